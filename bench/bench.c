@@ -0,0 +1,222 @@
+// Microbenchmark runner: ./bin/zbid_bench [-f FILTER] [-o RESULTS.csv] [-b BASELINE.csv] [-c LABEL]
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define read_cycles() __rdtsc()
+#else
+#define read_cycles() 0
+#endif
+
+#define USAGE_MSG "./bin/zbid_bench [-h] [-f FILTER] [-o RESULTS] [-b BASELINE] [-c LABEL]\n\n\
+-h				Displays this help menu, and returns EXIT_SUCCESS\n\
+-f FILTER			Only run benchmarks whose suite/name contains FILTER\n\
+-o RESULTS			Append results as CSV (label,suite,name,param,ns_op,cycles_op,allocs_op,n)\n\
+-b BASELINE			CSV from an earlier run; prints the ns/op change against it\n\
+-c LABEL			Label for the CSV rows, e.g. the commit id\n"
+
+#define MAX_BASELINE 1024
+
+/*
+ * Allocation counting: the benchmark binary interposes the libc allocator
+ * entry points and forwards to the glibc implementations.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_ulong alloc_count;
+
+void *malloc(size_t size) {
+	atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+uint64_t bench_allocs() {
+	return atomic_load_explicit(&alloc_count, memory_order_relaxed);
+}
+
+uint64_t bench_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_start(bench_t *b) {
+	b->timing = 1;
+	b->start_allocs = bench_allocs();
+	b->start_cycles = read_cycles();
+	b->start_ns = bench_now_ns();
+}
+
+void bench_stop(bench_t *b) {
+	if (!b->timing) return;
+	b->elapsed_ns = bench_now_ns() - b->start_ns;
+	b->elapsed_cycles = read_cycles() - b->start_cycles;
+	b->elapsed_allocs = bench_allocs() - b->start_allocs;
+	b->timing = 0;
+}
+
+static void run_once(bench_def_t *def, bench_t *b, long n) {
+	b->n = n;
+	b->arg = def->arg;
+	bench_start(b);
+	def->fn(b);
+	bench_stop(b);
+}
+
+static int cmp_double(const void *l, const void *r) {
+	double a = *(const double *)l, b = *(const double *)r;
+	return (a > b) - (a < b);
+}
+
+typedef struct {
+	char key[256];
+	double ns_op;
+} baseline_t;
+
+static baseline_t baseline[MAX_BASELINE];
+static int num_baseline;
+
+static void load_baseline(char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), fp) && num_baseline < MAX_BASELINE) {
+		char label[128], suite[64], name[64], param[64];
+		double ns;
+		if (sscanf(line, "%127[^,],%63[^,],%63[^,],%63[^,],%lf", label, suite, name, param, &ns) != 5) continue;
+		// Later rows (newer runs appended to the same file) win
+		snprintf(baseline[num_baseline].key, sizeof(baseline[0].key), "%s/%s/%s", suite, name, param);
+		baseline[num_baseline++].ns_op = ns;
+	}
+	fclose(fp);
+}
+
+static double baseline_for(bench_def_t *def) {
+	char key[256];
+	int i;
+	snprintf(key, sizeof(key), "%s/%s/%s", def->suite, def->name, def->param);
+	for (i = num_baseline - 1; i >= 0; i--) {
+		if (!strcmp(baseline[i].key, key)) return baseline[i].ns_op;
+	}
+	return 0;
+}
+
+static void run_bench(bench_def_t *def, FILE *out, char *label) {
+	bench_t b;
+	memset(&b, 0, sizeof(b));
+
+	// Warmup, then grow n until one run is long enough to time reliably
+	long n = 1;
+	run_once(def, &b, n);
+	while (b.elapsed_ns < BENCH_MIN_NS && n < (1L << 30)) {
+		long next = (b.elapsed_ns > 0) ? (long)(n * 1.2 * BENCH_MIN_NS / b.elapsed_ns) : n * 100;
+		if (next > n * 100) next = n * 100;
+		if (next <= n) next = n + 1;
+		n = next;
+		run_once(def, &b, n);
+	}
+
+	double ns[BENCH_RUNS], cycles[BENCH_RUNS], allocs[BENCH_RUNS];
+	int r;
+	for (r = 0; r < BENCH_RUNS; r++) {
+		run_once(def, &b, n);
+		ns[r] = (double)b.elapsed_ns / n;
+		cycles[r] = (double)b.elapsed_cycles / n;
+		allocs[r] = (double)b.elapsed_allocs / n;
+	}
+	qsort(ns, BENCH_RUNS, sizeof(double), cmp_double);
+	qsort(cycles, BENCH_RUNS, sizeof(double), cmp_double);
+	qsort(allocs, BENCH_RUNS, sizeof(double), cmp_double);
+	double med_ns = ns[BENCH_RUNS / 2];
+	double med_cycles = cycles[BENCH_RUNS / 2];
+	double med_allocs = allocs[BENCH_RUNS / 2];
+
+	char full[128];
+	snprintf(full, sizeof(full), "%s/%s/%s", def->suite, def->name, def->param);
+	printf("%-40s %12.1f %12.1f %10.2f %10ld", full, med_ns, med_cycles, med_allocs, n);
+	double base = baseline_for(def);
+	if (base > 0) printf(" %+8.1f%%", (med_ns - base) * 100.0 / base);
+	printf("\n");
+	fflush(stdout);
+
+	if (out) {
+		fprintf(out, "%s,%s,%s,%s,%.2f,%.2f,%.3f,%ld\n", label, def->suite, def->name, def->param,
+		        med_ns, med_cycles, med_allocs, n);
+		fflush(out);
+	}
+}
+
+static int matches(bench_def_t *def, char *filter) {
+	if (!filter) return 1;
+	char full[128];
+	snprintf(full, sizeof(full), "%s/%s/%s", def->suite, def->name, def->param);
+	return strstr(full, filter) != NULL;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	char *filter = NULL, *label = "local";
+	FILE *out = NULL;
+
+	while ((opt = getopt(argc, argv, "hf:o:b:c:")) != -1) {
+		switch (opt) {
+			case 'h':
+				fprintf(stdout, USAGE_MSG);
+				return EXIT_SUCCESS;
+			case 'f':
+				filter = optarg;
+				break;
+			case 'o':
+				out = fopen(optarg, "a");
+				if (!out) {
+					perror(optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'b':
+				load_baseline(optarg);
+				break;
+			case 'c':
+				label = optarg;
+				break;
+			default:
+				fprintf(stderr, USAGE_MSG);
+				return EXIT_FAILURE;
+		}
+	}
+
+	bench_def_t *suites[] = { list_benches, sbuf_benches, wire_benches, lookup_benches, bid_benches, tick_benches, NULL };
+	int s, i;
+
+	printf("%-40s %12s %12s %10s %10s%s\n", "BENCHMARK", "NS/OP", "CYCLES/OP", "ALLOCS/OP", "N",
+	       num_baseline ? "   CHANGE" : "");
+	for (s = 0; suites[s]; s++) {
+		for (i = 0; suites[s][i].fn; i++) {
+			if (matches(&suites[s][i], filter)) run_bench(&suites[s][i], out, label);
+		}
+	}
+
+	if (out) fclose(out);
+	return EXIT_SUCCESS;
+}
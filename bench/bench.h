@@ -0,0 +1,57 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Microbenchmark harness for the server modules.
+ *
+ * A benchmark is a function that performs b->n operations. The harness runs
+ * it once as warmup, grows n until a run takes at least BENCH_MIN_NS, then
+ * repeats the run BENCH_RUNS times and reports the median ns/op, cycles/op
+ * and heap allocations/op. Setup work can be excluded by calling
+ * bench_start() once it is done, teardown by calling bench_stop() first.
+ */
+
+#define BENCH_MIN_NS 20000000ULL
+#define BENCH_RUNS 5
+
+typedef struct bench {
+	long n;          // operations to perform in this run
+	void *arg;       // parameter given at registration
+
+	// Filled in by the harness
+	uint64_t start_ns, elapsed_ns;
+	uint64_t start_cycles, elapsed_cycles;
+	uint64_t start_allocs, elapsed_allocs;
+	int timing;
+} bench_t;
+
+typedef void (*bench_fn)(bench_t *b);
+
+typedef struct {
+	const char *suite;
+	const char *name;
+	const char *param; // human readable form of arg
+	bench_fn fn;
+	void *arg;
+} bench_def_t;
+
+void bench_start(bench_t *b);
+void bench_stop(bench_t *b);
+
+uint64_t bench_now_ns();
+
+// Heap allocations (malloc/calloc/realloc) made by the process so far
+uint64_t bench_allocs();
+
+// Benchmark tables, one per suite file
+extern bench_def_t list_benches[];
+extern bench_def_t sbuf_benches[];
+extern bench_def_t wire_benches[];
+extern bench_def_t lookup_benches[];
+extern bench_def_t bid_benches[];
+extern bench_def_t tick_benches[];
+
+#endif /* BENCH_H */
@@ -0,0 +1,135 @@
+// Lock-free bid placement (topbid) under contention. Every run also checks
+// that the accepted bids form one chain: each CAS replaced the value the
+// previous accepted bid left, with a higher amount, and the last one is what
+// the word holds.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "bench.h"
+#include "topbid.h"
+#include "protocol.h"
+
+typedef struct {
+	int threads;
+	int bidders; // distinct user ids taking turns
+} bid_cfg_t;
+
+// One accepted bid: the word it replaced and the word it left
+typedef struct {
+	uint64_t prev, next;
+} step_t;
+
+typedef struct {
+	topbid_t *top;
+	int index, bidders;
+	long count;
+	step_t *steps;
+	long retries;
+} bidder_arg_t;
+
+static void *bidder(void *arg) {
+	bidder_arg_t *w = (bidder_arg_t *)arg;
+	unsigned int seed = w->index;
+	long i;
+	for (i = 0; i < w->count; i++) {
+		uint32_t uid = (w->index + i * 7919) % w->bidders + 1;
+		uint64_t cur = atomic_load(w->top);
+		while (1) {
+			uint64_t prev = cur;
+			unsigned long bid = topbid_bid(cur) + 1 + rand_r(&seed) % 4;
+			if (topbid_check(cur, bid)) abort();
+			if (topbid_cas(w->top, &cur, uid, bid, 0) == OK) {
+				w->steps[i].prev = prev;
+				w->steps[i].next = topbid_pack(bid, uid);
+				break;
+			}
+			w->retries++;
+		}
+	}
+	return NULL;
+}
+
+static int step_cmp(const void *left, const void *right) {
+	unsigned long l = topbid_bid(((step_t *)left)->next), r = topbid_bid(((step_t *)right)->next);
+	return (l > r) - (l < r);
+}
+
+static void verify(uint64_t final, step_t *steps, long n) {
+	qsort(steps, n, sizeof(step_t), step_cmp);
+	uint64_t expect = 0;
+	long i;
+	for (i = 0; i < n; i++) {
+		if (steps[i].prev != expect || topbid_bid(steps[i].next) <= topbid_bid(steps[i].prev)) {
+			fprintf(stderr, "bid chain broken at step %ld: %#lx -> %#lx, expected from %#lx\n", i,
+			        steps[i].prev, steps[i].next, expect);
+			exit(EXIT_FAILURE);
+		}
+		expect = steps[i].next;
+	}
+	if (final != expect) {
+		fprintf(stderr, "lost bid: word holds %#lx, last accepted %#lx\n", final, expect);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* One op is one bid placed, however many CAS attempts it took */
+static void bench_bid(bench_t *b) {
+	bid_cfg_t *cfg = (bid_cfg_t *)b->arg;
+	pthread_t tids[cfg->threads];
+	bidder_arg_t args[cfg->threads];
+	topbid_t top;
+	atomic_init(&top, 0);
+	int i;
+
+	step_t *steps = malloc(b->n * sizeof(step_t));
+	long first = 0;
+	for (i = 0; i < cfg->threads; i++) {
+		args[i].top = &top;
+		args[i].index = i;
+		args[i].bidders = cfg->bidders;
+		args[i].count = b->n / cfg->threads + (i < b->n % cfg->threads);
+		args[i].steps = steps + first;
+		args[i].retries = 0;
+		first += args[i].count;
+	}
+
+	bench_start(b);
+	for (i = 0; i < cfg->threads; i++) pthread_create(&tids[i], NULL, bidder, &args[i]);
+	for (i = 0; i < cfg->threads; i++) pthread_join(tids[i], NULL);
+	bench_stop(b);
+
+	verify(atomic_load(&top), steps, b->n);
+	free(steps);
+}
+
+/* A bid at the buy-it-now price closes the word: exactly one closer, and no
+ * bid is accepted after it */
+static void bench_bid_close(bench_t *b) {
+	topbid_t top;
+	long i;
+
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		atomic_init(&top, 0);
+		uint64_t cur = 0;
+		if (topbid_cas(&top, &cur, 1, 5, 10) != OK) abort();
+		cur = atomic_load(&top);
+		if (topbid_cas(&top, &cur, 2, 10, 10) != ANCLOSED) abort();
+		cur = atomic_load(&top);
+		if (topbid_check(cur, 11) != EANNOTFOUND || topbid_close(&top)) abort();
+	}
+	bench_stop(b);
+}
+
+static bid_cfg_t cfg_1t = { 1, 4096 };
+static bid_cfg_t cfg_4t = { 4, 4096 };
+static bid_cfg_t cfg_16t = { 16, 4096 };
+
+bench_def_t bid_benches[] = {
+	{ "bid", "place", "1t_4096u", bench_bid, &cfg_1t },
+	{ "bid", "place", "4t_4096u", bench_bid, &cfg_4t },
+	{ "bid", "place", "16t_4096u", bench_bid, &cfg_16t },
+	{ "bid", "close", "bin", bench_bid_close, NULL },
+	{ NULL }
+};
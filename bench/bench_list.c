@@ -0,0 +1,76 @@
+// linkedlist.c operations at the list sizes the server sees
+
+#include "bench.h"
+#include "linkedlist.h"
+
+static list_t *make_list(long size) {
+	list_t *list = init(NULL, NULL);
+	long i;
+	for (i = 0; i < size; i++) insertFront(list, (void *)i);
+	return list;
+}
+
+/* insertRear walks the whole list; the removeFront keeps the size constant */
+static void bench_insert_rear(bench_t *b) {
+	list_t *list = make_list((long)b->arg);
+	long i;
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		insertRear(list, (void *)i);
+		removeFront(list);
+	}
+	bench_stop(b);
+	deleteList(list);
+}
+
+static void bench_insert_front(bench_t *b) {
+	list_t *list = make_list((long)b->arg);
+	long i;
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		insertFront(list, (void *)i);
+		removeFront(list);
+	}
+	bench_stop(b);
+	deleteList(list);
+}
+
+static void bench_get_element(bench_t *b) {
+	long size = (long)b->arg;
+	list_t *list = make_list(size);
+	volatile long sink = 0;
+	unsigned int x = 12345;
+	long i;
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		sink += (long)getElement(list, x % size);
+	}
+	bench_stop(b);
+	deleteList(list);
+}
+
+/* Cost per element of building a list with insertRear and freeing it */
+static void bench_build_rear(bench_t *b) {
+	long size = (long)b->arg;
+	long i, done = 0;
+	bench_start(b);
+	while (done < b->n) {
+		list_t *list = init(NULL, NULL);
+		for (i = 0; i < size && done < b->n; i++, done++) insertRear(list, (void *)i);
+		deleteList(list);
+	}
+	bench_stop(b);
+}
+
+bench_def_t list_benches[] = {
+	{ "list", "insertRear", "n=16", bench_insert_rear, (void *)16 },
+	{ "list", "insertRear", "n=1024", bench_insert_rear, (void *)1024 },
+	{ "list", "insertRear", "n=65536", bench_insert_rear, (void *)65536 },
+	{ "list", "insertFront", "n=1024", bench_insert_front, (void *)1024 },
+	{ "list", "getElement", "n=16", bench_get_element, (void *)16 },
+	{ "list", "getElement", "n=1024", bench_get_element, (void *)1024 },
+	{ "list", "getElement", "n=65536", bench_get_element, (void *)65536 },
+	{ "list", "buildRear", "n=1024", bench_build_rear, (void *)1024 },
+	{ NULL }
+};
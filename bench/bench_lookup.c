@@ -0,0 +1,73 @@
+// Auction lookup by id and user lookup by name, as done by every job
+
+#include <stdio.h>
+#include "bench.h"
+#include "helpers.h"
+
+static list_t *make_auctions(long size) {
+	list_t *auctions = init(auction_cmp, free_auction);
+	long i;
+	for (i = size; i > 0; i--) {
+		auction_t *a = new_auction("bench item", "ZBid Server", 10, 0);
+		a->id = i;
+		insertFront(auctions, a);
+	}
+	return auctions;
+}
+
+static list_t *make_users(long size) {
+	list_t *users = init(NULL, free_user);
+	char name[32];
+	long i;
+	for (i = 0; i < size; i++) {
+		user_t *u = calloc(1, sizeof(user_t));
+		sprintf(name, "user%ld", i);
+		u->username = strdup(name);
+		u->password = strdup("pw");
+		insertFront(users, u);
+	}
+	return users;
+}
+
+static void bench_auction_lookup(bench_t *b) {
+	long size = (long)b->arg;
+	list_t *auctions = make_auctions(size);
+	volatile long sink = 0;
+	unsigned int x = 12345;
+	long i;
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		sink += (long)auction_lookup(auctions, 1 + x % size);
+	}
+	bench_stop(b);
+	deleteList(auctions);
+}
+
+static void bench_user_lookup(bench_t *b) {
+	long size = (long)b->arg;
+	list_t *users = make_users(size);
+	char (*names)[32] = malloc(size * sizeof(*names));
+	volatile long sink = 0;
+	unsigned int x = 12345;
+	long i;
+	for (i = 0; i < size; i++) sprintf(names[i], "user%ld", i);
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		sink += (long)user_lookup(users, names[x % size]);
+	}
+	bench_stop(b);
+	free(names);
+	deleteList(users);
+}
+
+bench_def_t lookup_benches[] = {
+	{ "lookup", "auction", "n=16", bench_auction_lookup, (void *)16 },
+	{ "lookup", "auction", "n=1024", bench_auction_lookup, (void *)1024 },
+	{ "lookup", "auction", "n=65536", bench_auction_lookup, (void *)65536 },
+	{ "lookup", "user", "n=16", bench_user_lookup, (void *)16 },
+	{ "lookup", "user", "n=1024", bench_user_lookup, (void *)1024 },
+	{ "lookup", "user", "n=65536", bench_user_lookup, (void *)65536 },
+	{ NULL }
+};
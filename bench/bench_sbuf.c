@@ -0,0 +1,69 @@
+// Job queue (sbuf) throughput with several producers and consumers
+
+#include <pthread.h>
+#include "bench.h"
+#include "sbuf.h"
+
+typedef struct {
+	int producers;
+	int consumers;
+	int capacity;
+} sbuf_cfg_t;
+
+typedef struct {
+	sbuf_t *sp;
+	long count;
+} worker_arg_t;
+
+static void *producer(void *arg) {
+	worker_arg_t *w = (worker_arg_t *)arg;
+	long i;
+	for (i = 0; i < w->count; i++) sbuf_insert(w->sp, (void *)(i + 1));
+	return NULL;
+}
+
+static void *consumer(void *arg) {
+	worker_arg_t *w = (worker_arg_t *)arg;
+	long i;
+	for (i = 0; i < w->count; i++) sbuf_remove(w->sp);
+	return NULL;
+}
+
+/* One op is one job passing through the queue */
+static void bench_sbuf(bench_t *b) {
+	sbuf_cfg_t *cfg = (sbuf_cfg_t *)b->arg;
+	int nthreads = cfg->producers + cfg->consumers;
+	pthread_t tids[nthreads];
+	worker_arg_t args[nthreads];
+	int i;
+
+	sbuf_t *sp = malloc(sizeof(sbuf_t));
+	sbuf_init(sp, cfg->capacity);
+
+	bench_start(b);
+	for (i = 0; i < nthreads; i++) {
+		int producing = i < cfg->producers;
+		int idx = producing ? i : i - cfg->producers;
+		int k = producing ? cfg->producers : cfg->consumers;
+		args[i].sp = sp;
+		args[i].count = b->n / k + (idx < b->n % k);
+		pthread_create(&tids[i], NULL, producing ? producer : consumer, &args[i]);
+	}
+	for (i = 0; i < nthreads; i++) pthread_join(tids[i], NULL);
+	bench_stop(b);
+
+	sbuf_deinit(sp);
+}
+
+static sbuf_cfg_t cfg_1p1c = { 1, 1, 2 };
+static sbuf_cfg_t cfg_4p2c = { 4, 2, 2 };
+static sbuf_cfg_t cfg_4p2c_big = { 4, 2, 1024 };
+static sbuf_cfg_t cfg_16p4c = { 16, 4, 4 };
+
+bench_def_t sbuf_benches[] = {
+	{ "sbuf", "insert_remove", "1p1c_cap2", bench_sbuf, &cfg_1p1c },
+	{ "sbuf", "insert_remove", "4p2c_cap2", bench_sbuf, &cfg_4p2c },
+	{ "sbuf", "insert_remove", "4p2c_cap1024", bench_sbuf, &cfg_4p2c_big },
+	{ "sbuf", "insert_remove", "16p4c_cap4", bench_sbuf, &cfg_16p4c },
+	{ NULL }
+};
@@ -0,0 +1,176 @@
+// The tick's count down over 1M auctions: the ticker's arrays with each
+// kernel, on one thread and split into partitions as the server runs it,
+// against walking the auction list as the tick used to. Every run checks
+// that each tick closed exactly the auctions whose duration ended.
+
+#include <stdio.h>
+#include <pthread.h>
+#include "bench.h"
+#include "helpers.h"
+#include "ticker.h"
+
+#define TICK_AUCTIONS (1 << 20)
+#define TICK_MAX_DURATION 4096
+
+typedef struct {
+	const char *impl; // ticker kernel, NULL for the list walk
+	int open_pct;     // auctions still open at the start
+	int parts;        // threads ticking a partition each
+} tick_cfg_t;
+
+// Duration of auction i, 0 if it starts closed
+static uint32_t duration(long i, int open_pct) {
+	uint32_t h = (uint32_t)i * 2654435761u;
+	if ((h >> 8) % 100 >= (uint32_t)open_pct) return 0;
+	return 1 + (h >> 16) % TICK_MAX_DURATION;
+}
+
+static long expected[TICK_MAX_DURATION + 1];
+
+static void count_expected(int open_pct) {
+	long i;
+	memset(expected, 0, sizeof(expected));
+	for (i = 0; i < TICK_AUCTIONS; i++) expected[duration(i, open_pct)]++;
+}
+
+static void check(long tick, long closed) {
+	long want = (tick <= TICK_MAX_DURATION) ? expected[tick] : 0;
+	if (closed != want) {
+		fprintf(stderr, "tick %ld closed %ld auctions, expected %ld\n", tick, closed, want);
+		exit(EXIT_FAILURE);
+	}
+}
+
+typedef struct {
+	ticker_t *t;
+	tick_cfg_t *cfg;
+	pthread_barrier_t *start, *done;
+	long ticks;
+	int part;
+	long closed; // by the last tick
+	int bad;     // set if a slot closed early
+} tick_part_t;
+
+// Ticks part, checking that every slot it closes ends its duration
+static void tick_one(tick_part_t *p, long tick, uint32_t **slots, int *cap) {
+	int k, n = ticker_tick(p->t, p->part, p->cfg->parts, slots, cap, NULL);
+	for (k = 0; k < n; k++) {
+		if (duration((long)ticker_owner(p->t, (*slots)[k]) - 1, p->cfg->open_pct) != tick) p->bad = 1;
+	}
+	p->closed = n;
+}
+
+static void *tick_worker(void *arg) {
+	tick_part_t *p = (tick_part_t *)arg;
+	uint32_t *slots = NULL;
+	int cap = 0;
+	long tick;
+	for (tick = 1; tick <= p->ticks; tick++) {
+		pthread_barrier_wait(p->start);
+		tick_one(p, tick, &slots, &cap);
+		pthread_barrier_wait(p->done);
+	}
+	free(slots);
+	return NULL;
+}
+
+/* One op is one tick over every auction, part 0 on this thread */
+static void bench_tick_ticker(bench_t *b) {
+	tick_cfg_t *cfg = (tick_cfg_t *)b->arg;
+	const char *prev = ticker_impl();
+	if (ticker_use(cfg->impl) < 0) {
+		fprintf(stderr, "%s not supported here, using %s\n", cfg->impl, ticker_impl());
+	}
+	ticker_t *t = malloc(sizeof(ticker_t));
+	ticker_init(t);
+	long i, tick;
+	for (i = 0; i < TICK_AUCTIONS; i++) ticker_add(t, (void *)(i + 1), duration(i, cfg->open_pct));
+	count_expected(cfg->open_pct);
+
+	pthread_barrier_t start, done;
+	pthread_barrier_init(&start, NULL, cfg->parts);
+	pthread_barrier_init(&done, NULL, cfg->parts);
+	tick_part_t *parts = calloc(cfg->parts, sizeof(tick_part_t));
+	pthread_t *threads = malloc(cfg->parts * sizeof(pthread_t));
+	for (i = 0; i < cfg->parts; i++) {
+		parts[i] = (tick_part_t){ t, cfg, &start, &done, b->n, i, 0, 0 };
+		if (i) pthread_create(&threads[i], NULL, tick_worker, &parts[i]);
+	}
+	uint32_t *slots = NULL;
+	int cap = 0;
+
+	bench_start(b);
+	for (tick = 1; tick <= b->n; tick++) {
+		if (cfg->parts > 1) pthread_barrier_wait(&start);
+		tick_one(&parts[0], tick, &slots, &cap);
+		if (cfg->parts > 1) pthread_barrier_wait(&done);
+
+		long closed = 0;
+		for (i = 0; i < cfg->parts; i++) {
+			if (parts[i].bad) {
+				fprintf(stderr, "tick %ld closed a slot of partition %ld early\n", tick, i);
+				exit(EXIT_FAILURE);
+			}
+			closed += parts[i].closed;
+		}
+		check(tick, closed);
+	}
+	bench_stop(b);
+
+	for (i = 1; i < cfg->parts; i++) pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&start);
+	pthread_barrier_destroy(&done);
+	free(threads);
+	free(parts);
+	free(slots);
+	ticker_free(t);
+	free(t);
+	ticker_use(prev);
+}
+
+/* The tick before the ticker: every list node and auction is visited */
+static void bench_tick_list(bench_t *b) {
+	tick_cfg_t *cfg = (tick_cfg_t *)b->arg;
+	list_t *auctions = init(auction_cmp, free_auction);
+	long i, tick;
+	for (i = TICK_AUCTIONS - 1; i >= 0; i--) {
+		auction_t *a = new_auction("bench item", "ZBid Server", duration(i, cfg->open_pct), 0);
+		a->id = i + 1;
+		insertFront(auctions, a);
+	}
+	count_expected(cfg->open_pct);
+
+	bench_start(b);
+	for (tick = 1; tick <= b->n; tick++) {
+		long closed = 0;
+		node_t *cur = auctions->head;
+		while (cur) {
+			auction_t *auction = (auction_t *)cur->data;
+			if (auction->rticks && --auction->rticks == 0) closed++;
+			cur = cur->next;
+		}
+		check(tick, closed);
+	}
+	bench_stop(b);
+
+	deleteList(auctions);
+}
+
+static tick_cfg_t cfg_list = { NULL, 100, 1 };
+static tick_cfg_t cfg_scalar = { "scalar", 100, 1 };
+static tick_cfg_t cfg_sse2 = { "sse2", 100, 1 };
+static tick_cfg_t cfg_avx2 = { "avx2", 100, 1 };
+static tick_cfg_t cfg_avx2_sparse = { "avx2", 1, 1 };
+static tick_cfg_t cfg_scalar_4 = { "scalar", 100, 4 };
+static tick_cfg_t cfg_avx2_4 = { "avx2", 100, 4 };
+
+bench_def_t tick_benches[] = {
+	{ "tick", "list", "1M_open", bench_tick_list, &cfg_list },
+	{ "tick", "ticker", "scalar_1M_open", bench_tick_ticker, &cfg_scalar },
+	{ "tick", "ticker", "sse2_1M_open", bench_tick_ticker, &cfg_sse2 },
+	{ "tick", "ticker", "avx2_1M_open", bench_tick_ticker, &cfg_avx2 },
+	{ "tick", "ticker", "avx2_1M_1pct_open", bench_tick_ticker, &cfg_avx2_sparse },
+	{ "tick", "ticker", "scalar_1M_open_4_parts", bench_tick_ticker, &cfg_scalar_4 },
+	{ "tick", "ticker", "avx2_1M_open_4_parts", bench_tick_ticker, &cfg_avx2_4 },
+	{ NULL }
+};
@@ -0,0 +1,182 @@
+// Encode/decode cost of the PETR v1 (text) and v2 (binary) message bodies
+
+#include <stdio.h>
+#include "bench.h"
+#include "wire.h"
+#include "protocol.h"
+
+#define MAX_ROWS 1000
+
+typedef struct {
+	int version;
+	int rows;
+} wire_cfg_t;
+
+static auction_t *auctions;
+
+static void make_auctions() {
+	int i;
+	char name[64];
+	if (auctions) return;
+	auctions = calloc(MAX_ROWS, sizeof(auction_t));
+	for (i = 0; i < MAX_ROWS; i++) {
+		sprintf(name, "Auction item number %d", i);
+		auctions[i].item_name = strdup(name);
+		auctions[i].id = i + 1;
+		auctions[i].creater = strdup("ZBid Server");
+		auctions[i].highest_bidder = (i % 2) ? strdup("some_bidder") : NULL;
+		auctions[i].bin = 100000 + i;
+		auctions[i].bid = (i % 2) ? 5000 + i : 0;
+		auctions[i].rticks = 1 + i % 50;
+	}
+}
+
+static void encode_anlist(wbuf_t *b, int version, int rows) {
+	int i;
+	wbuf_reset(b);
+	wire_rows_begin(b, version);
+	for (i = 0; i < rows; i++) wire_anlist_row(b, version, &auctions[i], auctions[i].rticks);
+	wire_rows_end(b, version, rows);
+}
+
+/* One op is a whole ANLIST body of cfg->rows rows */
+static void bench_anlist_encode(bench_t *b) {
+	wire_cfg_t *cfg = (wire_cfg_t *)b->arg;
+	wbuf_t w;
+	long it;
+	make_auctions();
+	wbuf_init(&w, 1024);
+	bench_start(b);
+	for (it = 0; it < b->n; it++) encode_anlist(&w, cfg->version, cfg->rows);
+	bench_stop(b);
+	wbuf_free(&w);
+}
+
+static void bench_anlist_decode(bench_t *b) {
+	wire_cfg_t *cfg = (wire_cfg_t *)b->arg;
+	volatile uint64_t sink = 0;
+	wbuf_t w;
+	long it;
+	make_auctions();
+	wbuf_init(&w, 1024);
+	encode_anlist(&w, cfg->version, cfg->rows);
+	bench_start(b);
+	for (it = 0; it < b->n; it++) {
+		rbuf_t r;
+		uint32_t count;
+		anlist_row_t row;
+		rbuf_init(&r, w.data, w.len);
+		wire_rows_start(&r, cfg->version, &count);
+		while (wire_anlist_next(&r, cfg->version, &row) == 0) sink += row.bid + row.id;
+	}
+	bench_stop(b);
+	wbuf_free(&w);
+}
+
+/* The pre-v2 text path: strjoin per row plus realloc/strcat per message */
+static void bench_anlist_legacy(bench_t *b) {
+	wire_cfg_t *cfg = (wire_cfg_t *)b->arg;
+	long it;
+	int i;
+	make_auctions();
+	bench_start(b);
+	for (it = 0; it < b->n; it++) {
+		char *msg = strdup("\0");
+		for (i = 0; i < cfg->rows; i++) {
+			auction_t *a = &auctions[i];
+			list_t *l = init(NULL, free);
+			char num_buf[128];
+			sprintf(num_buf, "%d", a->id);
+			insertRear(l, strdup(num_buf));
+			insertRear(l, strdup(a->item_name));
+			sprintf(num_buf, "%ld", a->bin);
+			insertRear(l, strdup(num_buf));
+			sprintf(num_buf, "%d", 0);
+			insertRear(l, strdup(num_buf));
+			sprintf(num_buf, "%ld", a->bid);
+			insertRear(l, strdup(num_buf));
+			sprintf(num_buf, "%d", a->rticks);
+			insertRear(l, strdup(num_buf));
+			char *m = strjoin(l, ";");
+			m = realloc(m, strlen(m) + 2);
+			m = strcat(m, "\n");
+			msg = realloc(msg, strlen(msg) + strlen(m) + 1);
+			msg = strcat(msg, m);
+			deleteList(l);
+			free(m);
+		}
+		free(msg);
+	}
+	bench_stop(b);
+}
+
+static void bench_anupdate_encode(bench_t *b) {
+	wire_cfg_t *cfg = (wire_cfg_t *)b->arg;
+	wbuf_t w;
+	long it;
+	wbuf_init(&w, 128);
+	bench_start(b);
+	for (it = 0; it < b->n; it++) {
+		wbuf_reset(&w);
+		wire_anupdate(&w, cfg->version, it, "Xbox controller", "some_bidder", 1000 + it);
+	}
+	bench_stop(b);
+	wbuf_free(&w);
+}
+
+static void bench_anupdate_decode(bench_t *b) {
+	wire_cfg_t *cfg = (wire_cfg_t *)b->arg;
+	volatile uint64_t sink = 0;
+	wbuf_t w;
+	long it;
+	wbuf_init(&w, 128);
+	wire_anupdate(&w, cfg->version, 42, "Xbox controller", "some_bidder", 1000);
+	bench_start(b);
+	for (it = 0; it < b->n; it++) {
+		rbuf_t r;
+		anupdate_t m;
+		rbuf_init(&r, w.data, w.len);
+		wire_anupdate_decode(&r, cfg->version, &m);
+		sink += m.bid;
+	}
+	bench_stop(b);
+	wbuf_free(&w);
+}
+
+static void bench_anclosed_encode(bench_t *b) {
+	wire_cfg_t *cfg = (wire_cfg_t *)b->arg;
+	wbuf_t w;
+	long it;
+	wbuf_init(&w, 128);
+	bench_start(b);
+	for (it = 0; it < b->n; it++) {
+		wbuf_reset(&w);
+		wire_anclosed(&w, cfg->version, it, "some_bidder", 1000 + it);
+	}
+	bench_stop(b);
+	wbuf_free(&w);
+}
+
+static wire_cfg_t v1_msg = { PETR_V1, 1 };
+static wire_cfg_t v2_msg = { PETR_V2, 1 };
+static wire_cfg_t v1_100 = { PETR_V1, 100 };
+static wire_cfg_t v2_100 = { PETR_V2, 100 };
+static wire_cfg_t v1_1000 = { PETR_V1, 1000 };
+static wire_cfg_t v2_1000 = { PETR_V2, 1000 };
+
+bench_def_t wire_benches[] = {
+	{ "wire", "anlist_encode_legacy", "v1_rows=100", bench_anlist_legacy, &v1_100 },
+	{ "wire", "anlist_encode", "v1_rows=100", bench_anlist_encode, &v1_100 },
+	{ "wire", "anlist_encode", "v2_rows=100", bench_anlist_encode, &v2_100 },
+	{ "wire", "anlist_encode", "v1_rows=1000", bench_anlist_encode, &v1_1000 },
+	{ "wire", "anlist_encode", "v2_rows=1000", bench_anlist_encode, &v2_1000 },
+	{ "wire", "anlist_decode", "v1_rows=1000", bench_anlist_decode, &v1_1000 },
+	{ "wire", "anlist_decode", "v2_rows=1000", bench_anlist_decode, &v2_1000 },
+	{ "wire", "anupdate_encode", "v1", bench_anupdate_encode, &v1_msg },
+	{ "wire", "anupdate_encode", "v2", bench_anupdate_encode, &v2_msg },
+	{ "wire", "anupdate_decode", "v1", bench_anupdate_decode, &v1_msg },
+	{ "wire", "anupdate_decode", "v2", bench_anupdate_decode, &v2_msg },
+	{ "wire", "anclosed_encode", "v1", bench_anclosed_encode, &v1_msg },
+	{ "wire", "anclosed_encode", "v2", bench_anclosed_encode, &v2_msg },
+	{ NULL }
+};
@@ -0,0 +1,35 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/*
+ * CPU and NUMA placement of the server threads.
+ *
+ * -J and -I give the CPUs of the job threads and of the I/O threads (the
+ * main accept loop and every thread it starts: client, tick, admin,
+ * replication and shard threads). Job thread k is pinned to the k-th CPU of
+ * its list, round robin, so it keeps its caches warm; I/O threads mostly
+ * block on sockets and may run on any CPU of theirs.
+ *
+ * A pinned thread prefers memory from the NUMA node of its CPUs, so what it
+ * allocates afterwards (its local job list, reply buffers, metrics slot) is
+ * node local. The node is read from sysfs, there is no libnuma dependency.
+ */
+
+enum thread_class {
+	THREAD_JOB,
+	THREAD_IO,
+};
+
+// Parses a CPU list like "0-3,8" for the class. Returns 0 on success, -1 if
+// it is malformed or names a CPU this process may not run on.
+int affinity_parse(int class, char *spec);
+
+// Pins the calling thread as configured for its class (a no-op if no list
+// was given); index picks the CPU of a job thread. A named thread reports
+// where it was placed on stdout.
+void affinity_place(int class, int index, const char *name);
+
+// NUMA node of cpu, -1 if unknown
+int cpu_node(int cpu);
+
+#endif /* AFFINITY_H */
@@ -0,0 +1,60 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ * Traffic capture (-C FILE).
+ *
+ * Every frame clients send is appended to FILE with its arrival time and a
+ * connection id, so the traffic can be replayed against a test server later
+ * (bin/zbid_replay). The file starts with the 8 bytes of CAPTURE_MAGIC and
+ * a u64 wall clock start time in nanoseconds, followed by records of a
+ * capture_rec_t and len body bytes (host byte order):
+ *
+ *   CAP_LOGIN   the LOGIN body that opened connection conn
+ *   CAP_RESUME  the RESUME body that opened connection conn instead
+ *   CAP_FRAME   one request of the client logged in on conn
+ *   CAP_CLOSE   the client went away (no body)
+ *
+ * Records go through one buffered stream under a lock, flushed every
+ * CAPTURE_FLUSH_MS and at shutdown. LOGIN and RESUME bodies hold passwords
+ * and session tokens: captures are as sensitive as the user database.
+ */
+
+#define CAPTURE_MAGIC "ZBCAP001"
+#define CAPTURE_FLUSH_MS 100
+
+enum capture_kind {
+	CAP_LOGIN = 1,
+	CAP_FRAME,
+	CAP_CLOSE,
+	CAP_RESUME,
+};
+
+typedef struct {
+	uint64_t ns; // since the capture started
+	uint32_t conn;
+	uint32_t len;
+	uint8_t kind;
+	uint8_t type; // msg_type of the frame
+	uint16_t reserved;
+	uint32_t reserved2;
+} capture_rec_t;
+
+// Starts capturing to path. Returns 0, or -1 if the file cannot be created.
+int capture_open(const char *path);
+
+// Records a LOGIN and returns the id of its connection, 0 while not capturing
+uint32_t capture_login(const char *body, uint32_t len);
+// Likewise for a RESUME, which opens a new connection too
+uint32_t capture_resume(const char *body, uint32_t len);
+// Records a frame of, or the end of, connection conn (ignored if conn is 0)
+void capture_frame(uint32_t conn, petr_header *ph, const char *body);
+void capture_close(uint32_t conn);
+
+// At shutdown, once no other thread writes
+void capture_flush();
+
+#endif /* CAPTURE_H */
@@ -1,44 +1,117 @@
+#ifndef HELPERS_H
+#define HELPERS_H
+
 #include "linkedlist.h"
 #include <string.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "trace.h"
+#include "rcu.h"
+#include "topbid.h"
+
+// Job type of a partition of the tick (see run_tick), not a PETR message
+#define JOB_TICK 0xf0
 
 typedef struct {
 	int type;
 	unsigned int client_fd;
+	int proto; // PETR wire version of the requesting client
 	char *username;
+	struct user *user; // requesting user, NULL for jobs raised by the server
 	list_t *args; // linkedlist representing the message sent by the client
+	uint64_t enqueued_ns; // metrics_now() when the job was queued
+	trace_t *trace; // set while tracing is on, owned by trace.c
+	int peer_fd; // shard connection the reply goes to, -1 for local requests
 } job_t;
 
 typedef struct user {
 	char *username;
 	char *password;
 	unsigned int fd;
-	int balance;
+	_Atomic int64_t balance; // changed only by settle.c
+	_Atomic int64_t committed; // sum of this user's leading bids on open auctions
+	int proto; // PETR wire version negotiated at LOGIN
 	sig_atomic_t is_online;
+	int shard; // home shard if this is a proxy for a remote user, else -1
+	uint32_t id; // names the user in auction_t.top, see user_register
+	atomic_int watches_queued; // ANWATCH/ANLEAVE jobs queued and not yet run
+	list_t *watching; // auctions with this user in users_watching, one per slot
+	struct session *session; // see session.h, NULL until its first LOGIN
 } user_t;
 
 typedef struct auction {
 	char *item_name;
 	unsigned int id;
 	char *creater;
-	char *highest_bidder;
+	char *highest_bidder; // views only, see top
 	unsigned long bin;
-	unsigned long bid;
-	unsigned int rticks;
+	unsigned long bid; // views only, see top
+	unsigned int rticks; // duration, 0 once closed; the count down is in the ticker
+	int slot; // in the ticker, see ticker.h
 	user_t *users_watching[5];
+	// Leading bid and bidder of the live auction (see topbid.h); the leader
+	// holds the bid as committed funds
+	topbid_t top;
+	// Bids between their CAS and their replication event, waited out by
+	// close_auctions before settling
+	atomic_int placing;
+	_Atomic(struct proxy_book *) proxies; // see proxy.h, NULL until an ANPROXY
+	// Immutable copy read by lock-free queries, replaced by auction_publish
+	_Atomic(struct auction *) view;
 } auction_t;
 
+// One (auction, amount) pair of an ANBIDBATCH request
+typedef struct {
+	unsigned int auction_id;
+	unsigned long amount;
+	int index; // position in the request, results are returned in this order
+} bid_req_t;
+
+auction_t* new_auction(char *item_name, char *creater, unsigned int rticks, unsigned long bin);
+
+// Parts of an auction's view refreshed by auction_publish
+#define VIEW_BID 0x1 // bid and highest_bidder
+#define VIEW_RTICKS 0x2
+#define VIEW_WATCHERS 0x4
+#define VIEW_ALL (VIEW_BID | VIEW_RTICKS | VIEW_WATCHERS)
+
+// Publishes a new view of the auction: the fields selected are copied from
+// the live auction (the caller holds whatever protects them), the others
+// from the current view. The old view is freed through rcu_retire.
+void auction_publish(auction_t *a, int fields);
+void free_auction_view(void *view);
+
 void free_user(void *user);
 
+// Gives user the next user id, for users and proxies alike; ids are never
+// reused. Returns -1 once TOPBID_MAX_UID ids are given out: a larger one
+// would not fit auction_t.top. user_by_id returns NULL for 0 (no leader).
+void user_ids_init();
+int user_register(user_t *user);
+user_t *user_by_id(uint32_t id);
+
 void free_auction(void *auction);
 
 void free_job(void *job);
 
+// Unlocked list scans, callers hold the respective read lock
+auction_t* auction_lookup(list_t *auctions, unsigned int id);
+user_t* user_lookup(list_t *users, char *username);
+
 int auction_cmp(void *left, void *right);
 
+int bid_req_cmp(const void *left, const void *right);
+
 char* strjoin(list_t *args, char *delim);
 
 list_t* strsplit(char *str, char *delim);
 
 int isWatching(user_t *users_watching[], user_t *user);
+
+// Protocol name of a message type, e.g. "ANBID"; "UNKNOWN" if not a PETR type
+const char* msg_name(int type);
+
+#endif /* HELPERS_H */
@@ -0,0 +1,35 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear (HDR style) histogram of non-negative integer samples, usually
+ * latencies in nanoseconds. Values below 2^HIST_SUB_BITS are exact; above
+ * that every power of two is split into 2^(HIST_SUB_BITS-1) buckets, giving
+ * ~3% relative precision up to 2^HIST_MAX_BITS (values above are clamped).
+ *
+ * Recording is not thread safe; keep one histogram per thread and merge
+ * them when reading.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 3) << (HIST_SUB_BITS - 1))
+
+typedef struct {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t max;
+} histogram_t;
+
+void hist_init(histogram_t *h);
+void hist_record(histogram_t *h, uint64_t value);
+void hist_merge(histogram_t *dst, histogram_t *src);
+
+// Highest value equivalent to the p-th percentile (0 < p <= 100)
+uint64_t hist_percentile(histogram_t *h, double p);
+uint64_t hist_mean(histogram_t *h);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,89 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "histogram.h"
+#include "trace.h"
+
+/*
+ * Server metrics registry.
+ *
+ * Every thread records into its own slot (claimed on first use, released by
+ * metrics_release() when the thread exits and reused by the next thread), so
+ * the hot path never takes a lock or bounces a shared cache line. Readers sum
+ * the slots on demand; histograms are read without synchronization, so a
+ * dump may miss samples recorded while it runs.
+ *
+ * Gauges are process wide and updated atomically.
+ */
+
+#define METRICS_MAX_SLOTS 512
+
+enum metric_counter {
+	M_LOGINS,          // accepted LOGINs
+	M_LOGINS_REFUSED,  // EUSRLGDIN / EWRNGPWD
+	M_FRAMES_IN,       // messages read by client threads
+	M_BYTES_IN,        // including the PETR header
+	M_FRAMES_OVERSIZE, // over PETR_MAX_MSG_LEN, the input limit or (first frame) 1023 bytes, the client was dropped
+	M_BIDS_ACCEPTED,
+	M_BIDS_REJECTED,
+	M_UPDATES_SENT,    // ANUPDATE/ANCLOSED pushed to watchers
+	M_TICKS,
+	M_AUCTIONS_CLOSED,
+	M_SHARD_HANDOFFS,  // LOGINs passed to the user's home shard
+	M_SHARD_FORWARDED, // requests sent to another shard
+	M_SHARD_SERVED,    // requests run for another shard
+	M_REPL_EVENTS,     // state changes logged for the replica
+	M_POOL_GROWN,      // job threads started by the pool thread
+	M_POOL_SHRUNK,     // idle job threads that exited
+	M_RATE_LIMITED,    // requests delayed by their connection's rate limit
+	M_SHED,            // requests refused while over the queue wait target
+	M_URING_ENTERS,    // io_uring_enter calls of the I/O thread
+	M_URING_WAKEUPS,   // eventfd writes waking the I/O thread
+	M_BID_RETRIES,     // bid CAS attempts lost to a concurrent bid
+	M_BIDS_EARLY,      // rejected bids answered without being queued
+	M_PROXY_BIDS,      // bids placed by proxies (ANPROXY)
+	M_RESUMES,         // sessions taken over by RESUME
+	M_RESUMES_REFUSED, // ETOKEN
+	M_SESSIONS_EXPIRED,
+	M_NUM_COUNTERS
+};
+
+// Latencies, in nanoseconds
+enum metric_hist {
+	H_ENQUEUE,     // client thread blocked in sbuf_insert
+	H_QUEUE_WAIT,  // job inserted until a job thread picked it up
+	H_JOB,         // job thread time per job, any type
+	H_BID,         // job thread time per ANBID
+	H_TICK,        // tick thread work per tick
+	// Request stages in trace.h order, only recorded while tracing is on
+	H_TRACE_FIRST,
+	H_TRACE_TOTAL = H_TRACE_FIRST + T_NUM_STAGES,
+	M_NUM_HISTS
+};
+
+enum metric_gauge {
+	G_CONNECTIONS, // client threads running
+	G_JOB_THREADS,
+	M_NUM_GAUGES
+};
+
+void metrics_init();
+
+// Monotonic clock in nanoseconds
+uint64_t metrics_now();
+
+void metrics_count(int counter, uint64_t n);
+void metrics_record(int hist, uint64_t ns);
+// Counts one job of the given message type and records its latency
+void metrics_job(int type, uint64_t ns);
+void metrics_gauge_add(int gauge, int64_t delta);
+
+// Gives the calling thread's slot back, call before the thread exits
+void metrics_release();
+
+// Writes every metric as "name value" lines
+void metrics_dump(FILE *fp);
+
+#endif /* METRICS_H */
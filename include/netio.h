@@ -0,0 +1,54 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ * io_uring client I/O backend (-u).
+ *
+ * Instead of a client thread per connection blocking in recv, one I/O
+ * thread serves every logged in client from an io_uring. Each connection
+ * has a multishot receive drawing from a ring of provided buffers, so one
+ * armed request delivers all its data. Frames written to a connection by
+ * any thread (netio_send) are appended to its output buffer, and the I/O
+ * thread sends everything queued for a connection with one SEND, one
+ * send in flight per connection to keep frames in order. All SQEs of a
+ * pass go to the kernel with the same io_uring_enter that waits for the
+ * next completions; the I/O thread is only woken through an eventfd when
+ * output arrives while it sleeps. Under load this takes far fewer than one
+ * system call per request.
+ *
+ * A frame is handed to the server in two steps: admit returns how long the
+ * connection must wait (rate limits, see ratelimit.h), during which its
+ * input is held: neither parsed nor received, so it stays bounded. Then
+ * frame handles it. frame returns -1 to
+ * close the connection once its output is flushed (LOGOUT).
+ */
+
+typedef struct {
+	// The connection is attached, before anything is received from it;
+	// returns -1 to close it once what it sent is flushed
+	int (*opened)(void *ctx);
+	uint64_t (*admit)(void *ctx, int type);
+	int (*frame)(void *ctx, petr_header *ph, char *body);
+	// The connection is gone; its fd is closed after this returns
+	void (*closed)(void *ctx);
+} netio_ops_t;
+
+// Sets up the ring; returns -1 if io_uring is not available
+int netio_init(netio_ops_t *ops);
+
+int netio_enabled();
+
+// Starts serving fd, a logged in client, with ctx passed to the ops.
+// Callable from any thread.
+void netio_attach(int fd, void *ctx);
+
+// Queues one frame to the client on fd. Falls back to a blocking wr_msg when
+// the backend is off or fd is not attached. Callable from any thread.
+int netio_send(int fd, petr_header *ph, char *msg);
+
+void *netio_thread();
+
+#endif /* NETIO_H */
@@ -0,0 +1,51 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+/*
+ * Elastic job thread pool.
+ *
+ * -j MIN-MAX lets the number of job threads float between MIN and MAX
+ * (-j N keeps it fixed at N). Every POOL_SAMPLE_MS the pool thread looks at
+ * the job queue: if jobs waited POOL_GROW_WAIT_NS on average since the last
+ * sample, or at least one job per worker is queued, it starts one more job
+ * thread, or doubles the pool when the backlog is over twice its size. A job
+ * thread that finds no job for POOL_IDLE_MS exits, unless that would take
+ * the pool below MIN; the idle time keeps a pool that just grew from
+ * shrinking between two bursts.
+ */
+
+#define POOL_SAMPLE_MS 100
+#define POOL_GROW_WAIT_NS (1 * 1000000)
+#define POOL_IDLE_MS 5000
+
+extern int pool_min, pool_max;
+
+// Parses "N" or "MIN-MAX". Returns 0 on success, -1 otherwise.
+int pool_parse(char *spec);
+
+void pool_init();
+
+// Whether the pool may change size (MIN < MAX)
+int pool_elastic();
+
+// Job threads running
+int pool_size();
+
+// Counts a job thread about to be started; returns its index (0, 1, ...)
+int pool_spawn();
+
+// Records how long a job waited in the queue
+void pool_record_wait(uint64_t ns);
+
+// Called by a job thread idle for POOL_IDLE_MS. Returns 1 if it is to exit,
+// in which case it no longer counts as running.
+int pool_retire();
+
+// Called by the pool thread with the current queue depth. Returns how many
+// job threads to start (each with pool_spawn), and the mean queue wait since
+// the last call.
+int pool_grow(int depth, uint64_t *mean_wait);
+
+#endif /* POOL_H */
@@ -7,8 +7,10 @@ enum msg_types {
     OK,
     LOGIN = 0x10,
     LOGOUT,
+    RESUME,
     EUSRLGDIN = 0x1a,
     EWRNGPWD,
+    ETOKEN,
     ANCREATE = 0x20,
     ANCLOSED = 0x22,
     ANLIST,
@@ -16,6 +18,9 @@ enum msg_types {
     ANLEAVE,
     ANBID,
     ANUPDATE,
+    // Pinned, clients hard-code them
+    ANBIDBATCH = 0x28,
+    ANPROXY = 0x29, // "id\r\nmax", see proxy.h
     EANFULL = 0x2b,
     EANNOTFOUND,
     EANDENIED,
@@ -28,12 +33,24 @@ enum msg_types {
     ESERV = 0xff
 };
 
+// PETR wire versions. A client selects v2 (binary bodies, see wire.h) by
+// sending a third LOGIN field: "username\r\npassword\r\n2"
+// A client that also sends a fourth field, "username\r\npassword\r\n1\r\nresume",
+// is answered OK with a session token, which a new connection may send
+// instead of LOGIN as RESUME "username\r\ntoken" (see session.h). Other
+// clients get an empty OK.
+#define PETR_V1 1
+#define PETR_V2 2
+
 // This is the struct describes the header of the PETR protocol messages
 typedef struct {
     uint32_t msg_len; // this should include the null terminator
     uint8_t msg_type;
 } petr_header;
 
+// Largest msg_len a client may send; a bigger frame closes the connection
+#define PETR_MAX_MSG_LEN (1 << 20)
+
 int rd_msgheader(int socket_fd, petr_header *h);
 int wr_msg(int socket_fd, petr_header *h, char *msgbuf);
 
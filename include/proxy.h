@@ -0,0 +1,49 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <semaphore.h>
+#include "helpers.h"
+
+/*
+ * Proxy (automatic) bidding.
+ *
+ * ANPROXY "id\r\nmax" registers the most a user will pay for an auction
+ * (0 withdraws it). From then on the server bids for the user whenever it
+ * is outbid, by hand or by another proxy, going one above the competition
+ * up to max. Competing proxies are resolved in one step: the highest max
+ * takes the lead at the runner-up's max plus one (or its own max if that is
+ * lower), so a contest costs one bid and one ANUPDATE instead of a round
+ * trip through the clients for every raise.
+ *
+ * An auction's proxies are kept in a book sorted by max, highest first and
+ * in registration order among equals, created on the first ANPROXY and
+ * changed under its lock. Auctions without proxies cost bids one pointer
+ * load. Proxy bids are ordinary bids (place_bid): they are checked against
+ * the credit limit and replicated as EV_BID; the book itself is replicated
+ * as EV_PROXY.
+ */
+
+typedef struct {
+	user_t *user;
+	unsigned long max;
+} proxy_t;
+
+typedef struct proxy_book {
+	sem_t lock;
+	int n, cap;
+	proxy_t *entries; // sorted, see above
+} proxy_book_t;
+
+// The auction's book, created if create is set; NULL if it has none
+proxy_book_t *proxy_book(auction_t *auction, int create);
+void free_proxy_book(proxy_book_t *book);
+
+// Sets user's max, or withdraws the user's proxy if max is 0. The caller
+// holds book->lock.
+void proxy_set(proxy_book_t *book, user_t *user, unsigned long max);
+void proxy_remove(proxy_book_t *book, int i);
+
+// Drops proxies that lost for good: not leading and max at most bid
+void proxy_prune(proxy_book_t *book, uint32_t leader, unsigned long bid);
+
+#endif /* PROXY_H */
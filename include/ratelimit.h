@@ -0,0 +1,47 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+/*
+ * Admission control, applied by the client thread before a request is
+ * queued.
+ *
+ * Per connection, -R gives a token bucket per message type, e.g.
+ * "bid=200/50,list=5/2,*=1000/100": RATE requests per second with bursts
+ * of up to BURST. Buckets are kept as a theoretical arrival time (GCRA), one
+ * word per type owned by the connection's client thread, so the check is a
+ * compare and an add. A request over its rate is not refused: the client
+ * thread sleeps until it conforms and stops reading meanwhile, so the
+ * flooding client is slowed down by TCP flow control.
+ *
+ * Globally, -W sets a queue wait target. The job threads keep a moving
+ * average of how long jobs waited in the queue; while it is over the target
+ * and jobs are queued, requests outside the bid lane are answered ESERV
+ * right away instead of being queued. Both are single relaxed atomics.
+ */
+
+// Per connection bucket state, indexed by message type
+typedef struct {
+	uint64_t tat[256];
+} ratelimit_t;
+
+// Parses the -R spec. Returns 0 on success, -1 otherwise.
+int ratelimit_parse(char *spec);
+
+// Sets the -W target, in microseconds
+void ratelimit_set_target(long us);
+
+void ratelimit_init(ratelimit_t *rl);
+
+// Takes a token for a request of type arriving at now (metrics_now).
+// Returns 0 if it may go ahead, else the nanoseconds to wait before it does.
+uint64_t ratelimit_take(ratelimit_t *rl, int type, uint64_t now);
+
+// Feeds the queue wait of a job into the moving average
+void ratelimit_observe_wait(uint64_t ns);
+
+// Whether the average queue wait is over the -W target
+int ratelimit_overloaded();
+
+#endif /* RATELIMIT_H */
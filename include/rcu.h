@@ -0,0 +1,58 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdatomic.h>
+
+/*
+ * Epoch based read-copy-update.
+ *
+ * Readers bracket their traversal with rcu_read_lock/rcu_read_unlock, which
+ * only publish the global epoch in a per-thread slot and never block.
+ * Writers publish a new version of an object with an atomic pointer store
+ * (or CAS) and hand the old one to rcu_retire; it is freed once every reader
+ * that was active when it was retired has left its read side section.
+ *
+ * A thread claims a reader slot on its first read side section and gives it
+ * back with rcu_thread_exit(). While all RCU_MAX_READERS slots are taken,
+ * readers without one are only counted, and nothing is freed until the
+ * last of them has left its section.
+ */
+
+#define RCU_MAX_READERS 256
+
+void rcu_init();
+
+void rcu_read_lock();
+// rcu_read_lock for optional reads: returns -1, without entering a section,
+// if the thread would have to read without a slot
+int rcu_try_read_lock();
+void rcu_read_unlock();
+// Gives the calling thread's reader slot back, call before the thread exits
+void rcu_thread_exit();
+
+// Frees p with free_fn once no reader can still hold it
+void rcu_retire(void *p, void (*free_fn)(void *));
+
+// Frees what can be freed now; called from the tick and by rcu_retire
+void rcu_reclaim();
+
+// Objects retired but not yet freed
+long rcu_pending();
+
+/*
+ * Append-only array published for lock-free readers. Writers must be
+ * serialized by the caller; readers load the array inside a read side
+ * section and may read items [0, n).
+ */
+typedef struct {
+	atomic_int n;
+	int cap;
+	void *items[];
+} rcu_array_t;
+
+typedef _Atomic(rcu_array_t *) rcu_array_ref;
+
+void rcu_array_init(rcu_array_ref *ref, int cap);
+void rcu_array_append(rcu_array_ref *ref, void *item);
+
+#endif /* RCU_H */
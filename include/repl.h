@@ -0,0 +1,100 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stddef.h>
+#include "helpers.h"
+#include "wire.h"
+
+/*
+ * Hot standby replication.
+ *
+ * A primary started with -r SOCKET serves one replica on that Unix socket.
+ * When the replica connects the primary pauses every replicated change,
+ * sends a snapshot of its users and auctions as events and from then on
+ * streams each change as it is made: new users and auctions, watches,
+ * accepted bids, ticks and settlements. The replica (-f SOCKET) applies
+ * them to its own state without serving clients; once the stream ends or
+ * stays silent for REPL_TIMEOUT_MS (the primary sends heartbeats while
+ * idle) it is promoted and starts listening on the port.
+ *
+ * Replication is asynchronous: the bid path appends an encoded event to an
+ * in-memory log and a sender thread writes it out, so a replica may miss
+ * the last few changes of a primary that dies. A replica that falls more
+ * than REPL_MAX_BACKLOG bytes behind is dropped and has to reconnect.
+ *
+ * Events are framed by a petr_header. Strings are wire.h strings.
+ *
+ *   EV_SYNC     u32 next auction id, u64 house balance
+ *   EV_USER     str username, str password, u64 balance, u64 committed
+ *   EV_AUCTION  u32 id, str creater, str item, u64 bin, u32 rticks, u64 bid,
+ *               str highest bidder, u8 n, n * str watcher
+ *   EV_WATCH    u32 id, str username
+ *   EV_LEAVE    u32 id, str username
+ *   EV_BID      u32 id, str username, u64 bid
+ *   EV_TICK     u32 ticker chunk counted down (see ticker.h)
+ *   EV_CLOSE    u32 n, n * u32 id (settled as one batch)
+ *   EV_READY    end of the snapshot
+ *   EV_HEARTBEAT
+ *   EV_PROXY    u32 id, str username, u64 max (0: withdrawn)
+ */
+
+#define REPL_TIMEOUT_MS 1000
+#define REPL_HEARTBEAT_MS 200
+#define REPL_MAX_BACKLOG (64 << 20)
+
+enum repl_event {
+	EV_SYNC = 1,
+	EV_USER,
+	EV_AUCTION,
+	EV_WATCH,
+	EV_LEAVE,
+	EV_BID,
+	EV_TICK,
+	EV_CLOSE,
+	EV_READY,
+	EV_HEARTBEAT,
+	EV_PROXY,
+};
+
+void repl_init();
+
+// Makes this process a primary; snapshot writes the current state as
+// events (see repl_frame_begin) while all replicated changes are paused.
+void repl_enable(void (*snapshot)(wbuf_t *b));
+
+// Accepts replicas on the Unix socket path and streams the log to them
+void *repl_thread(void *path);
+
+/*
+ * A replicated change is made between repl_begin and repl_end, with its
+ * event logged before repl_end; snapshots are only taken while no thread
+ * is in between. Calls nest. A thread must enter before taking any lock
+ * another thread may hold while entering (e.g. auctions_wlock); the locks
+ * it needs inside must not be waited on by threads that are themselves
+ * inside.
+ */
+void repl_begin();
+void repl_end();
+
+// Opens an event in the log and returns it with the log locked, or NULL if
+// no replica is attached. The caller appends the fields and calls
+// repl_event_end.
+wbuf_t *repl_event_begin(int type);
+void repl_event_end(wbuf_t *b);
+
+// Event framing, for the snapshot
+size_t repl_frame_begin(wbuf_t *b, int type);
+void repl_frame_end(wbuf_t *b, size_t start);
+
+// Field encoders shared by the snapshot and the live events
+void repl_put_user(wbuf_t *b, user_t *u);
+void repl_put_auction(wbuf_t *b, auction_t *a, uint32_t rticks);
+
+int repl_attached();
+size_t repl_backlog();
+
+// Runs as the replica of the primary at path: applies every event with
+// apply until the primary goes away, then returns.
+void repl_follow(char *path, void (*apply)(int type, rbuf_t *r));
+
+#endif /* REPL_H */
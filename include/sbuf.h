@@ -1,19 +1,50 @@
+#ifndef SBUF_H
+#define SBUF_H
+
 #include <semaphore.h>
 #include <stdlib.h>
 #include "protocol.h"
 #include "helpers.h"
 
+/*
+ * Bounded FIFO lanes sharing one set of consumers. Lane 0 has the highest
+ * priority. Removal is weighted round robin: in every round a lane is
+ * served at most its weight times, higher priority lanes first, and a new
+ * round starts once every non-empty lane has used its share. Under a full
+ * load of every lane, a lane with weight w thus gets w of every
+ * sum(weights) removals, so no lane starves.
+ */
 typedef struct {
 	void **buf; /* Buffer array */
-	int n; /* Maximum number of slots */
 	int front; /* buf[(front+1)%n] is first item */
 	int rear; /* buf[rear%n] is last item */
-	sem_t mutex; /* Protects accesses to buf */
+	int count; /* Items in the lane, guarded by mutex */
+	int weight; /* Removals per round */
+	int credit; /* Removals left in this round */
 	sem_t slots; /* Counts available slots */
-	sem_t items; /* Counts available items */
+} sbuf_lane_t;
+
+typedef struct {
+	sbuf_lane_t *lanes;
+	int nlanes;
+	int n; /* Maximum number of slots per lane */
+	sem_t mutex; /* Protects accesses to the lanes */
+	sem_t items; /* Counts available items, in all lanes */
 } sbuf_t;
 
 void sbuf_init(sbuf_t *sp, int n);
+/* weights[i] is the weight of lane i */
+void sbuf_init_lanes(sbuf_t *sp, int n, int nlanes, const int *weights);
 void sbuf_deinit(sbuf_t *sp);
+/* Inserts into lane 0 */
 void sbuf_insert(sbuf_t *sp, void *ptr);
-void* sbuf_remove(sbuf_t *sp);
\ No newline at end of file
+/* sbuf_insert in two steps into any lane, for callers that time the wait for a slot */
+void sbuf_reserve(sbuf_t *sp, int lane);
+void sbuf_put(sbuf_t *sp, int lane, void *ptr);
+void* sbuf_remove(sbuf_t *sp);
+/* sbuf_remove giving up after ms milliseconds, NULL if it did */
+void* sbuf_remove_timed(sbuf_t *sp, int ms);
+int sbuf_length(sbuf_t *sp);
+int sbuf_lane_length(sbuf_t *sp, int lane);
+
+#endif /* SBUF_H */
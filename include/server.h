@@ -9,19 +9,48 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <semaphore.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include "sbuf.h"
+#include "wire.h"
+#include "metrics.h"
+#include "settle.h"
+#include "shard.h"
+#include "repl.h"
+#include "affinity.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "netio.h"
+#include "proxy.h"
+#include "capture.h"
+#include "ticker.h"
+#include "session.h"
 
 #define BUFFER_SIZE 1024
 #define SA struct sockaddr
 
-#define USAGE_MSG "./bin/zbid_server [-h] [-j N] [-t M] PORT_NUMBER AUCTION_FILENAME\n\n\
+#define USAGE_MSG "./bin/zbid_server [-h] [-j N | -j MIN-MAX] [-t M] [-c N] [-s SOCKET] [-S K/N [-D DIR]] [-r SOCKET | -f SOCKET] [-J CPUS] [-I CPUS] [-R LIMITS] [-W US] [-u] [-C FILE] PORT_NUMBER AUCTION_FILENAME\n\n\
 -h				Displays this help menu, and returns EXIT_SUCCESS\n\
 -j N				Number of job threads. If option not specified, default to 2.\n\
+-j MIN-MAX			Start MIN job threads and add more, up to MAX, while jobs queue up;\n				threads idle for 5 seconds exit down to MIN.\n\
 -t M				M seconds between time ticks. If option not specified, default is to wait on\n				input from stdin to indicate a tick.\n\
+-t v				Virtual clock: ticks only run on the admin command \"tick N\" (needs -s),\n				back to back, which reports the tick times and closes per second.\n\
+-c N				Credit limit. A bid is denied if the user's leading bids would exceed\n				their balance plus N. If option not specified, bids are not limited.\n\
+-s SOCKET			Serve admin commands on this Unix socket path: \"stats\", \"ledger\",\n				\"trace on|off\", \"trace slow US\", \"trace dump\" and \"tick N\" (-t v).\n\
+-S K/N				Run as shard K (0 to N-1) of N server processes sharing PORT_NUMBER.\n				Each shard owns every Nth auction id and serves the users hashed to it.\n\
+-D DIR				Directory of the shards' Unix sockets. If option not specified, /tmp.\n\
+-r SOCKET			Stream state changes to a hot standby replica connecting on this\n				Unix socket path.\n\
+-f SOCKET			Run as hot standby of the primary at SOCKET, promoted to primary\n				when it goes away. AUCTION_FILENAME is not read.\n\
+-J CPUS				Pin the job threads to these CPUs (e.g. 0-3,8), one CPU each, round\n				robin. Each allocates its memory on the CPU's NUMA node.\n\
+-I CPUS				Run the I/O threads (accept, client, tick and admin threads) on these CPUs.\n\
+-R LIMITS			Per connection rate limits, TYPE=RATE/BURST requests per second, e.g.\n				bid=200/50,list=5/2,*=1000/100. Types: create list watch leave bid\n				batch proxy users wins sales balance, * for the rest. Clients over their\n				rate are read from more slowly.\n\
+-W US				Answer everything but bids with ESERV while jobs wait in the queue\n				over US microseconds on average.\n\
+-u				Serve clients from one io_uring I/O thread instead of a thread per\n				client. Falls back to client threads if io_uring is not available.\n\
+-C FILE				Record every frame clients send to FILE, for bin/zbid_replay.\n\
 PORT_NUMBER			Port number to listen on\n\
 AUCTION_FILENAME		File to read auction item information from at the start of the server\n"
 
@@ -35,9 +64,17 @@ void sigint_handler(int sig);
 
 // Server thread functions:
 
-void* client_thread(void *clientfd_ptr);
-void* job_thread();
+void* client_thread(void *conn_ptr);
+void* job_thread(void *index);
+void* pool_thread();
+// Starts a job thread and counts it in the pool
+void spawn_job_thread();
 void* tick_thread(void *ticks);
+// Ends expired sessions (see session.h) and drops their watches
+void* session_thread();
+void* admin_thread(void *path);
+void* shard_thread(void *fd_ptr);
+void* peer_thread(void *conn_ptr);
 
 void press_to_cont();
 
@@ -46,11 +83,171 @@ void press_to_cont();
 void sem_enableread(sem_t *rlock, sem_t *wlock, int *rcount);
 void sem_releaseread(sem_t *rlock, sem_t *wlock, int *wcount);
 
+// Auction/user helpers used by the job threads:
+
+// Lookups take the respective read lock; NULL if not found
+auction_t *find_auction(unsigned int id);
+user_t *find_user(char *username);
+// Lock-free lookup of a local auction in auction_index, whose ids rise
+auction_t *index_auction(unsigned int id);
+// Remaining ticks of a local auction, lock-free (auction->rticks only tells
+// whether it closed)
+unsigned int auction_rticks(auction_t *auction);
+
+// Validates and applies a bid, lock-free against other bids (see topbid.h).
+// Returns OK when accepted, ANCLOSED when accepted at the buy-it-now price,
+// otherwise the error type to reply with (EANDENIED if over the credit limit).
+int place_bid(auction_t *auction, char *username, user_t *user, unsigned long bid);
+// Swaps in a bid that passed validation against *cur and the credit
+// reservation, then releases the outbid leader's funds. Returns -1 with *cur
+// reloaded if another bid got in first (see topbid_cas).
+int accept_bid(auction_t *auction, user_t *user, unsigned long bid, uint64_t *cur);
+
+// Runs one tick: counts the auctions down and settles those that closed,
+// split into partitions run by the job threads too (see ticker.h). Returns
+// how many closed.
+int run_tick();
+// Ticks partition part of parts and settles what it closed as one batch.
+// Returns how many closed.
+int tick_part(int part, int parts);
+// Admin command "tick N" of the virtual clock: runs N ticks and reports
+// their times
+void admin_tick(char *arg, FILE *fp);
+
+// Counts the open auctions of partition part down one tick without any
+// list lock. Returns how many closed; if closed is not NULL, *closed is a new
+// array of them. Between repl_begin and repl_end.
+int tick_auctions(int part, int parts, auction_t ***closed);
+// Logs the tick of a ticker chunk for the replica, under the chunk's lock so
+// it is ordered against the chunk's new auctions (whose EV_AUCTION carries
+// the count after the tick)
+void repl_tick(int chunk);
+
+// Lets the auction's proxies outbid whatever leads now, if it has any. Returns
+// the result of the last proxy bid (OK, ANCLOSED) with its bidder and amount
+// filled in, or -1 if no proxy bid. Enters repl_begin and takes book->lock.
+int resolve_proxies(auction_t *auction, user_t **bidder, unsigned long *bid);
+// Logs a change of user's proxy on the auction for the replica; between
+// repl_begin and repl_end
+void repl_proxy(auction_t *auction, user_t *user, unsigned long max);
+
+void broadcast_anupdate(auction_t *auction, char *bidder, unsigned long bid);
+
+// Client connections, shared by the client threads and the io_uring backend
+
+// Per connection state, of a client thread or the io_uring backend. The fd
+// is the connection's own: a RESUME may move user->fd to a newer one.
+typedef struct {
+	user_t *user;
+	int fd;
+	uint32_t capture_id; // the connection in the capture (-C), 0 if none
+	int resume; // to be answered by session_attach
+	ratelimit_t rl;
+} client_conn_t;
+
+// Counts and logs a client that logged in, and one that went away
+void client_started(user_t *user);
+void client_gone(client_conn_t *conn);
+// Handles one frame from a logged in client after admission: answers
+// LOGOUT (then returns -1), sheds or queues the request
+int client_frame(client_conn_t *conn, petr_header *ph, char *body);
+// Answers an ANBID that the job thread would certainly reject (EBIDLOW,
+// EANNOTFOUND or EANDENIED) from the auction's packed word and published
+// view, without queueing it. Returns 1 if it did, 0 if the bid has to be
+// queued.
+int prefilter_bid(client_conn_t *conn, char *body);
+
+int ring_opened(void *ctx);
+uint64_t ring_admit(void *ctx, int type);
+int ring_frame(void *ctx, petr_header *ph, char *body);
+void ring_closed(void *ctx);
+
+// Job execution, run by the job threads and (for requests from another
+// shard) by the peer threads. run_job frees the job.
+void run_job(job_t *job);
+
+/*
+ * Job queue lanes, highest priority first. Bids and the ANCLOSED jobs of
+ * closing auctions go ahead of the whole-market queries, which may take
+ * milliseconds each; LANE_WEIGHTS are the lanes' shares of the job threads
+ * while all of them are backed up (see sbuf.h).
+ */
+enum job_lane {
+	LANE_BID,
+	LANE_DEFAULT,
+	LANE_QUERY,
+	NUM_LANES
+};
+#define LANE_WEIGHTS { 8, 4, 1 }
+
+int job_lane(int type);
+void job_reply(job_t *job, petr_header *ph, char *msg);
+
+// Writes to the user's client, through its home shard for a proxy
+void send_to_user(user_t *user, petr_header *ph, char *msg);
+
+// Proxy account of a remote user, created on first use; NULL if there are
+// no user ids left for it (see user_register)
+user_t *proxy_user(char *username, int shard);
+
+// Runs the job on shard and relays its reply to the job's client
+void forward_job(job_t *job, int shard);
+// Places bids (all on one auction of shard) there, filling in their results.
+// Returns the number accepted.
+int forward_bids(job_t *job, int shard, bid_req_t *bids, int n, uint8_t *results);
+
+// Settles auctions whose rticks reached 0 as one batch, then queues their
+// ANCLOSED jobs. Takes each auction->lock, callers must not hold it.
+void close_auctions(auction_t **closed, int n);
+void close_auction(auction_t *auction);
+// A job raised by the server itself, arg its only argument
+job_t *server_job(int type, void *arg);
+
+// Watching an auction puts the user in one of its users_watching slots and
+// the auction on user->watching, so a client that goes away leaves every
+// auction in O(watched) instead of lingering as a dead ANUPDATE recipient.
+// Both are changed under watchers_lock, which also orders their EV_WATCH and
+// EV_LEAVE events; between repl_begin and repl_end.
+// Returns 0, or -1 if all the auction's slots are taken.
+int watch_auction(auction_t *auction, user_t *user);
+// Frees one slot of the user on the auction, if it has any
+void unwatch_auction(auction_t *auction, user_t *user);
+// Frees the user's slot of the auction; under watchers_lock, the auction
+// already taken off user->watching
+void drop_watcher(auction_t *auction, user_t *user);
+// Leaves every auction the user watches, when its client goes away and its
+// session is not held, or the session ends. Enters repl_begin itself.
+void unwatch_all(user_t *user);
+// unwatch_all for a session that expired, checked again under watchers_lock:
+// a LOGIN since then sets is_online before its first ANWATCH, and its
+// watches are left alone.
+void unwatch_ended(user_t *user);
+// Fills in the settlement of a closed auction; the caller holds the users
+// read lock
+void settlement_of(auction_t *auction, settlement_t *s);
+
+// Replication: writes the state as events, and applies one event (replica)
+void repl_snapshot(wbuf_t *b);
+void repl_apply(int type, rbuf_t *r);
+
+// Admin endpoint: runs one command line (e.g. "stats") and writes the reply to fp
+void admin_command(char *cmd, FILE *fp);
+
 // Server functions:
 
 // Initializes the server 
 int server_init(int server_port);
 
+// Validates a LOGIN body and starts the client thread, or refuses it
+void login_client(int client_fd, char *body);
+// Reattaches a RESUME to its held session and starts the client thread, or
+// refuses it with ETOKEN
+void resume_client(int client_fd, char *body);
+// Serves the logged in user's client on fd, on a client thread or the
+// io_uring; a resumed one is answered there by session_attach, so its fd
+// becomes the user's only once it is served
+void serve_client(user_t *user, int fd, uint32_t capture_id, int resume);
+
 // Main thread 
 void run_server(int server_port, int num_jobthreads, int tick_speed);
 
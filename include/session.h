@@ -0,0 +1,99 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <semaphore.h>
+#include "helpers.h"
+#include "protocol.h"
+
+/*
+ * Session resume tokens.
+ *
+ * A LOGIN asking for it with the "resume" field (see protocol.h) answers OK
+ * with a token (SESSION_TOKEN_LEN hex characters, null terminated) as its
+ * body; without it the user gets no session, as before tokens. When the
+ * client goes away without LOGOUT its session is held for SESSION_TTL_MS:
+ * the user keeps its watches, and the ANUPDATE/ANCLOSED sent to it meanwhile
+ * are kept, up to SESSION_BACKLOG of them. A new connection whose first
+ * message is RESUME with the body "username\r\ntoken" takes the held session
+ * over with a single lookup instead of a LOGIN: it is answered OK with the
+ * same token, followed by the held messages in order. After a network blip
+ * the server may not have noticed the old connection drop yet: RESUME then
+ * takes the attached session over and shuts that connection down. RESUME is
+ * refused with ETOKEN if the token is unknown or expired, or the backlog
+ * overflowed; the client then logs in and watches again.
+ *
+ * A session ends at LOGOUT, at the next LOGIN, or when it expires. Tokens
+ * are not replicated or shared between shards (RESUME goes to the user's
+ * home shard like LOGIN).
+ */
+
+#define SESSION_TOKEN_LEN 32
+#define SESSION_BACKLOG 64
+#define SESSION_TTL_MS 30000
+#define SESSION_BUCKETS 4096
+
+enum session_state {
+	SESSION_ATTACHED, // the client is connected
+	SESSION_HELD,     // the client went away, messages are held
+	SESSION_RESUMING, // held until session_attach on the resuming connection
+	SESSION_LOST,     // held, but the backlog overflowed: cannot resume
+	SESSION_ENDED,
+};
+
+typedef struct session {
+	char token[SESSION_TOKEN_LEN + 1];
+	struct user *user;
+	int state;
+	uint64_t gone_ns; // metrics_now() when the client went away
+	// Held messages, oldest first
+	petr_header backlog[SESSION_BACKLOG];
+	char *bodies[SESSION_BACKLOG];
+	int held;
+	int resume_fd; // the connection resuming it, while RESUMING
+	sem_t lock; // state, backlog, user->fd and, while held, user->is_online
+	struct session *next; // in its bucket, while the token is valid
+} session_t;
+
+void session_init();
+
+// Starts a new session for the user's connection and writes its token to
+// token (SESSION_TOKEN_LEN + 1 bytes); any session it had ends. Returns 1
+// if that one was held (its watches are still there), else 0.
+int session_open(struct user *user, char *token);
+// LOGOUT, or a LOGIN without resume: the user's session ends. Returns 1 if
+// it was held (its watches are still there), else 0.
+int session_end(struct user *user);
+// The client on fd went away: is_online is cleared and the session held.
+// Returns -1 if the user has no session to hold, 0 if it is held now or was
+// taken over by another connection.
+int session_detach(struct user *user, int fd);
+// 1 while the user's session is held or resuming, i.e. keeps its watches
+int session_held(struct user *user);
+
+// Takes the session of token over for the connection on fd, which is not
+// answered yet: a connection it was attached to is shut down, and messages
+// are held until session_attach. Returns the user, or NULL if the session
+// cannot be resumed.
+struct user *session_resume(const char *username, const char *token, int fd);
+// Answers the RESUME on fd with OK and the token, sends it the held
+// messages and makes it the user's fd. Called once fd is served, so that
+// netio_send reaches it; sends without the lock, and what is held
+// meanwhile is sent too. Returns -1 if the session was lost or taken over
+// in the meantime (the connection should be closed).
+int session_attach(struct user *user, int fd);
+
+// Keeps a message for a user whose client is away. Returns -1 if the client
+// is connected after all (the caller sends it), otherwise 0: held, or
+// dropped if there is nothing to resume.
+int session_hold(struct user *user, petr_header *ph, char *msg);
+
+// Ends the held sessions older than SESSION_TTL_MS at now and the lost ones.
+// Fills users with theirs (at most max, the rest on the next call) so the
+// caller can drop their watches; returns how many.
+int session_expire(uint64_t now, struct user **users, int max);
+
+// At shutdown, with the user
+void session_free(session_t *s);
+
+#endif /* SESSION_H */
@@ -0,0 +1,65 @@
+#ifndef SETTLE_H
+#define SETTLE_H
+
+#include <stdio.h>
+#include <time.h>
+#include "helpers.h"
+
+/*
+ * Settlement of closed auctions.
+ *
+ * Balances are 64-bit atomics changed only here (with fetch_add), so
+ * settling never needs the users lock for writing and USRBLNC is a single
+ * atomic load. Settlements are applied in batches, one per tick, and each
+ * one is appended to an in-memory ledger. Auctions sold by the server
+ * ("ZBid Server") are paid to the house account, so the sum of all user
+ * balances plus the house balance is always zero.
+ *
+ * In a sharded deployment a remote winner or seller is represented by a
+ * proxy account, which is settled here like a local user; its home shard
+ * then applies the same amount to the real account with settle_transfer.
+ *
+ * Leading bids on open auctions are held as the user's committed funds:
+ * reserved when the user takes the lead, released when outbid and turned
+ * into a payment when the auction settles.
+ */
+
+typedef struct {
+	unsigned int auction_id;
+	user_t *winner; // NULL if the auction closed without bids
+	user_t *seller; // NULL for house auctions
+	int64_t amount;
+} settlement_t;
+
+typedef struct {
+	uint64_t seq;
+	time_t when;
+	settlement_t s;
+} ledger_entry_t;
+
+void settle_init();
+
+// Applies the settlements of one batch and records them in the ledger.
+// Entries without a winner are skipped.
+void settle_apply(settlement_t *batch, int n);
+
+int64_t settle_house_balance();
+
+// Sets the house balance, for a replica loading the primary's snapshot
+void settle_restore_house(int64_t balance);
+
+// Applies a settlement made by another shard for one of this shard's users
+// (to the house if u is NULL). Transfers are not recorded in the ledger,
+// their running sum is returned by settle_transfers().
+void settle_transfer(user_t *u, int64_t amount);
+int64_t settle_transfers();
+
+// Adds amount to u's committed funds if they stay within balance + limit;
+// a negative limit disables the check. Returns 0 on success, -1 otherwise.
+int settle_reserve(user_t *u, int64_t amount, int64_t limit);
+void settle_release(user_t *u, int64_t amount);
+
+// Writes ledger totals and the last (up to) n entries, most recent first
+void ledger_dump(FILE *fp, int n);
+
+#endif /* SETTLE_H */
@@ -0,0 +1,91 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+#include "helpers.h"
+#include "protocol.h"
+#include "wire.h"
+
+/*
+ * Sharded deployment: N server processes on one host share the client port
+ * through SO_REUSEPORT and talk to each other over Unix sockets.
+ *
+ * Auction ids are partitioned by residue, auction id belongs to shard
+ * (id - 1) % N, and every user has a home shard picked by hashing the
+ * username. A LOGIN or RESUME accepted by another shard is handed to the
+ * home shard together with the client socket (SCM_RIGHTS), so a user's
+ * connection, login state and balance live in one process. The home shard
+ * forwards requests on another shard's auctions to it and merges the results
+ * of whole-market queries (ANLIST, USRLIST, USRWINS, USRSALES) from all
+ * shards.
+ * The auction shard refers to remote users through proxy user_t entries and
+ * pushes ANUPDATE/ANCLOSED and settlements back to their home shard.
+ *
+ * Inter-shard messages are framed by a petr_header like client messages:
+ *
+ *   SH_HANDOFF  LOGIN body, the client socket attached
+ *   SH_RESUME   RESUME body, the client socket attached
+ *   SH_REQUEST  u8 proto, str username, u8 type, request body (text)
+ *   SH_RESPONSE u8 type, reply body; exactly one per SH_REQUEST
+ *   SH_DELIVER  str username, u8 type, message body for the user's client
+ *   SH_SETTLE   str username, u64 amount (two's complement, debits < 0)
+ *
+ * Each thread keeps one connection per peer, connected on first use.
+ * Requests are answered on the connection they arrived on; everything else
+ * is one-way, so a thread only ever waits for the reply to its own request.
+ */
+
+#define SHARD_MAX 64
+
+enum shard_msg {
+	SH_HANDOFF = 0x80,
+	SH_REQUEST,
+	SH_RESPONSE,
+	SH_DELIVER,
+	SH_SETTLE,
+	SH_RESUME,
+};
+
+extern int shard_self, shard_count;
+
+// Parses "K/N" (shard K of N, 0 <= K < N). Returns 0 on success, -1 otherwise.
+int shard_parse(char *spec);
+
+// dir holds the shards' sockets, named after port and shard number
+void shard_init(char *dir, int port);
+
+int shard_owner(unsigned int id);
+int shard_home(const char *username);
+
+// Smallest id >= id owned by this shard
+unsigned int shard_next_id(unsigned int id);
+
+// Binds this shard's socket; returns the listening fd, or -1
+int shard_listen();
+void shard_unlink();
+
+// Reads one message from a shard connection. *body is malloc'd and null
+// terminated (also when empty); *fd receives an attached descriptor or -1.
+int shard_read(int conn, petr_header *ph, char **body, int *fd);
+
+// Sends one message on conn, attaching fd unless it is negative
+int shard_write(int conn, int type, const char *body, size_t len, int fd);
+
+// One-way messages to another shard over this thread's connection
+// msg_type is the client's first message, LOGIN or RESUME
+int shard_handoff(int shard, int msg_type, int client_fd, const char *login, size_t len);
+int shard_deliver(int shard, const char *username, petr_header *ph, const char *body);
+int shard_settle(int shard, const char *username, int64_t amount);
+
+// Runs a request on another shard for username and waits for its reply.
+// args is the request body as split by the client thread (may be NULL).
+// Returns 0 with *reply/*body (malloc'd) filled in, -1 if the shard is down.
+int shard_call(int shard, int proto, const char *username, int type, list_t *args,
+               petr_header *reply, char **body);
+
+// Runs a row based query on every other shard and merges the replies, whose
+// bodies are in wire format version, into rows (see wire_rows_merge).
+// Returns the number of v2 rows appended.
+uint32_t shard_gather(int proto, const char *username, int type, wbuf_t *rows, int version);
+
+#endif /* SHARD_H */
@@ -0,0 +1,63 @@
+#ifndef TICKER_H
+#define TICKER_H
+
+#include <stdint.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+/*
+ * Remaining ticks of every auction, kept apart from auction_t.
+ *
+ * Each auction gets a slot when it is created; slots are never reused. The
+ * counts of the slots live in contiguous, cache line aligned chunks of
+ * TICKER_CHUNK u32s (the hot state the tick touches), and what each slot
+ * belongs to in a separate array that is only read for the slots that
+ * close. A tick is one pass over the counts, TICKER_LANES at a time with
+ * AVX2 or SSE2 where available: every nonzero count goes down by one, and
+ * the slots that reach 0 are returned. Vectors holding only closed slots
+ * are not written back, and chunks without open slots are skipped.
+ *
+ * A tick can be split into partitions, each taking every parts-th chunk,
+ * run by different threads at once. Every chunk has a lock, held by the
+ * partition ticking it and by ticker_add/ticker_set, so nothing else waits
+ * on a tick. Chunks never move, so ticker_rticks reads a count without a
+ * lock and sees it before or after a tick. ticker_add calls are serialized
+ * by the caller (the server holds auctions_wlock).
+ */
+
+#define TICKER_CHUNK 65536
+#define TICKER_MAX_CHUNKS 4096
+#define TICKER_LANES 8
+
+typedef struct {
+	uint32_t *rticks[TICKER_MAX_CHUNKS]; // hot: remaining ticks, 0 once closed
+	void **owners[TICKER_MAX_CHUNKS];    // cold: what each slot belongs to
+	int open[TICKER_MAX_CHUNKS];         // slots of the chunk with rticks > 0
+	sem_t locks[TICKER_MAX_CHUNKS];
+	atomic_int n;                        // slots handed out
+} ticker_t;
+
+void ticker_init(ticker_t *t);
+void ticker_free(ticker_t *t);
+
+// Gives owner the next slot, counting down from rticks (0: already closed)
+int ticker_add(ticker_t *t, void *owner, uint32_t rticks);
+uint32_t ticker_rticks(ticker_t *t, int slot);
+// Sets a slot's count; 0 closes it without a tick returning it
+void ticker_set(ticker_t *t, int slot, uint32_t rticks);
+void *ticker_owner(ticker_t *t, int slot);
+
+// Partitions worth running apart: one per chunk in use, at most max
+int ticker_parts(ticker_t *t, int max);
+// Counts the open slots of partition part (of parts) down one tick. Returns
+// how many reached 0, their slots are in *slots (of *cap, grown as needed).
+// ticked (may be NULL) is called for every chunk counted down, with its lock
+// still held.
+int ticker_tick(ticker_t *t, int part, int parts, uint32_t **slots, int *cap, void (*ticked)(int chunk));
+
+// Tick implementation: "avx2", "sse2" or "scalar", the best the CPU runs by
+// default. ticker_use returns -1 if the CPU cannot run impl.
+const char *ticker_impl();
+int ticker_use(const char *impl);
+
+#endif /* TICKER_H */
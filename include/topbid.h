@@ -0,0 +1,48 @@
+#ifndef TOPBID_H
+#define TOPBID_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Leading bid of an auction, packed into one atomic word so a bid is
+ * validated and placed with a compare-and-swap instead of under a lock:
+ *
+ *   bit 63       closed, set by the tick or by a buy-it-now bid
+ *   bits 40-62   id of the leading user (user_t.id), 0 before any bid
+ *   bits 0-39    amount of the leading bid
+ *
+ * Every change goes through a CAS from the value it was computed from, so
+ * accepted bids form a single chain of strictly rising amounts and none is
+ * lost. Once the closed bit is set the word never changes again, which
+ * makes the leader final for settlement.
+ */
+
+typedef _Atomic uint64_t topbid_t;
+
+#define TOPBID_BID_BITS 40
+#define TOPBID_UID_BITS 23
+#define TOPBID_MAX_BID ((1ULL << TOPBID_BID_BITS) - 1)
+#define TOPBID_MAX_UID ((1U << TOPBID_UID_BITS) - 1)
+#define TOPBID_CLOSED (1ULL << 63)
+
+uint64_t topbid_pack(unsigned long bid, uint32_t uid);
+unsigned long topbid_bid(uint64_t t);
+uint32_t topbid_uid(uint64_t t);
+int topbid_closed(uint64_t t);
+
+// Whether bid may replace t: 0 if so, otherwise EANNOTFOUND (closed) or
+// EBIDLOW (not above the leading bid, or over TOPBID_MAX_BID)
+int topbid_check(uint64_t t, unsigned long bid);
+
+// Replaces *cur, the value last loaded from top, with bid by uid, closing the
+// auction if bid reaches bin (0 for none). Returns OK or ANCLOSED if the bid
+// took the lead, or -1 if top changed since: *cur is then reloaded and the
+// caller checks again.
+int topbid_cas(topbid_t *top, uint64_t *cur, uint32_t uid, unsigned long bid, unsigned long bin);
+
+// Sets the closed bit. Returns 1, or 0 if it was already set (a buy-it-now
+// bid closed the auction first).
+int topbid_close(topbid_t *top);
+
+#endif /* TOPBID_H */
@@ -0,0 +1,69 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Per-request tracing, off by default and toggled at runtime through the
+ * admin socket ("trace on|off|slow US|dump").
+ *
+ * While enabled, every client request gets a trace_t that follows its job
+ * from the client thread to the job thread. Each trace_mark(stage) charges
+ * the time since the previous mark to that stage, so the stages add up to
+ * the request's total. Finished traces feed one histogram per stage (see
+ * metrics.h) and, when slower than the threshold, a ring of recent slow
+ * requests.
+ *
+ * The trace being marked is thread local: the owning thread sets it with
+ * trace_set() and every mark is a no-op when it is NULL, so instrumented
+ * code costs one TLS load while tracing is off.
+ */
+
+#define TRACE_RING_SIZE 256
+#define TRACE_NAME_LEN 32
+
+enum trace_stage {
+	T_READ,       // reading and splitting the request body
+	T_ENQUEUE,    // client thread waiting for a free job_queue slot
+	T_QUEUE,      // queued until a job thread picks the job up
+	T_LOCK,       // waiting on users/auctions locks and auction->lock
+	T_PROCESS,    // job thread work not covered by another stage
+	T_BROADCAST,  // ANUPDATE/ANCLOSED fan-out to watchers
+	T_REPLY,      // writing the reply to the requesting client
+	T_NUM_STAGES
+};
+
+typedef struct {
+	int type;
+	char username[TRACE_NAME_LEN];
+	uint64_t start_ns;  // metrics_now() when the request header was read
+	uint64_t last_ns;   // time of the previous mark
+	uint64_t total_ns;  // set by trace_finish
+	uint64_t stage_ns[T_NUM_STAGES];
+} trace_t;
+
+void trace_enable(int on);
+int trace_enabled();
+
+// Requests at least this slow are kept in the ring (0 keeps all)
+void trace_set_threshold(uint64_t ns);
+uint64_t trace_threshold();
+
+// New trace started now, or NULL while tracing is disabled
+trace_t *trace_start(int type, char *username);
+
+void trace_set(trace_t *t);
+trace_t *trace_get();
+
+void trace_mark(int stage);
+
+// Completes the current trace: records it and frees it
+void trace_finish();
+// Drops the current trace without recording it
+void trace_discard();
+
+// Writes the slow request ring, most recent first
+void trace_dump(FILE *fp);
+
+#endif /* TRACE_H */
@@ -0,0 +1,54 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring access through the raw system calls (there is no
+ * liburing dependency): one submission and one completion queue, used by a
+ * single thread, plus provided buffer rings for multishot receives.
+ */
+
+typedef struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	unsigned sqe_tail; // SQEs handed out, published by uring_submit
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+} uring_t;
+
+// Buffers the kernel picks from for IOSQE_BUFFER_SELECT reads
+typedef struct {
+	struct io_uring_buf_ring *ring;
+	char *bufs;
+	unsigned nbufs, size;
+	uint16_t tail;
+} uring_bufs_t;
+
+// Returns 0, or -1 with errno set if io_uring is not available
+int uring_init(uring_t *r, unsigned entries);
+
+// A cleared SQE to fill in, or NULL if the queue is full (submit first)
+struct io_uring_sqe *uring_sqe(uring_t *r);
+
+// Submits the SQEs handed out and waits for wait_nr completions. Returns
+// the number submitted or -1.
+int uring_submit(uring_t *r, unsigned wait_nr);
+
+// The oldest unconsumed completion, or NULL; uring_cqe_seen consumes it
+struct io_uring_cqe *uring_cqe(uring_t *r);
+void uring_cqe_seen(uring_t *r);
+
+// Registers nbufs buffers of size bytes as buffer group bgid
+int uring_bufs_init(uring_t *r, uring_bufs_t *b, int bgid, unsigned nbufs, unsigned size);
+char *uring_buf(uring_bufs_t *b, unsigned bid);
+// Gives buffer bid back to the kernel
+void uring_buf_put(uring_bufs_t *b, unsigned bid);
+
+#endif /* URING_H */
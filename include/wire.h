@@ -0,0 +1,139 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "helpers.h"
+
+/*
+ * Encoders/decoders for PETR message bodies.
+ *
+ * PETR_V1 is the legacy text format: fields joined by "\r\n" or ";", rows
+ * terminated by "\n" and the whole body null terminated.
+ *
+ * PETR_V2 is negotiated by an optional third LOGIN field ("user\r\npass\r\n2")
+ * and replaces the bodies of ANLIST, ANUPDATE, ANCLOSED, USRWINS and USRSALES
+ * with fixed-width little-endian fields. Strings are a u16 length followed by
+ * the raw bytes (no terminator). Row based messages start with a u32 count.
+ *
+ *   ANLIST   u32 count, { u32 id, str item, u64 bin, u32 watchers, u64 bid, u32 rticks }
+ *   ANUPDATE u32 id, str item, str bidder, u64 bid
+ *   ANCLOSED u32 id, str winner (empty if none), u64 bid
+ *   USRWINS  u32 count, { u32 id, str item, u64 bid }
+ *   USRSALES u32 count, { u32 id, str item, str winner (empty if none), u64 bid }
+ *
+ * ANBIDBATCH requests are text for both versions: "id\r\namount" pairs joined
+ * by "\r\n". The reply holds one result type (OK, EANNOTFOUND, EANDENIED,
+ * EBIDLOW) per pair in request order: v1 as decimal codes joined by ";", v2
+ * as u32 count followed by one u8 per pair.
+ *
+ * ANPROXY requests are text for both versions: "id\r\nmax", max 0 withdraws
+ * the proxy (see proxy.h). The reply is OK or an ANBID error, without body.
+ */
+
+/*
+ * Growable output buffer. len is the number of valid bytes in data and is
+ * used directly as the msg_len of the outgoing petr_header.
+ */
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} wbuf_t;
+
+/* Read cursor over a received message body */
+typedef struct {
+	const char *data;
+	size_t len;
+	size_t pos;
+} rbuf_t;
+
+/* Decoded string field, points into the message body (not terminated) */
+typedef struct {
+	const char *ptr;
+	uint16_t len;
+} wstr_t;
+
+typedef struct {
+	uint32_t id;
+	wstr_t item_name;
+	uint64_t bin;
+	uint32_t watchers;
+	uint64_t bid;
+	uint32_t rticks;
+} anlist_row_t;
+
+typedef struct {
+	uint32_t id;
+	wstr_t item_name;
+	wstr_t bidder;
+	uint64_t bid;
+} anupdate_t;
+
+typedef struct {
+	uint32_t id;
+	wstr_t winner;
+	uint64_t bid;
+} anclosed_t;
+
+/* Used for both USRWINS (winner left empty) and USRSALES rows */
+typedef struct {
+	uint32_t id;
+	wstr_t item_name;
+	wstr_t winner;
+	uint64_t bid;
+} usrhist_row_t;
+
+// Buffer management
+
+void wbuf_init(wbuf_t *b, size_t cap);
+void wbuf_free(wbuf_t *b);
+void wbuf_reset(wbuf_t *b);
+
+void wbuf_put_u8(wbuf_t *b, uint8_t v);
+void wbuf_put_u16(wbuf_t *b, uint16_t v);
+void wbuf_put_u32(wbuf_t *b, uint32_t v);
+void wbuf_put_u64(wbuf_t *b, uint64_t v);
+void wbuf_put_str(wbuf_t *b, const char *s);
+void wbuf_put_bytes(wbuf_t *b, const char *s, size_t n);
+void wbuf_put_dec(wbuf_t *b, unsigned long v);
+
+void rbuf_init(rbuf_t *r, const char *data, size_t len);
+int rbuf_get_u8(rbuf_t *r, uint8_t *v);
+int rbuf_get_u16(rbuf_t *r, uint16_t *v);
+int rbuf_get_u32(rbuf_t *r, uint32_t *v);
+int rbuf_get_u64(rbuf_t *r, uint64_t *v);
+int rbuf_get_str(rbuf_t *r, wstr_t *s);
+
+// Message encoders. Row based messages are built with rows_begin, one call
+// per row and rows_end, which patches the v2 count / v1 terminator.
+
+void wire_rows_begin(wbuf_t *b, int version);
+void wire_rows_end(wbuf_t *b, int version, uint32_t count);
+
+// Appends the rows of another complete row based body (e.g. the same query
+// answered by another shard) to b, between rows_begin and rows_end. Returns
+// the number of rows appended (v2) or 0 (v1, whose bodies carry no count).
+uint32_t wire_rows_merge(wbuf_t *b, int version, const char *body, size_t len);
+
+// rticks is the live count, see auction_rticks
+void wire_anlist_row(wbuf_t *b, int version, auction_t *a, unsigned int rticks);
+void wire_usrwins_row(wbuf_t *b, int version, auction_t *a);
+void wire_usrsales_row(wbuf_t *b, int version, auction_t *a);
+void wire_anupdate(wbuf_t *b, int version, unsigned int id, const char *item_name, const char *bidder, unsigned long bid);
+void wire_anclosed(wbuf_t *b, int version, unsigned int id, const char *winner, unsigned long bid);
+void wire_bidbatch(wbuf_t *b, unsigned int *ids, unsigned long *amounts, uint32_t n);
+void wire_bidresults(wbuf_t *b, int version, uint8_t *results, uint32_t n);
+
+// Message decoders. Row decoders return 0 for each row and -1 once the
+// body is exhausted or malformed; call wire_rows_start first.
+
+int wire_rows_start(rbuf_t *r, int version, uint32_t *count);
+int wire_anlist_next(rbuf_t *r, int version, anlist_row_t *row);
+int wire_usrwins_next(rbuf_t *r, int version, usrhist_row_t *row);
+int wire_usrsales_next(rbuf_t *r, int version, usrhist_row_t *row);
+int wire_anupdate_decode(rbuf_t *r, int version, anupdate_t *m);
+int wire_anclosed_decode(rbuf_t *r, int version, anclosed_t *m);
+int wire_bidresults_decode(rbuf_t *r, int version, uint8_t *results, uint32_t max, uint32_t *n);
+
+#endif /* WIRE_H */
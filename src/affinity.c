@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// CPUs of each class in ascending order, count 0 if not configured
+static int cpus[2][CPU_SETSIZE];
+static int ncpus[2];
+
+int affinity_parse(int class, char *spec) {
+	cpu_set_t allowed, set;
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	CPU_ZERO(&set);
+
+	char *save, *tok, *copy = strdup(spec);
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *end;
+		long lo = strtol(tok, &end, 10), hi = lo;
+		if (end == tok) goto fail;
+		if (*end == '-') {
+			char *start = end + 1;
+			hi = strtol(start, &end, 10);
+			if (end == start) goto fail;
+		}
+		if (*end || lo < 0 || hi < lo || hi >= CPU_SETSIZE) goto fail;
+		for (; lo <= hi; lo++) {
+			if (!CPU_ISSET(lo, &allowed)) goto fail;
+			CPU_SET(lo, &set);
+		}
+	}
+	free(copy);
+
+	ncpus[class] = 0;
+	int cpu;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set)) cpus[class][ncpus[class]++] = cpu;
+	}
+	return (ncpus[class]) ? 0 : -1;
+
+fail:
+	free(copy);
+	return -1;
+}
+
+int cpu_node(int cpu) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (!dir) return -1;
+
+	int node = -1;
+	struct dirent *e;
+	while ((e = readdir(dir))) {
+		if (!strncmp(e->d_name, "node", 4) && sscanf(e->d_name + 4, "%d", &node) == 1) break;
+	}
+	closedir(dir);
+	return node;
+}
+
+void affinity_place(int class, int index, const char *name) {
+	int n = ncpus[class];
+	if (!n) return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	int i, first = (class == THREAD_JOB) ? index % n : 0;
+	int last = (class == THREAD_JOB) ? first : n - 1;
+	for (i = first; i <= last; i++) CPU_SET(cpus[class][i], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	// Prefer the node of the CPUs when they share one
+	int node = cpu_node(cpus[class][first]);
+	for (i = first + 1; i <= last && node >= 0; i++) {
+		if (cpu_node(cpus[class][i]) != node) node = -1;
+	}
+	if (node >= 0 && node < (int)(8 * sizeof(unsigned long))) {
+		unsigned long mask = 1UL << node;
+		syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask));
+	}
+
+	if (!name) return;
+	printf("%s on CPU%s ", name, (last > first) ? "s" : "");
+	for (i = first; i <= last; i++) printf((i > first) ? ",%d" : "%d", cpus[class][i]);
+	if (node >= 0) printf(", node %d", node);
+	printf("\n");
+}
@@ -0,0 +1,76 @@
+#include "capture.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+static FILE *fp;
+static sem_t lock;
+static uint64_t start_ns, flushed_ns;
+static atomic_uint next_conn = 1;
+
+int capture_open(const char *path) {
+	fp = fopen(path, "wb");
+	if (!fp) return -1;
+	setvbuf(fp, NULL, _IOFBF, 1 << 16);
+	sem_init(&lock, 0, 1);
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t wall = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	fwrite(CAPTURE_MAGIC, 1, 8, fp);
+	fwrite(&wall, sizeof(wall), 1, fp);
+	start_ns = flushed_ns = metrics_now();
+	return 0;
+}
+
+static void capture_write(uint32_t conn, int kind, int type, const char *body, uint32_t len) {
+	capture_rec_t rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.conn = conn;
+	rec.len = len;
+	rec.kind = kind;
+	rec.type = type;
+
+	sem_wait(&lock);
+	// Stamped under the lock so the file is in time order
+	uint64_t now = metrics_now();
+	rec.ns = now - start_ns;
+	fwrite(&rec, sizeof(rec), 1, fp);
+	if (len) fwrite(body, 1, len, fp);
+	if (now - flushed_ns > CAPTURE_FLUSH_MS * 1000000ULL) {
+		fflush(fp);
+		flushed_ns = now;
+	}
+	sem_post(&lock);
+}
+
+uint32_t capture_login(const char *body, uint32_t len) {
+	if (!fp) return 0;
+	uint32_t conn = atomic_fetch_add(&next_conn, 1);
+	capture_write(conn, CAP_LOGIN, LOGIN, body, len);
+	return conn;
+}
+
+uint32_t capture_resume(const char *body, uint32_t len) {
+	if (!fp) return 0;
+	uint32_t conn = atomic_fetch_add(&next_conn, 1);
+	capture_write(conn, CAP_RESUME, RESUME, body, len);
+	return conn;
+}
+
+void capture_frame(uint32_t conn, petr_header *ph, const char *body) {
+	if (!fp || !conn) return;
+	capture_write(conn, CAP_FRAME, ph->msg_type, body, ph->msg_len);
+}
+
+void capture_close(uint32_t conn) {
+	if (!fp || !conn) return;
+	capture_write(conn, CAP_CLOSE, 0, NULL, 0);
+}
+
+void capture_flush() {
+	if (fp) fflush(fp);
+}
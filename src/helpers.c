@@ -1,18 +1,124 @@
 #include "helpers.h"
 #include "linkedlist.h"
+#include "protocol.h"
+#include "proxy.h"
+#include "session.h"
+
+// Users by id - 1, appended under ids_lock
+static rcu_array_ref user_ids;
+static sem_t ids_lock;
+
+void user_ids_init() {
+	rcu_array_init(&user_ids, 64);
+	sem_init(&ids_lock, 0, 1);
+}
+
+int user_register(user_t *user) {
+	sem_wait(&ids_lock);
+	rcu_array_t *ids = atomic_load(&user_ids);
+	if (atomic_load(&ids->n) >= TOPBID_MAX_UID) {
+		sem_post(&ids_lock);
+		user->id = 0;
+		return -1;
+	}
+	user->id = atomic_load(&ids->n) + 1;
+	rcu_array_append(&user_ids, user);
+	sem_post(&ids_lock);
+	return 0;
+}
+
+user_t *user_by_id(uint32_t id) {
+	if (id == 0) return NULL;
+	rcu_read_lock();
+	rcu_array_t *ids = atomic_load(&user_ids);
+	user_t *user = (id <= (uint32_t)atomic_load(&ids->n)) ? ids->items[id - 1] : NULL;
+	rcu_read_unlock();
+	return user;
+}
 
 void free_user(void *user) {
 	if (user) {
 		user_t *u = (user_t *) user;
 		free(u->username); u->username = NULL;
 		free(u->password); u->password = NULL;
+		deleteList(u->watching);
+		session_free(u->session);
 		free(u); u = NULL;
 	}
 }
 
+auction_t* new_auction(char *item_name, char *creater, unsigned int rticks, unsigned long bin) {
+	auction_t *a = (auction_t *)malloc(sizeof(auction_t));
+	a->item_name = strdup(item_name);
+	a->id = 0;
+	a->creater = strdup(creater);
+	a->highest_bidder = NULL;
+	a->bin = bin;
+	a->bid = 0;
+	a->rticks = rticks;
+	a->slot = -1;
+
+	int i;
+	for (i = 0; i < 5; i++) {
+		a->users_watching[i] = NULL;
+	}
+	atomic_init(&a->top, 0);
+	atomic_init(&a->placing, 0);
+	atomic_init(&a->proxies, NULL);
+	atomic_init(&a->view, NULL);
+	return a;
+}
+
+void auction_publish(auction_t *a, int fields) {
+	auction_t *v = malloc(sizeof(auction_t));
+	rcu_read_lock();
+	auction_t *old = atomic_load(&a->view);
+
+	// Bids and the tick may publish at once; the CAS makes the loser rebuild
+	// from the winner's view, reloading top so the newest bid wins
+	while (1) {
+		v->item_name = a->item_name;
+		v->id = a->id;
+		v->creater = a->creater;
+		v->bin = a->bin;
+		if (!old || (fields & VIEW_BID)) {
+			uint64_t top = atomic_load(&a->top);
+			user_t *leader = user_by_id(topbid_uid(top));
+			v->bid = topbid_bid(top);
+			v->highest_bidder = (leader) ? strdup(leader->username) : NULL;
+		}
+		else {
+			v->bid = old->bid;
+			v->highest_bidder = (old->highest_bidder) ? strdup(old->highest_bidder) : NULL;
+		}
+		v->rticks = (!old || (fields & VIEW_RTICKS)) ? a->rticks : old->rticks;
+		auction_t *src = (!old || (fields & VIEW_WATCHERS)) ? a : old;
+		memcpy(v->users_watching, src->users_watching, sizeof(v->users_watching));
+		atomic_init(&v->top, 0);
+		atomic_init(&v->proxies, NULL);
+		atomic_init(&v->view, NULL);
+
+		if (atomic_compare_exchange_strong(&a->view, &old, v)) break;
+		free(v->highest_bidder);
+	}
+	rcu_read_unlock();
+
+	if (old) rcu_retire(old, free_auction_view);
+}
+
+void free_auction_view(void *view) {
+	auction_t *v = (auction_t *)view;
+	if (v) {
+		free(v->highest_bidder);
+		free(v);
+	}
+}
+
 void free_auction(void *auction) {
 	if (auction) {
 		auction_t *a = (auction_t*) auction;
+		free_auction_view(atomic_load(&a->view));
+		free_proxy_book(atomic_load(&a->proxies));
 		free(a->item_name); a->item_name = NULL;
 		free(a->creater); a->creater = NULL;
 		if (a->highest_bidder) { 
@@ -31,6 +137,26 @@ void free_job(void *job) {
 	}
 }
 
+auction_t* auction_lookup(list_t *auctions, unsigned int id) {
+	node_t *curr = auctions->head;
+	while (curr) {
+		auction_t *a = curr->data;
+		if (a->id == id) return a;
+		curr = curr->next;
+	}
+	return NULL;
+}
+
+user_t* user_lookup(list_t *users, char *username) {
+	node_t *curr = users->head;
+	while (curr) {
+		user_t *u = curr->data;
+		if (!strcmp(u->username, username)) return u;
+		curr = curr->next;
+	}
+	return NULL;
+}
+
 int auction_cmp(void *left, void *right) {
 	if (left && right) {
 		auction_t *l = (auction_t *)left;
@@ -40,6 +166,15 @@ int auction_cmp(void *left, void *right) {
 	} else return 0;
 }
 
+/* Orders batched bids by auction, keeping request order within an auction */
+int bid_req_cmp(const void *left, const void *right) {
+	const bid_req_t *l = (const bid_req_t *)left;
+	const bid_req_t *r = (const bid_req_t *)right;
+
+	if (l->auction_id != r->auction_id) return (l->auction_id < r->auction_id) ? -1 : 1;
+	return l->index - r->index;
+}
+
 char* strjoin(list_t *args, char* delim) {
 	if (args && args->head && args->head->data) {
 		if (args->length == 0) return NULL;
@@ -81,10 +216,43 @@ list_t* strsplit(char *str, char *delim) {
 	return l;
 }
 
-int isWatching(user_t *users_watching[5], user_t *user) {
+int isWatching(user_t *users_watching[], user_t *user) {
 	int i;
 	for (i = 0; i < 5; i++) {
 		if (users_watching[i] == user) return 1;
 	}
 	return 0;
 }
+
+const char* msg_name(int type) {
+	switch (type) {
+		case OK: return "OK";
+		case LOGIN: return "LOGIN";
+		case LOGOUT: return "LOGOUT";
+		case RESUME: return "RESUME";
+		case EUSRLGDIN: return "EUSRLGDIN";
+		case EWRNGPWD: return "EWRNGPWD";
+		case ETOKEN: return "ETOKEN";
+		case ANCREATE: return "ANCREATE";
+		case ANCLOSED: return "ANCLOSED";
+		case JOB_TICK: return "TICK";
+		case ANLIST: return "ANLIST";
+		case ANWATCH: return "ANWATCH";
+		case ANLEAVE: return "ANLEAVE";
+		case ANBID: return "ANBID";
+		case ANUPDATE: return "ANUPDATE";
+		case ANBIDBATCH: return "ANBIDBATCH";
+		case ANPROXY: return "ANPROXY";
+		case EANFULL: return "EANFULL";
+		case EANNOTFOUND: return "EANNOTFOUND";
+		case EANDENIED: return "EANDENIED";
+		case EBIDLOW: return "EBIDLOW";
+		case EINVALIDARG: return "EINVALIDARG";
+		case USRLIST: return "USRLIST";
+		case USRWINS: return "USRWINS";
+		case USRSALES: return "USRSALES";
+		case USRBLNC: return "USRBLNC";
+		case ESERV: return "ESERV";
+		default: return "UNKNOWN";
+	}
+}
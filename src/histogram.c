@@ -0,0 +1,64 @@
+#include "histogram.h"
+#include <string.h>
+
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+
+static int bucket_of(uint64_t v) {
+	if (v >> HIST_MAX_BITS) v = (1ULL << HIST_MAX_BITS) - 1;
+	if (v < (1 << HIST_SUB_BITS)) return v;
+
+	int e = (63 - __builtin_clzll(v)) - HIST_SUB_BITS + 1;
+	return e * HIST_HALF + (v >> e);
+}
+
+/* Largest value that falls into bucket i */
+static uint64_t bucket_top(int i) {
+	if (i < (1 << HIST_SUB_BITS)) return i;
+
+	int e = i / HIST_HALF - 1;
+	uint64_t sub = i - e * HIST_HALF;
+	return ((sub + 1) << e) - 1;
+}
+
+void hist_init(histogram_t *h) {
+	memset(h, 0, sizeof(histogram_t));
+}
+
+void hist_record(histogram_t *h, uint64_t value) {
+	h->counts[bucket_of(value)]++;
+	h->total++;
+	h->sum += value;
+	if (value > h->max) h->max = value;
+}
+
+void hist_merge(histogram_t *dst, histogram_t *src) {
+	int i;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->counts[i] += src->counts[i];
+	}
+	dst->total += src->total;
+	dst->sum += src->sum;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t hist_percentile(histogram_t *h, double p) {
+	if (h->total == 0) return 0;
+
+	uint64_t rank = (uint64_t)(h->total * p / 100.0 + 0.5);
+	if (rank < 1) rank = 1;
+
+	uint64_t seen = 0;
+	int i;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			uint64_t top = bucket_top(i);
+			return (top < h->max) ? top : h->max;
+		}
+	}
+	return h->max;
+}
+
+uint64_t hist_mean(histogram_t *h) {
+	return h->total ? h->sum / h->total : 0;
+}
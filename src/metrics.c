@@ -0,0 +1,188 @@
+#include "metrics.h"
+#include "protocol.h"
+#include "helpers.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <semaphore.h>
+
+typedef struct {
+	atomic_int in_use;
+	// Written only by the owning thread, hence relaxed load + store
+	_Atomic uint64_t counters[M_NUM_COUNTERS];
+	_Atomic uint64_t jobs[256];
+	histogram_t hists[M_NUM_HISTS];
+} metrics_slot_t;
+
+static const char *counter_names[M_NUM_COUNTERS] = {
+	"logins_total",
+	"logins_refused_total",
+	"frames_in_total",
+	"bytes_in_total",
+	"frames_oversize_total",
+	"bids_accepted_total",
+	"bids_rejected_total",
+	"updates_sent_total",
+	"ticks_total",
+	"auctions_closed_total",
+	"shard_handoffs_total",
+	"shard_forwarded_total",
+	"shard_served_total",
+	"repl_events_total",
+	"pool_grown_total",
+	"pool_shrunk_total",
+	"rate_limited_total",
+	"shed_total",
+	"uring_enter_total",
+	"uring_wakeups_total",
+	"bid_retries_total",
+	"bids_early_rejected_total",
+	"proxy_bids_total",
+	"resumes_total",
+	"resumes_refused_total",
+	"sessions_expired_total",
+};
+
+static const char *hist_names[M_NUM_HISTS] = {
+	"enqueue_ns",
+	"queue_wait_ns",
+	"job_ns",
+	"bid_ns",
+	"tick_ns",
+	"trace_read_ns",
+	"trace_enqueue_ns",
+	"trace_queue_ns",
+	"trace_lock_ns",
+	"trace_process_ns",
+	"trace_broadcast_ns",
+	"trace_reply_ns",
+	"trace_total_ns",
+};
+
+static const char *gauge_names[M_NUM_GAUGES] = {
+	"connections",
+	"job_threads",
+};
+
+// Slots are never freed; nslots only grows, so readers can walk [0, nslots)
+static metrics_slot_t slots[METRICS_MAX_SLOTS];
+static atomic_int nslots;
+// Used once every slot is taken; its samples are not reported
+static metrics_slot_t overflow;
+
+static _Atomic int64_t gauges[M_NUM_GAUGES];
+static uint64_t start_ns;
+static sem_t dump_lock;
+
+static __thread metrics_slot_t *self = NULL;
+
+void metrics_init() {
+	start_ns = metrics_now();
+	sem_init(&dump_lock, 0, 1);
+}
+
+uint64_t metrics_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static metrics_slot_t *metrics_slot() {
+	if (self) return self;
+
+	while (!self) {
+		// Reuse a slot released by an exited thread first
+		int i, n = atomic_load(&nslots);
+		for (i = 0; i < n && !self; i++) {
+			int expected = 0;
+			if (atomic_compare_exchange_strong(&slots[i].in_use, &expected, 1)) self = &slots[i];
+		}
+		if (self) break;
+
+		// Grow; a concurrent scan may claim the new slot first, then retry
+		i = atomic_fetch_add(&nslots, 1);
+		if (i >= METRICS_MAX_SLOTS) {
+			atomic_fetch_sub(&nslots, 1);
+			self = &overflow;
+			break;
+		}
+		int expected = 0;
+		if (atomic_compare_exchange_strong(&slots[i].in_use, &expected, 1)) self = &slots[i];
+	}
+	return self;
+}
+
+static inline void slot_add(_Atomic uint64_t *c, uint64_t n) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_count(int counter, uint64_t n) {
+	slot_add(&metrics_slot()->counters[counter], n);
+}
+
+void metrics_record(int hist, uint64_t ns) {
+	hist_record(&metrics_slot()->hists[hist], ns);
+}
+
+void metrics_job(int type, uint64_t ns) {
+	metrics_slot_t *s = metrics_slot();
+	slot_add(&s->jobs[type & 0xff], 1);
+	hist_record(&s->hists[H_JOB], ns);
+	if (type == ANBID) hist_record(&s->hists[H_BID], ns);
+}
+
+void metrics_gauge_add(int gauge, int64_t delta) {
+	atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+}
+
+void metrics_release() {
+	if (self && self != &overflow) atomic_store(&self->in_use, 0);
+	self = NULL;
+}
+
+void metrics_dump(FILE *fp) {
+	uint64_t counters[M_NUM_COUNTERS] = { 0 };
+	uint64_t jobs[256] = { 0 };
+	histogram_t *hists = malloc(M_NUM_HISTS * sizeof(histogram_t));
+	int i, j, n;
+
+	sem_wait(&dump_lock);
+	for (j = 0; j < M_NUM_HISTS; j++) hist_init(&hists[j]);
+
+	n = atomic_load(&nslots);
+	if (n > METRICS_MAX_SLOTS) n = METRICS_MAX_SLOTS;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < M_NUM_COUNTERS; j++) {
+			counters[j] += atomic_load_explicit(&slots[i].counters[j], memory_order_relaxed);
+		}
+		for (j = 0; j < 256; j++) {
+			jobs[j] += atomic_load_explicit(&slots[i].jobs[j], memory_order_relaxed);
+		}
+		for (j = 0; j < M_NUM_HISTS; j++) hist_merge(&hists[j], &slots[i].hists[j]);
+	}
+
+	fprintf(fp, "uptime_seconds %lu\n", (unsigned long)((metrics_now() - start_ns) / 1000000000ULL));
+	for (j = 0; j < M_NUM_GAUGES; j++) {
+		fprintf(fp, "%s %ld\n", gauge_names[j], (long)atomic_load(&gauges[j]));
+	}
+	for (j = 0; j < M_NUM_COUNTERS; j++) {
+		fprintf(fp, "%s %lu\n", counter_names[j], (unsigned long)counters[j]);
+	}
+	for (j = 0; j < 256; j++) {
+		if (jobs[j]) fprintf(fp, "jobs_total{type=\"%s\"} %lu\n", msg_name(j), (unsigned long)jobs[j]);
+	}
+	for (j = 0; j < M_NUM_HISTS; j++) {
+		histogram_t *h = &hists[j];
+		if (j >= H_TRACE_FIRST && !h->total) continue;
+		fprintf(fp, "%s{stat=\"count\"} %lu\n", hist_names[j], (unsigned long)h->total);
+		fprintf(fp, "%s{stat=\"mean\"} %lu\n", hist_names[j], (unsigned long)hist_mean(h));
+		fprintf(fp, "%s{stat=\"p50\"} %lu\n", hist_names[j], (unsigned long)hist_percentile(h, 50));
+		fprintf(fp, "%s{stat=\"p99\"} %lu\n", hist_names[j], (unsigned long)hist_percentile(h, 99));
+		fprintf(fp, "%s{stat=\"p999\"} %lu\n", hist_names[j], (unsigned long)hist_percentile(h, 99.9));
+		fprintf(fp, "%s{stat=\"max\"} %lu\n", hist_names[j], (unsigned long)h->max);
+	}
+	sem_post(&dump_lock);
+
+	free(hists);
+}
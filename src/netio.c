@@ -0,0 +1,417 @@
+#include "netio.h"
+#include "uring.h"
+#include "wire.h"
+#include "metrics.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define NETIO_ENTRIES 4096
+#define NETIO_BUFS 1024 // power of 2
+#define NETIO_BUF_SIZE 4096
+#define NETIO_BGID 0
+#define NETIO_MAX_FDS (1 << 20)
+
+enum { TAG_WAKE = 1, TAG_RECV, TAG_SEND, TAG_HOLD, TAG_CANCEL };
+#define UDATA(tag, fd) (((uint64_t)(tag) << 32) | (uint32_t)(fd))
+
+typedef struct conn {
+	int fd;
+	void *ctx;
+
+	// Owned by the I/O thread
+	char *in; // received bytes not yet handled, with room for a terminator
+	size_t in_len, in_cap;
+	int recv_armed, send_busy, held, closing, failed;
+	int admitted; // the held frame already passed admit
+	struct __kernel_timespec hold_ts;
+	wbuf_t sending;
+	size_t sent;
+
+	// Shared with the sending threads
+	sem_t lock;
+	int open, attach;
+	wbuf_t out; // frames queued since the last send
+
+	// Link in the pending stack while queued is set
+	atomic_int queued;
+	struct conn *next;
+} conn_t;
+
+static int enabled;
+static netio_ops_t *ops;
+static uring_t ring;
+static uring_bufs_t bufs;
+
+// Indexed by fd, a slot is created on first attach and reused
+static _Atomic(conn_t *) *conns;
+static int max_fds;
+static sem_t conns_lock;
+
+// Connections with output or an attach for the I/O thread (a Treiber stack)
+static _Atomic(conn_t *) pending;
+static atomic_int sleeping;
+static int wake_fd;
+static uint64_t wake_buf;
+
+int netio_init(netio_ops_t *o) {
+	if (uring_init(&ring, NETIO_ENTRIES) < 0) return -1;
+	if (uring_bufs_init(&ring, &bufs, NETIO_BGID, NETIO_BUFS, NETIO_BUF_SIZE) < 0) return -1;
+	wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd < 0) return -1;
+
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	max_fds = (rl.rlim_cur < NETIO_MAX_FDS) ? rl.rlim_cur : NETIO_MAX_FDS;
+	conns = calloc(max_fds, sizeof(*conns));
+	sem_init(&conns_lock, 0, 1);
+	ops = o;
+	enabled = 1;
+	return 0;
+}
+
+int netio_enabled() {
+	return enabled;
+}
+
+static void conn_kick(conn_t *c) {
+	if (atomic_exchange(&c->queued, 1)) return;
+	conn_t *head = atomic_load(&pending);
+	do {
+		c->next = head;
+	} while (!atomic_compare_exchange_weak(&pending, &head, c));
+
+	if (atomic_exchange(&sleeping, 0)) {
+		uint64_t one = 1;
+		if (write(wake_fd, &one, sizeof(one)) < 0) perror("netio wake");
+		metrics_count(M_URING_WAKEUPS, 1);
+	}
+}
+
+void netio_attach(int fd, void *ctx) {
+	if (fd >= max_fds) {
+		fprintf(stderr, "netio: fd %d over the limit\n", fd);
+		close(fd);
+		ops->closed(ctx);
+		return;
+	}
+
+	conn_t *c = atomic_load(&conns[fd]);
+	if (!c) {
+		sem_wait(&conns_lock);
+		c = atomic_load(&conns[fd]);
+		if (!c) {
+			c = calloc(1, sizeof(conn_t));
+			c->fd = fd;
+			c->in_cap = 1024;
+			c->in = malloc(c->in_cap + 1);
+			wbuf_init(&c->sending, 256);
+			wbuf_init(&c->out, 256);
+			sem_init(&c->lock, 0, 1);
+			atomic_store(&conns[fd], c);
+		}
+		sem_post(&conns_lock);
+	}
+
+	sem_wait(&c->lock);
+	c->ctx = ctx;
+	c->open = 1;
+	c->attach = 1;
+	wbuf_reset(&c->out);
+	sem_post(&c->lock);
+	conn_kick(c);
+}
+
+int netio_send(int fd, petr_header *ph, char *msg) {
+	conn_t *c = (enabled && fd >= 0 && fd < max_fds) ? atomic_load(&conns[fd]) : NULL;
+	if (c) {
+		petr_header h;
+		memset(&h, 0, sizeof(h));
+		h.msg_len = ph->msg_len;
+		h.msg_type = ph->msg_type;
+
+		sem_wait(&c->lock);
+		if (c->open) {
+			wbuf_put_bytes(&c->out, (char *)&h, sizeof(h));
+			if (h.msg_len) wbuf_put_bytes(&c->out, msg, h.msg_len);
+			sem_post(&c->lock);
+			conn_kick(c);
+			return 0;
+		}
+		sem_post(&c->lock);
+		// The client went away; fd may already belong to someone else
+		if (!c->attach) return -1;
+	}
+	return wr_msg(fd, ph, msg);
+}
+
+// Everything below runs on the I/O thread
+
+static struct io_uring_sqe *get_sqe() {
+	struct io_uring_sqe *sqe;
+	while (!(sqe = uring_sqe(&ring))) {
+		uring_submit(&ring, 0);
+		metrics_count(M_URING_ENTERS, 1);
+	}
+	return sqe;
+}
+
+static void arm_recv(conn_t *c) {
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = NETIO_BGID;
+	sqe->user_data = UDATA(TAG_RECV, c->fd);
+	c->recv_armed = 1;
+}
+
+static void arm_wake() {
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = wake_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&wake_buf;
+	sqe->len = sizeof(wake_buf);
+	sqe->user_data = UDATA(TAG_WAKE, 0);
+}
+
+static void submit_send(conn_t *c) {
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(c->sending.data + c->sent);
+	sqe->len = c->sending.len - c->sent;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = UDATA(TAG_SEND, c->fd);
+	c->send_busy = 1;
+}
+
+// Sends all output queued for c, unless a send is in flight
+static void conn_flush(conn_t *c) {
+	if (c->send_busy) return;
+
+	sem_wait(&c->lock);
+	wbuf_t t = c->sending;
+	c->sending = c->out;
+	c->out = t;
+	wbuf_reset(&c->out);
+	sem_post(&c->lock);
+
+	c->sent = 0;
+	if (c->sending.len) submit_send(c);
+}
+
+static void cancel_recv(conn_t *c) {
+	if (!c->recv_armed) return;
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = UDATA(TAG_RECV, c->fd);
+	sqe->user_data = UDATA(TAG_CANCEL, c->fd);
+}
+
+// Stops reading; the connection is closed once nothing is in flight
+static void conn_shut(conn_t *c) {
+	if (c->closing) return;
+	c->closing = 1;
+	cancel_recv(c);
+}
+
+static void conn_maybe_close(conn_t *c) {
+	if (!c->closing || c->recv_armed || c->held) return;
+	// A LOGOUT reply still has to go out
+	if (!c->failed) conn_flush(c);
+	if (c->send_busy) return;
+
+	sem_wait(&c->lock);
+	c->open = 0;
+	wbuf_reset(&c->out);
+	sem_post(&c->lock);
+	ops->closed(c->ctx);
+	close(c->fd);
+}
+
+// Nothing is received while held, so a client over its rate cannot grow
+// its input; the recv is armed again when the hold ends
+static void conn_hold(conn_t *c, uint64_t ns) {
+	c->held = 1;
+	cancel_recv(c);
+	c->hold_ts.tv_sec = ns / 1000000000ULL;
+	c->hold_ts.tv_nsec = ns % 1000000000ULL;
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t)(uintptr_t)&c->hold_ts;
+	sqe->len = 1;
+	sqe->user_data = UDATA(TAG_HOLD, c->fd);
+}
+
+// Hands every complete frame received on c to the server
+static void conn_parse(conn_t *c) {
+	size_t pos = 0;
+	while (!c->closing && !c->held && c->in_len - pos >= sizeof(petr_header)) {
+		petr_header ph;
+		memcpy(&ph, c->in + pos, sizeof(ph));
+		// Never buffered: the client is dropped
+		if (ph.msg_len > PETR_MAX_MSG_LEN) {
+			metrics_count(M_FRAMES_OVERSIZE, 1);
+			c->failed = 1;
+			conn_shut(c);
+			break;
+		}
+		size_t total = sizeof(ph) + ph.msg_len;
+		if (c->in_len - pos < total) break;
+
+		if (!c->admitted) {
+			uint64_t wait = ops->admit(c->ctx, ph.msg_type);
+			if (wait) {
+				c->admitted = 1;
+				conn_hold(c, wait);
+				break;
+			}
+		}
+		c->admitted = 0;
+
+		// Terminated in place for the handler, the byte is restored after
+		char *body = c->in + pos + sizeof(ph);
+		char saved = body[ph.msg_len];
+		body[ph.msg_len] = '\0';
+		int ret = ops->frame(c->ctx, &ph, body);
+		body[ph.msg_len] = saved;
+		pos += total;
+		if (ret < 0) conn_shut(c);
+	}
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+}
+
+static void conn_input(conn_t *c, const char *data, size_t len) {
+	// Holds at most one frame of PETR_MAX_MSG_LEN and a receive buffer,
+	// conn_parse drops a client announcing more
+	if (c->in_len + len > sizeof(petr_header) + PETR_MAX_MSG_LEN + NETIO_BUF_SIZE) {
+		metrics_count(M_FRAMES_OVERSIZE, 1);
+		c->failed = 1;
+		conn_shut(c);
+		return;
+	}
+	if (c->in_len + len > c->in_cap) {
+		size_t cap = c->in_cap;
+		while (c->in_len + len > cap) cap *= 2;
+		char *in = realloc(c->in, cap + 1);
+		if (!in) {
+			c->failed = 1;
+			conn_shut(c);
+			return;
+		}
+		c->in = in;
+		c->in_cap = cap;
+	}
+	memcpy(c->in + c->in_len, data, len);
+	c->in_len += len;
+	conn_parse(c);
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe) {
+	int tag = cqe->user_data >> 32;
+	int fd = (int)(uint32_t)cqe->user_data;
+	int res = cqe->res;
+
+	if (tag == TAG_WAKE) {
+		arm_wake();
+		return;
+	}
+	conn_t *c = atomic_load(&conns[fd]);
+	if (!c || tag == TAG_CANCEL) return;
+
+	if (tag == TAG_RECV) {
+		if (!(cqe->flags & IORING_CQE_F_MORE)) c->recv_armed = 0;
+		if (res > 0) {
+			unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (!c->closing) conn_input(c, uring_buf(&bufs, bid), res);
+			uring_buf_put(&bufs, bid);
+			if (!c->recv_armed && !c->closing && !c->held) arm_recv(c);
+		}
+		else if ((res == -ENOBUFS || res == -ECANCELED) && !c->closing) {
+			// Out of buffers, or cancelled by conn_hold
+			if (!c->recv_armed && !c->held) arm_recv(c);
+		}
+		else {
+			// EOF, an error or cancelled by conn_shut
+			if (res != -ECANCELED) c->failed = 1;
+			conn_shut(c);
+		}
+	}
+	else if (tag == TAG_SEND) {
+		c->send_busy = 0;
+		if (res < 0) {
+			c->failed = 1;
+			conn_shut(c);
+		}
+		else {
+			c->sent += res;
+			if (c->sent < c->sending.len) submit_send(c);
+			else conn_flush(c);
+		}
+	}
+	else if (tag == TAG_HOLD) {
+		c->held = 0;
+		if (!c->closing) conn_parse(c);
+		if (!c->recv_armed && !c->closing && !c->held) arm_recv(c);
+	}
+	conn_maybe_close(c);
+}
+
+void *netio_thread() {
+	pthread_detach(pthread_self());
+	arm_wake();
+
+	while (1) {
+		conn_t *c = atomic_exchange(&pending, NULL);
+		while (c) {
+			conn_t *next = c->next;
+			atomic_store(&c->queued, 0);
+
+			sem_wait(&c->lock);
+			int attach = c->attach;
+			c->attach = 0;
+			sem_post(&c->lock);
+			if (attach) {
+				c->in_len = 0;
+				c->held = c->admitted = c->closing = c->failed = 0;
+				c->send_busy = 0;
+				if (ops->opened(c->ctx) < 0) c->closing = 1;
+				else arm_recv(c);
+			}
+			conn_flush(c);
+			if (attach && c->closing) conn_maybe_close(c);
+			c = next;
+		}
+
+		// Sleep only if nothing is ready; conn_kick writes the eventfd when
+		// it finds sleeping set
+		atomic_store(&sleeping, 1);
+		int wait = !atomic_load(&pending) && !uring_cqe(&ring);
+		if (!wait) atomic_store(&sleeping, 0);
+		if (wait || ring.sqe_tail != *ring.sq_tail) {
+			uring_submit(&ring, wait);
+			metrics_count(M_URING_ENTERS, 1);
+		}
+		atomic_store(&sleeping, 0);
+
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_cqe(&ring))) {
+			struct io_uring_cqe copy = *cqe;
+			uring_cqe_seen(&ring);
+			handle_cqe(&copy);
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,74 @@
+#include "pool.h"
+#include "metrics.h"
+#include <stdatomic.h>
+#include <stdio.h>
+
+int pool_min = 2, pool_max = 2;
+
+static atomic_int size, next_index;
+
+// Queue waits recorded since the last pool_grow
+static _Atomic uint64_t wait_sum, wait_count;
+
+int pool_parse(char *spec) {
+	int lo, hi;
+	char end;
+	int n = sscanf(spec, "%d-%d%c", &lo, &hi, &end);
+	if (n == 1 && sscanf(spec, "%d%c", &lo, &end) == 1) hi = lo;
+	else if (n != 2) return -1;
+	if (lo < 1 || hi < lo) return -1;
+	pool_min = lo;
+	pool_max = hi;
+	return 0;
+}
+
+void pool_init() {
+	atomic_init(&size, 0);
+	atomic_init(&next_index, 0);
+	atomic_init(&wait_sum, 0);
+	atomic_init(&wait_count, 0);
+}
+
+int pool_elastic() {
+	return pool_min < pool_max;
+}
+
+int pool_size() {
+	return atomic_load(&size);
+}
+
+int pool_spawn() {
+	atomic_fetch_add(&size, 1);
+	metrics_gauge_add(G_JOB_THREADS, 1);
+	return atomic_fetch_add(&next_index, 1);
+}
+
+void pool_record_wait(uint64_t ns) {
+	atomic_fetch_add(&wait_sum, ns);
+	atomic_fetch_add(&wait_count, 1);
+}
+
+int pool_retire() {
+	int n = atomic_load(&size);
+	do {
+		if (n <= pool_min) return 0;
+	} while (!atomic_compare_exchange_weak(&size, &n, n - 1));
+	metrics_gauge_add(G_JOB_THREADS, -1);
+	metrics_count(M_POOL_SHRUNK, 1);
+	return 1;
+}
+
+int pool_grow(int depth, uint64_t *mean_wait) {
+	uint64_t count = atomic_exchange(&wait_count, 0);
+	uint64_t sum = atomic_exchange(&wait_sum, 0);
+	*mean_wait = (count) ? sum / count : 0;
+
+	int n = atomic_load(&size);
+	if (n >= pool_max) return 0;
+	if (*mean_wait < POOL_GROW_WAIT_NS && depth < n) return 0;
+
+	int add = (depth > 2 * n) ? n : 1;
+	if (n + add > pool_max) add = pool_max - n;
+	metrics_count(M_POOL_GROWN, add);
+	return add;
+}
@@ -0,0 +1,65 @@
+#include "proxy.h"
+#include <stdlib.h>
+#include <string.h>
+
+proxy_book_t *proxy_book(auction_t *auction, int create) {
+	proxy_book_t *book = atomic_load(&auction->proxies);
+	if (book || !create) return book;
+
+	book = malloc(sizeof(proxy_book_t));
+	sem_init(&book->lock, 0, 1);
+	book->n = 0;
+	book->cap = 4;
+	book->entries = malloc(book->cap * sizeof(proxy_t));
+
+	// Two first ANPROXYs may race, the loser uses the winner's book
+	proxy_book_t *expected = NULL;
+	if (!atomic_compare_exchange_strong(&auction->proxies, &expected, book)) {
+		free_proxy_book(book);
+		return expected;
+	}
+	return book;
+}
+
+void free_proxy_book(proxy_book_t *book) {
+	if (book) {
+		sem_destroy(&book->lock);
+		free(book->entries);
+		free(book);
+	}
+}
+
+void proxy_remove(proxy_book_t *book, int i) {
+	memmove(&book->entries[i], &book->entries[i + 1], (book->n - i - 1) * sizeof(proxy_t));
+	book->n--;
+}
+
+void proxy_set(proxy_book_t *book, user_t *user, unsigned long max) {
+	int i;
+	for (i = 0; i < book->n; i++) {
+		if (book->entries[i].user == user) {
+			proxy_remove(book, i);
+			break;
+		}
+	}
+	if (max == 0) return;
+
+	if (book->n == book->cap) {
+		book->cap *= 2;
+		book->entries = realloc(book->entries, book->cap * sizeof(proxy_t));
+	}
+	// After every entry with the same max, so ties go to the earlier proxy
+	for (i = 0; i < book->n && book->entries[i].max >= max; i++);
+	memmove(&book->entries[i + 1], &book->entries[i], (book->n - i) * sizeof(proxy_t));
+	book->entries[i].user = user;
+	book->entries[i].max = max;
+	book->n++;
+}
+
+void proxy_prune(proxy_book_t *book, uint32_t leader, unsigned long bid) {
+	int i = 0;
+	while (i < book->n) {
+		if (book->entries[i].user->id != leader && book->entries[i].max <= bid) proxy_remove(book, i);
+		else i++;
+	}
+}
@@ -0,0 +1,91 @@
+#include "ratelimit.h"
+#include "protocol.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Interval between requests and tolerated burst, in ns; 0 = not limited
+static uint64_t interval[256], tolerance[256];
+
+static uint64_t target_ns;
+static _Atomic uint64_t wait_avg;
+
+static const struct {
+	const char *name;
+	int type;
+} type_names[] = {
+	{ "create", ANCREATE },
+	{ "list", ANLIST },
+	{ "watch", ANWATCH },
+	{ "leave", ANLEAVE },
+	{ "bid", ANBID },
+	{ "batch", ANBIDBATCH },
+	{ "proxy", ANPROXY },
+	{ "users", USRLIST },
+	{ "wins", USRWINS },
+	{ "sales", USRSALES },
+	{ "balance", USRBLNC },
+	{ "*", -1 },
+};
+
+int ratelimit_parse(char *spec) {
+	char *save, *tok, *copy = strdup(spec);
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char name[16], end;
+		unsigned long rate, burst;
+		if (sscanf(tok, "%15[^=]=%lu/%lu%c", name, &rate, &burst, &end) != 3 || rate == 0 || burst == 0) goto fail;
+
+		unsigned int i;
+		for (i = 0; i < sizeof(type_names) / sizeof(type_names[0]); i++) {
+			if (!strcmp(name, type_names[i].name)) break;
+		}
+		if (i == sizeof(type_names) / sizeof(type_names[0])) goto fail;
+
+		// "*" sets every type not given its own rate
+		int t, type = type_names[i].type;
+		for (t = 0; t < 256; t++) {
+			if (t != type && (type >= 0 || interval[t])) continue;
+			interval[t] = 1000000000ULL / rate;
+			tolerance[t] = (burst - 1) * interval[t];
+		}
+	}
+	free(copy);
+	return 0;
+
+fail:
+	free(copy);
+	return -1;
+}
+
+void ratelimit_set_target(long us) {
+	target_ns = (us > 0) ? us * 1000ULL : 0;
+}
+
+void ratelimit_init(ratelimit_t *rl) {
+	memset(rl, 0, sizeof(*rl));
+}
+
+uint64_t ratelimit_take(ratelimit_t *rl, int type, uint64_t now) {
+	type &= 0xff;
+	if (!interval[type]) return 0;
+
+	// The request conforms if its theoretical arrival time is at most the
+	// burst tolerance ahead of now; otherwise it waits until it is
+	uint64_t tat = (rl->tat[type] > now) ? rl->tat[type] : now;
+	uint64_t wait = (tat - now > tolerance[type]) ? tat - now - tolerance[type] : 0;
+	rl->tat[type] = tat + interval[type];
+	return wait;
+}
+
+void ratelimit_observe_wait(uint64_t ns) {
+	if (!target_ns) return;
+	// Average over about the last 16 jobs; concurrent updates may lose a
+	// sample, which does not matter for an average
+	uint64_t avg = atomic_load_explicit(&wait_avg, memory_order_relaxed);
+	atomic_store_explicit(&wait_avg, avg - avg / 16 + ns / 16, memory_order_relaxed);
+}
+
+int ratelimit_overloaded() {
+	return target_ns && atomic_load_explicit(&wait_avg, memory_order_relaxed) > target_ns;
+}
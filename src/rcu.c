@@ -0,0 +1,169 @@
+#include "rcu.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+
+#define RCU_RECLAIM_BATCH 64
+
+typedef struct retired {
+	void *p;
+	void (*free_fn)(void *);
+	uint64_t epoch;
+	struct retired *next;
+} retired_t;
+
+// Epoch a reader entered with, 0 while the thread is outside a read section
+typedef struct {
+	atomic_int in_use;
+	_Atomic uint64_t epoch;
+} reader_t;
+
+static reader_t readers[RCU_MAX_READERS];
+static atomic_int nreaders;
+// Readers inside a section without a slot, all slots being taken
+static atomic_int unslotted;
+static _Atomic uint64_t global_epoch = 1;
+
+static retired_t *retired = NULL;
+static long npending;
+static sem_t retired_lock;
+
+static __thread reader_t *self = NULL;
+static __thread int depth = 0;
+
+void rcu_init() {
+	sem_init(&retired_lock, 0, 1);
+}
+
+// NULL if every slot is taken; retried at the thread's next section
+static reader_t *reader_slot() {
+	while (!self) {
+		// Reuse a slot released by an exited thread first
+		int i, n = atomic_load(&nreaders);
+		for (i = 0; i < n && !self; i++) {
+			int expected = 0;
+			if (atomic_compare_exchange_strong(&readers[i].in_use, &expected, 1)) self = &readers[i];
+		}
+		if (self || n == RCU_MAX_READERS) break;
+
+		// Grow; a concurrent scan may claim the new slot first, then retry
+		if (!atomic_compare_exchange_strong(&nreaders, &n, n + 1)) continue;
+		int expected = 0;
+		if (atomic_compare_exchange_strong(&readers[n].in_use, &expected, 1)) self = &readers[n];
+	}
+	return self;
+}
+
+void rcu_read_lock() {
+	if (depth++) return;
+	reader_t *r = reader_slot();
+	if (r) atomic_store(&r->epoch, atomic_load(&global_epoch));
+	else atomic_fetch_add(&unslotted, 1);
+}
+
+int rcu_try_read_lock() {
+	if (!depth && !reader_slot()) return -1;
+	rcu_read_lock();
+	return 0;
+}
+
+void rcu_read_unlock() {
+	if (--depth) return;
+	if (self) atomic_store(&self->epoch, 0);
+	else atomic_fetch_sub(&unslotted, 1);
+}
+
+void rcu_thread_exit() {
+	if (self) {
+		atomic_store(&self->epoch, 0);
+		atomic_store(&self->in_use, 0);
+	}
+	self = NULL;
+}
+
+void rcu_retire(void *p, void (*free_fn)(void *)) {
+	retired_t *r = malloc(sizeof(retired_t));
+	r->p = p;
+	r->free_fn = free_fn;
+	// Readers that enter from now on see the new epoch and cannot hold p
+	r->epoch = atomic_fetch_add(&global_epoch, 1);
+
+	sem_wait(&retired_lock);
+	r->next = retired;
+	retired = r;
+	int reclaim = (++npending % RCU_RECLAIM_BATCH) == 0;
+	sem_post(&retired_lock);
+
+	if (reclaim) rcu_reclaim();
+}
+
+void rcu_reclaim() {
+	// A reader without a slot may be using anything retired while it is in
+	if (atomic_load(&unslotted)) return;
+
+	// Oldest epoch any reader may still be using
+	uint64_t min = atomic_load(&global_epoch);
+	int i, n = atomic_load(&nreaders);
+	for (i = 0; i < n; i++) {
+		uint64_t e = atomic_load(&readers[i].epoch);
+		if (e && e < min) min = e;
+	}
+
+	retired_t *ready = NULL;
+	sem_wait(&retired_lock);
+	retired_t **link = &retired;
+	while (*link) {
+		retired_t *r = *link;
+		if (r->epoch < min) {
+			*link = r->next;
+			r->next = ready;
+			ready = r;
+			npending--;
+		}
+		else link = &r->next;
+	}
+	sem_post(&retired_lock);
+
+	while (ready) {
+		retired_t *r = ready;
+		ready = r->next;
+		r->free_fn(r->p);
+		free(r);
+	}
+}
+
+long rcu_pending() {
+	sem_wait(&retired_lock);
+	long n = npending;
+	sem_post(&retired_lock);
+	return n;
+}
+
+void rcu_array_init(rcu_array_ref *ref, int cap) {
+	rcu_array_t *a = malloc(sizeof(rcu_array_t) + cap * sizeof(void *));
+	atomic_init(&a->n, 0);
+	a->cap = cap;
+	atomic_init(ref, a);
+}
+
+void rcu_array_append(rcu_array_ref *ref, void *item) {
+	rcu_array_t *a = atomic_load(ref);
+	int n = atomic_load(&a->n);
+
+	if (n == a->cap) {
+		// Readers keep using the old array until they leave their section
+		rcu_array_t *grown = malloc(sizeof(rcu_array_t) + 2 * a->cap * sizeof(void *));
+		memcpy(grown->items, a->items, n * sizeof(void *));
+		atomic_init(&grown->n, n);
+		grown->cap = 2 * a->cap;
+		grown->items[n] = item;
+		atomic_store(&grown->n, n + 1);
+		atomic_store(ref, grown);
+		rcu_retire(a, free);
+		return;
+	}
+
+	a->items[n] = item;
+	atomic_store(&a->n, n + 1);
+}
@@ -0,0 +1,283 @@
+#include "repl.h"
+#include "metrics.h"
+#include "protocol.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int enabled;
+static void (*snapshot_fn)(wbuf_t *b);
+
+// Threads between repl_begin and repl_end, and whether a snapshot waits for
+// them to drain
+static atomic_int active, pausing;
+static __thread int depth;
+
+// Events not yet handed to the sender thread, guarded by log_lock
+static wbuf_t log_buf;
+static size_t event_start;
+static sem_t log_lock;
+static atomic_int attached;
+
+// Set by the sender before sleeping, log_ready wakes it up
+static atomic_int sender_waiting;
+static sem_t log_ready;
+
+void repl_init() {
+	sem_init(&log_lock, 0, 1);
+	sem_init(&log_ready, 0, 0);
+	wbuf_init(&log_buf, 4096);
+}
+
+void repl_enable(void (*snapshot)(wbuf_t *b)) {
+	snapshot_fn = snapshot;
+	enabled = 1;
+}
+
+void repl_begin() {
+	if (!enabled || depth++) return;
+	while (1) {
+		atomic_fetch_add(&active, 1);
+		if (!atomic_load(&pausing)) return;
+		atomic_fetch_sub(&active, 1);
+		while (atomic_load(&pausing)) usleep(50);
+	}
+}
+
+void repl_end() {
+	if (!enabled || --depth) return;
+	atomic_fetch_sub(&active, 1);
+}
+
+size_t repl_frame_begin(wbuf_t *b, int type) {
+	petr_header ph;
+	memset(&ph, 0, sizeof(ph));
+	ph.msg_type = type;
+	size_t start = b->len;
+	wbuf_put_bytes(b, (char *)&ph, sizeof(ph));
+	return start;
+}
+
+void repl_frame_end(wbuf_t *b, size_t start) {
+	uint32_t len = b->len - start - sizeof(petr_header);
+	memcpy(b->data + start, &len, sizeof(len));
+}
+
+wbuf_t *repl_event_begin(int type) {
+	if (!atomic_load(&attached)) return NULL;
+	sem_wait(&log_lock);
+	if (!atomic_load(&attached)) {
+		sem_post(&log_lock);
+		return NULL;
+	}
+	event_start = repl_frame_begin(&log_buf, type);
+	return &log_buf;
+}
+
+void repl_event_end(wbuf_t *b) {
+	repl_frame_end(b, event_start);
+	// The sender notices and drops the replica
+	if (b->len > REPL_MAX_BACKLOG) atomic_store(&attached, 0);
+	sem_post(&log_lock);
+	metrics_count(M_REPL_EVENTS, 1);
+	if (atomic_exchange(&sender_waiting, 0)) sem_post(&log_ready);
+}
+
+void repl_put_user(wbuf_t *b, user_t *u) {
+	wbuf_put_str(b, u->username);
+	wbuf_put_str(b, u->password);
+	wbuf_put_u64(b, atomic_load(&u->balance));
+	wbuf_put_u64(b, atomic_load(&u->committed));
+}
+
+void repl_put_auction(wbuf_t *b, auction_t *a, uint32_t rticks) {
+	wbuf_put_u32(b, a->id);
+	wbuf_put_str(b, a->creater);
+	wbuf_put_str(b, a->item_name);
+	wbuf_put_u64(b, a->bin);
+	wbuf_put_u32(b, rticks);
+	uint64_t top = atomic_load(&a->top);
+	user_t *leader = user_by_id(topbid_uid(top));
+	wbuf_put_u64(b, topbid_bid(top));
+	wbuf_put_str(b, (leader) ? leader->username : NULL);
+
+	int i, n = 0;
+	for (i = 0; i < 5; i++) {
+		if (a->users_watching[i]) n++;
+	}
+	wbuf_put_u8(b, n);
+	for (i = 0; i < 5; i++) {
+		if (a->users_watching[i]) wbuf_put_str(b, a->users_watching[i]->username);
+	}
+}
+
+int repl_attached() {
+	return atomic_load(&attached);
+}
+
+size_t repl_backlog() {
+	sem_wait(&log_lock);
+	size_t len = log_buf.len;
+	sem_post(&log_lock);
+	return len;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+	while (len) {
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void stream(int fd) {
+	wbuf_t out;
+	wbuf_init(&out, 4096);
+
+	while (1) {
+		sem_wait(&log_lock);
+		wbuf_t tmp = out;
+		out = log_buf;
+		log_buf = tmp;
+		wbuf_reset(&log_buf);
+		int dropped = !atomic_load(&attached);
+		sem_post(&log_lock);
+		if (dropped) {
+			fprintf(stderr, "replica fell behind, dropped\n");
+			break;
+		}
+
+		if (out.len) {
+			if (write_all(fd, out.data, out.len) < 0) break;
+			wbuf_reset(&out);
+			continue;
+		}
+
+		// Idle: sleep until an event is logged, or send a heartbeat
+		atomic_store(&sender_waiting, 1);
+		sem_wait(&log_lock);
+		int pending = log_buf.len > 0;
+		sem_post(&log_lock);
+		if (pending) {
+			atomic_store(&sender_waiting, 0);
+			continue;
+		}
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += REPL_HEARTBEAT_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if (sem_timedwait(&log_ready, &ts) < 0) {
+			atomic_store(&sender_waiting, 0);
+			wbuf_t hb;
+			wbuf_init(&hb, sizeof(petr_header));
+			repl_frame_end(&hb, repl_frame_begin(&hb, EV_HEARTBEAT));
+			int ret = write_all(fd, hb.data, hb.len);
+			wbuf_free(&hb);
+			if (ret < 0) break;
+		}
+	}
+	wbuf_free(&out);
+}
+
+void *repl_thread(void *path) {
+	pthread_detach(pthread_self());
+
+	int repl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, (char *)path, sizeof(addr.sun_path) - 1);
+	unlink(addr.sun_path);
+
+	if (repl_fd < 0 || bind(repl_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(repl_fd, 1) != 0) {
+		perror("replication socket");
+		return NULL;
+	}
+
+	while (1) {
+		int fd = accept(repl_fd, NULL, NULL);
+		if (fd < 0) continue;
+
+		// Snapshot at a point where no replicated change is half done; the
+		// log is switched on in the same pause, so every later change is
+		// streamed and none is in both
+		atomic_store(&pausing, 1);
+		while (atomic_load(&active)) usleep(50);
+		sem_wait(&log_lock);
+		wbuf_reset(&log_buf);
+		snapshot_fn(&log_buf);
+		repl_frame_end(&log_buf, repl_frame_begin(&log_buf, EV_READY));
+		atomic_store(&attached, 1);
+		sem_post(&log_lock);
+		atomic_store(&pausing, 0);
+		printf("Replica attached\n");
+
+		stream(fd);
+
+		atomic_store(&attached, 0);
+		sem_wait(&log_lock);
+		wbuf_reset(&log_buf);
+		sem_post(&log_lock);
+		close(fd);
+		printf("Replica detached\n");
+	}
+	return NULL;
+}
+
+void repl_follow(char *path, void (*apply)(int type, rbuf_t *r)) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	int fd;
+	while (1) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) break;
+		close(fd);
+		usleep(100000);
+	}
+	printf("Following primary at %s\n", path);
+
+	// Heartbeats arrive every REPL_HEARTBEAT_MS, silence means the primary is gone
+	struct timeval tv = { REPL_TIMEOUT_MS / 1000, (REPL_TIMEOUT_MS % 1000) * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	size_t cap = 1024;
+	char *body = malloc(cap);
+	while (1) {
+		petr_header ph;
+		if (recv(fd, &ph, sizeof(ph), MSG_WAITALL) != sizeof(ph)) break;
+		if (ph.msg_len > cap) {
+			cap = ph.msg_len;
+			body = realloc(body, cap);
+		}
+		if (ph.msg_len && recv(fd, body, ph.msg_len, MSG_WAITALL) != ph.msg_len) break;
+
+		if (ph.msg_type == EV_HEARTBEAT) continue;
+		if (ph.msg_type == EV_READY) {
+			printf("Replica in sync\n");
+			continue;
+		}
+		rbuf_t r;
+		rbuf_init(&r, body, ph.msg_len);
+		apply(ph.msg_type, &r);
+	}
+	free(body);
+	close(fd);
+}
@@ -1,39 +1,121 @@
 #include "sbuf.h"
+#include <errno.h>
+#include <time.h>
 
 /* Create an empty, bounded, shared FIFO buffer with n slots */
 void sbuf_init(sbuf_t *sp, int n) {
-	sp->buf = calloc(n, sizeof(job_t));
-	sp->n = n; /* Buffer holds max of n items */
-	sp->front = sp->rear = 0; /* Empty buffer iff front == rear */
+	int weight = 1;
+	sbuf_init_lanes(sp, n, 1, &weight);
+}
+
+/* Create nlanes empty lanes of n slots each */
+void sbuf_init_lanes(sbuf_t *sp, int n, int nlanes, const int *weights) {
+	int i;
+	sp->lanes = calloc(nlanes, sizeof(sbuf_lane_t));
+	sp->nlanes = nlanes;
+	sp->n = n; /* Each lane holds max of n items */
+	for (i = 0; i < nlanes; i++) {
+		sbuf_lane_t *l = &sp->lanes[i];
+		l->buf = calloc(n, sizeof(void *));
+		l->front = l->rear = 0; /* Empty lane iff front == rear */
+		l->count = 0;
+		l->weight = l->credit = (weights[i] > 0) ? weights[i] : 1;
+		sem_init(&l->slots, 0, n); /* Initially, each lane has n empty slots */
+	}
 	sem_init(&sp->mutex, 0, 1); /* Binary semaphore for locking */
-	sem_init(&sp->slots, 0, n); /* Initially, buf has n empty slots */
 	sem_init(&sp->items, 0, 0); /* Initially, buf has 0 items */
 }
 
 /* Clean up buffer sp */
 void sbuf_deinit(sbuf_t *sp) {
 	if (sp) {
-		free(sp->buf);
+		int i;
+		for (i = 0; i < sp->nlanes; i++) free(sp->lanes[i].buf);
+		free(sp->lanes);
 		free(sp);
 	}
 }
 
-/* Insert item onto the rear of shared buffer sp */
+/* Insert item onto the rear of lane 0 of shared buffer sp */
 void sbuf_insert(sbuf_t *sp, void *ptr) {
-	sem_wait(&sp->slots); /* Wait for available slot */
+	sbuf_reserve(sp, 0);
+	sbuf_put(sp, 0, ptr);
+}
+
+/* Wait for an available slot in lane; must be followed by sbuf_put */
+void sbuf_reserve(sbuf_t *sp, int lane) {
+	sem_wait(&sp->lanes[lane].slots);
+}
+
+/* Insert item into the slot taken by sbuf_reserve */
+void sbuf_put(sbuf_t *sp, int lane, void *ptr) {
+	sbuf_lane_t *l = &sp->lanes[lane];
 	sem_wait(&sp->mutex); /* Lock the buffer */
-	sp->buf[(++sp->rear)%(sp->n)] = ptr; /* Insert the item */
+	l->buf[(++l->rear)%(sp->n)] = ptr; /* Insert the item */
+	l->count++;
 	sem_post(&sp->mutex); /* Unlock the buffer */
 	sem_post(&sp->items); /* Announce available item */
 }
 
-/* Remove and return the first item from buffer sp */
-void* sbuf_remove(sbuf_t *sp) {
-	void *ptr;
-	sem_wait(&sp->items); /* Wait for available item */
+/* Remove the next item in weighted round robin order; an item is available */
+static void* sbuf_take(sbuf_t *sp) {
+	sbuf_lane_t *l = NULL;
+	int i, pass;
+
 	sem_wait(&sp->mutex); /* Lock the buffer */
-	ptr = sp->buf[(++sp->front)%(sp->n)]; /* Remove the item */
+	for (pass = 0; pass < 2 && !l; pass++) {
+		for (i = 0; i < sp->nlanes; i++) {
+			if (sp->lanes[i].count && sp->lanes[i].credit > 0) {
+				l = &sp->lanes[i];
+				break;
+			}
+		}
+		/* Every non-empty lane used its share: start a new round */
+		if (!l) {
+			for (i = 0; i < sp->nlanes; i++) sp->lanes[i].credit = sp->lanes[i].weight;
+		}
+	}
+	l->credit--;
+	l->count--;
+	void *ptr = l->buf[(++l->front)%(sp->n)]; /* Remove the item */
 	sem_post(&sp->mutex); /* Unlock the buffer */
-	sem_post(&sp->slots); /* Announce available slot */
+	sem_post(&l->slots); /* Announce available slot */
 	return ptr;
-}
\ No newline at end of file
+}
+
+/* Remove and return the next item from buffer sp */
+void* sbuf_remove(sbuf_t *sp) {
+	sem_wait(&sp->items); /* Wait for available item */
+	return sbuf_take(sp);
+}
+
+/* Remove the next item, waiting at most ms milliseconds for one */
+void* sbuf_remove_timed(sbuf_t *sp, int ms) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	while (sem_timedwait(&sp->items, &ts) < 0) {
+		if (errno != EINTR) return NULL;
+	}
+	return sbuf_take(sp);
+}
+
+/* Number of items currently waiting in buffer sp */
+int sbuf_length(sbuf_t *sp) {
+	int items;
+	sem_getvalue(&sp->items, &items);
+	return items;
+}
+
+/* Number of items currently waiting in lane */
+int sbuf_lane_length(sbuf_t *sp, int lane) {
+	sem_wait(&sp->mutex);
+	int count = sp->lanes[lane].count;
+	sem_post(&sp->mutex);
+	return count;
+}
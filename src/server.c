@@ -10,11 +10,31 @@
 list_t *users, *auctions;
 unsigned int auctionID = 1;
 
+// Accounts standing in for other shards' users on this shard's auctions
+list_t *proxies;
+sem_t proxies_lock;
+
+// The auctions' users_watching slots and the users' watching lists
+sem_t watchers_lock;
+
 sem_t users_rlock, users_wlock, auctions_rlock, auctions_wlock;
 int users_rcount, auctions_rcount;
 
+// Every auction/user in creation order, for the lock-free read-only
+// queries (ANLIST, USRLIST, USRWINS, USRSALES). Writers append while
+// holding the respective write lock.
+rcu_array_ref auction_index, user_index;
+
+// Remaining ticks of every local auction, see ticker.h
+ticker_t ticker;
+
 sbuf_t *job_queue;
 
+// Jobs raised by a job thread itself (e.g. ANCLOSED after a buy-it-now bid).
+// Inserting those into the bounded job_queue could block every job thread
+// on a full queue, so they are run by the same thread instead.
+__thread list_t *local_jobs = NULL;
+
 // Currently running thread ids
 pthread_t threadids[THREADIDS_SIZE];
 sem_t threadids_wlock;
@@ -27,17 +47,52 @@ sem_t logfile_wlock;
 // Global listen file descriptor
 int listen_fd;
 
+// Unix socket path of the admin endpoint, NULL if disabled
+char *admin_path = NULL;
+
+// Credit allowed beyond a user's balance for leading bids, -1 for no limit
+long credit_limit = -1;
+
+// Directory of the shards' Unix sockets, NULL for the default
+char *shard_dir = NULL;
+
+// Unix socket a replica attaches to (-r), or of the primary to follow (-f)
+char *repl_path = NULL, *follow_path = NULL;
+
+// Serve clients from an io_uring instead of client threads (-u)
+int use_uring = 0;
+
+// Ticks only on the admin command "tick N" (-t v)
+int virtual_clock = 0;
+
+// Ticks run so far
+int tick_counter = 0;
+
+// Partitions of the running tick: the ticking thread runs part 0, job
+// threads the others as JOB_TICK jobs, adding up what they closed in
+// tick_closed and posting tick_done
+int tick_parts = 1;
+int tick_part_ids[TICKER_MAX_CHUNKS];
+atomic_long tick_closed;
+sem_t tick_done;
+
 void shutdown_server() {
     int i;
     sem_wait(&threadids_wlock);
     for (i = 0; i < THREADIDS_SIZE; i++) {
-        pthread_cancel(threadids[i]);
+        if (threadids[i]) pthread_cancel(threadids[i]);
     }
     close(listen_fd);
+    if (admin_path) unlink(admin_path);
+    if (shard_count > 1) shard_unlink();
+    if (repl_path) unlink(repl_path);
     deleteList(users);
+    deleteList(proxies);
     deleteList(auctions);
+    ticker_free(&ticker);
     sbuf_deinit(job_queue);
     if(log_fileptr) fclose(log_fileptr);
+    capture_flush();
     exit(EXIT_SUCCESS);
     sem_post(&threadids_wlock);
 }
@@ -50,24 +105,81 @@ void sigint_handler(int sig) {
     return;
 }
 
-void *client_thread(void *clientfd_ptr) {
-    int client_fd = *(int *)clientfd_ptr;
+void *client_thread(void *conn_ptr) {
+    // Passed directly: offline users keep their old fd, so looking the user
+    // up by a reused fd could find the wrong one
+    client_conn_t *conn = (client_conn_t *)conn_ptr;
+    user_t *user = conn->user;
+    int client_fd = conn->fd;
     pthread_detach(pthread_self());
-    free(clientfd_ptr);
+    client_started(user);
 
-    sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-    node_t *curr = users->head;
-    user_t *user;
-    while (curr)  {
-        user_t *u = curr->data;
-        if (u->fd == client_fd) {
-            user = u;
+    // The RESUME is answered from here, once the thread reads the fd
+    if (conn->resume && session_attach(user, client_fd) < 0) shutdown(client_fd, SHUT_RDWR);
+
+    while (1) {
+        petr_header ph;
+
+        if (rd_msgheader(client_fd, &ph) < 0) break;
+        metrics_count(M_FRAMES_IN, 1);
+        metrics_count(M_BYTES_IN, sizeof(petr_header) + ph.msg_len);
+        trace_set(trace_start(ph.msg_type, user->username));
+
+        // msg_len is the client's word, checked before anything is allocated
+        if (ph.msg_len > PETR_MAX_MSG_LEN) {
+            metrics_count(M_FRAMES_OVERSIZE, 1);
+            trace_discard();
             break;
         }
-        curr = curr->next;
+
+        // Large bodies (e.g. ANBIDBATCH) do not fit the stack buffer
+        char buf[1024];
+        char *body = (ph.msg_len < sizeof(buf)) ? buf : malloc(ph.msg_len + 1);
+        if (!body) {
+            trace_discard();
+            break;
+        }
+        if (ph.msg_len && recv(client_fd, body, ph.msg_len, MSG_WAITALL) <= 0) {
+            if (body != buf) free(body);
+            trace_discard();
+            break;
+        }
+        body[ph.msg_len] = '\0';
+
+        // A client over its rate is not read from until it conforms
+        uint64_t wait = (ph.msg_type != LOGOUT) ? ratelimit_take(&conn->rl, ph.msg_type, metrics_now()) : 0;
+        if (wait) {
+            metrics_count(M_RATE_LIMITED, 1);
+            struct timespec ts = { wait / 1000000000ULL, wait % 1000000000ULL };
+            nanosleep(&ts, NULL);
+        }
+
+        int ret = client_frame(conn, &ph, body);
+        if (body != buf) free(body);
+        if (ret < 0) break;
     }
-    sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+    client_gone(conn);
+    close(client_fd);
+    free(conn);
+    metrics_release();
+    rcu_thread_exit();
 
+    // The id of an exited detached thread must not be cancelled at shutdown
+    int i;
+    sem_wait(&threadids_wlock);
+    for (i = 0; i < THREADIDS_SIZE; i++) {
+        if (pthread_equal(threadids[i], pthread_self())) {
+            threadids[i] = 0;
+            break;
+        }
+    }
+    sem_post(&threadids_wlock);
+
+    return NULL;
+}
+
+void client_started(user_t *user) {
+    metrics_gauge_add(G_CONNECTIONS, 1);
     if (log_fileptr) {
         sem_wait(&logfile_wlock);
         clk = time(NULL);
@@ -76,947 +188,1801 @@ void *client_thread(void *clientfd_ptr) {
         fprintf(log_fileptr, "%s %s\n\n", "LOGIN", user->username);
         sem_post(&logfile_wlock);
     }
+}
 
-    while (1) {
-        petr_header ph;
+void client_gone(client_conn_t *conn) {
+    user_t *user = conn->user;
+    capture_close(conn->capture_id);
+    // A held session keeps the watches for its RESUME
+    if (session_detach(user, conn->fd) < 0) {
+        user->is_online = 0;
+        unwatch_all(user);
+    }
+    metrics_gauge_add(G_CONNECTIONS, -1);
+}
 
-        if (rd_msgheader(client_fd, &ph) < 0) break;
+int client_frame(client_conn_t *conn, petr_header *ph, char *body) {
+    // Replies go to this connection, even if a RESUME has moved user->fd on
+    user_t *user = conn->user;
+    int client_fd = conn->fd;
+    capture_frame(conn->capture_id, ph, body);
+
+    if (ph->msg_type == LOGOUT) {
+        session_end(user);
+        ph->msg_len = 0;
+        ph->msg_type = OK;
+        trace_mark(T_READ);
+        netio_send(client_fd, ph, NULL);
+        trace_mark(T_REPLY);
+        trace_finish();
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Client Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s\n\n", "LOGOUT", user->username);
+            sem_post(&logfile_wlock);
+        }
+        return -1;
+    }
 
-        char buf[1024];
-        read(client_fd, buf, ph.msg_len);
+    if (ph->msg_type == ANBID && prefilter_bid(conn, body)) {
+        trace_discard();
+        return 0;
+    }
 
-        if (ph.msg_type == LOGOUT) {
-            ph.msg_len = 0;
-            ph.msg_type = OK;
-            wr_msg(client_fd, &ph, NULL);
-            if (log_fileptr) {
-                sem_wait(&logfile_wlock);
-                clk = time(NULL);
-                fprintf(log_fileptr, "%s", ctime(&clk));
-                fprintf(log_fileptr, "Client Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s\n\n", "LOGOUT", user->username);
-                sem_post(&logfile_wlock);
-            }
-            break;
+    // While the queue is backed up only bids get in
+    int lane = job_lane(ph->msg_type);
+    if (lane != LANE_BID && ratelimit_overloaded() && sbuf_length(job_queue) > 0) {
+        ph->msg_len = 0;
+        ph->msg_type = ESERV;
+        netio_send(client_fd, ph, NULL);
+        metrics_count(M_SHED, 1);
+        trace_discard();
+        return 0;
+    }
+
+    job_t *job = malloc(sizeof(job_t));
+    job->type = ph->msg_type;
+    job->client_fd = client_fd;
+    job->proto = user->proto;
+    job->username = strdup(user->username);
+    job->user = user;
+    job->args = (ph->msg_len) ? strsplit(body, "\r\n") : NULL;
+    job->trace = trace_get();
+    job->peer_fd = -1;
+    if (job->type == ANWATCH || job->type == ANLEAVE) atomic_fetch_add(&user->watches_queued, 1);
+
+    // Queue wait is timed from when the slot was obtained, the wait for
+    // the slot itself is the enqueue time
+    uint64_t reserve_start = metrics_now();
+    trace_mark(T_READ);
+    sbuf_reserve(job_queue, lane);
+    job->enqueued_ns = metrics_now();
+    metrics_record(H_ENQUEUE, job->enqueued_ns - reserve_start);
+    trace_mark(T_ENQUEUE);
+
+    // The job thread owns the trace from here on
+    trace_set(NULL);
+    sbuf_put(job_queue, lane, job);
+    return 0;
+}
+
+int prefilter_bid(client_conn_t *conn, char *body) {
+    user_t *user = conn->user;
+    // Malformed bodies are left to the job thread
+    char *end;
+    unsigned long id = strtoul(body, &end, 10);
+    if (end == body || strncmp(end, "\r\n", 2)) return 0;
+    char *amount = end + 2;
+    unsigned long bid = strtoul(amount, &end, 10);
+    if (end == amount || *end) return 0;
+    if (shard_owner(id) != shard_self) return 0;
+    // Client threads come and go: with more of them than reader slots, the
+    // bid is left to the job thread rather than holding reclaim back
+    if (rcu_try_read_lock() < 0) return 0;
+
+    // The packed word only moves forward: a bid not above it, or on a
+    // closed auction, is rejected whenever the job thread gets to it. The
+    // checks are made in place_bid's order.
+    auction_t *auction = index_auction(id);
+    int result = 0;
+    if (!auction) result = EANNOTFOUND;
+    else {
+        uint64_t top = atomic_load(&auction->top);
+        if (topbid_closed(top)) result = EANNOTFOUND;
+        // Watching can still change through this user's own queued requests
+        else if (atomic_load(&user->watches_queued) == 0) {
+            auction_t *view = atomic_load(&auction->view);
+            if (!strcmp(user->username, view->creater) || !isWatching(view->users_watching, user)) result = EANDENIED;
+            if (!result) result = topbid_check(top, bid);
         }
+    }
+    rcu_read_unlock();
+    if (!result) return 0;
+
+    petr_header ph;
+    ph.msg_len = 0;
+    ph.msg_type = result;
+    netio_send(conn->fd, &ph, NULL);
+    metrics_count(M_BIDS_REJECTED, 1);
+    metrics_count(M_BIDS_EARLY, 1);
+    if (log_fileptr) {
+        char *label = (result == EANNOTFOUND) ? "ANBID:EANNOTFOUND" :
+                      (result == EANDENIED) ? "ANBID:EANDENIED" : "ANBID:EBIDLOW";
+        sem_wait(&logfile_wlock);
+        clk = time(NULL);
+        fprintf(log_fileptr, "%s", ctime(&clk));
+        fprintf(log_fileptr, "Client Thread (TID %ld)\n", pthread_self());
+        fprintf(log_fileptr, "%s %s %lu %lu\n\n", label, user->username, id, bid);
+        sem_post(&logfile_wlock);
+    }
+    return 1;
+}
 
-        job_t *job = malloc(sizeof(job_t));
-        job->type = ph.msg_type;
-        job->client_fd = client_fd;
-        job->username = strdup(user->username);
-        job->args = (ph.msg_len) ? strsplit(buf, "\r\n") : NULL;
+int ring_opened(void *ctx) {
+    client_conn_t *rc = (client_conn_t *)ctx;
+    return (rc->resume) ? session_attach(rc->user, rc->fd) : 0;
+}
+
+uint64_t ring_admit(void *ctx, int type) {
+    client_conn_t *rc = (client_conn_t *)ctx;
+    if (type == LOGOUT) return 0;
+    uint64_t wait = ratelimit_take(&rc->rl, type, metrics_now());
+    if (wait) metrics_count(M_RATE_LIMITED, 1);
+    return wait;
+}
+
+int ring_frame(void *ctx, petr_header *ph, char *body) {
+    client_conn_t *rc = (client_conn_t *)ctx;
+    metrics_count(M_FRAMES_IN, 1);
+    metrics_count(M_BYTES_IN, sizeof(petr_header) + ph->msg_len);
+    trace_set(trace_start(ph->msg_type, rc->user->username));
+    return client_frame(rc, ph, body);
+}
+
+void ring_closed(void *ctx) {
+    client_conn_t *rc = (client_conn_t *)ctx;
+    client_gone(rc);
+    free(rc);
+}
+
+netio_ops_t ring_ops = { ring_opened, ring_admit, ring_frame, ring_closed };
 
-        sbuf_insert(job_queue, job);
+void *job_thread(void *index) {
+    pthread_detach(pthread_self());
+
+    // Pinned before allocating, so the thread's memory is on its node
+    char name[32];
+    snprintf(name, sizeof(name), "Job thread %ld", (long)index);
+    affinity_place(THREAD_JOB, (long)index, name);
+    local_jobs = init(NULL, free_job);
+
+    while (1) {
+        job_t *job;
+        if (local_jobs->length) job = removeFront(local_jobs);
+        else if (!pool_elastic()) job = (job_t *)sbuf_remove(job_queue);
+        else if (!(job = (job_t *)sbuf_remove_timed(job_queue, POOL_IDLE_MS))) {
+            if (pool_retire()) break;
+            continue;
+        }
+
+        uint64_t job_start = metrics_now();
+        int job_type = job->type;
+        metrics_record(H_QUEUE_WAIT, job_start - job->enqueued_ns);
+        if (pool_elastic()) pool_record_wait(job_start - job->enqueued_ns);
+        ratelimit_observe_wait(job_start - job->enqueued_ns);
+        trace_set(job->trace);
+        trace_mark(T_QUEUE);
+
+        user_t *job_user = job->user;
+        run_job(job);
+        if (job_user && (job_type == ANWATCH || job_type == ANLEAVE)) atomic_fetch_sub(&job_user->watches_queued, 1);
+
+        metrics_job(job_type, metrics_now() - job_start);
+        trace_mark(T_PROCESS);
+        trace_finish();
     }
-    user->is_online = 0;
-    close(client_fd);
 
+    // Idle long enough to leave the pool
+    if (log_fileptr) {
+        sem_wait(&logfile_wlock);
+        clk = time(NULL);
+        fprintf(log_fileptr, "%s", ctime(&clk));
+        fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+        fprintf(log_fileptr, "%s %d\n\n", "POOLSHRINK", pool_size());
+        sem_post(&logfile_wlock);
+    }
+    deleteList(local_jobs);
+    metrics_release();
+    rcu_thread_exit();
+
+    int i;
+    sem_wait(&threadids_wlock);
+    for (i = 0; i < THREADIDS_SIZE; i++) {
+        if (pthread_equal(threadids[i], pthread_self())) {
+            threadids[i] = 0;
+            break;
+        }
+    }
+    sem_post(&threadids_wlock);
     return NULL;
 }
 
-void *job_thread() {
+void spawn_job_thread() {
+    pthread_t tid;
+    int i;
+
+    // Registered under the lock, so the thread cannot exit and clear its
+    // slot before it is filled
+    sem_wait(&threadids_wlock);
+    pthread_create(&tid, NULL, job_thread, (void *)(long)pool_spawn());
+    for (i = 0; i < THREADIDS_SIZE; i++) {
+        if (threadids[i] == 0) {
+            threadids[i] = tid;
+            break;
+        }
+    }
+    sem_post(&threadids_wlock);
+}
+
+void *pool_thread() {
     pthread_detach(pthread_self());
 
     while (1) {
-        job_t *job = (job_t *)sbuf_remove(job_queue);
-        petr_header ph;
+        usleep(POOL_SAMPLE_MS * 1000);
 
-        if (job->type == ANCREATE) {
-            if (!job->args || job->args->length != 3) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
+        uint64_t mean_wait;
+        int depth = sbuf_length(job_queue);
+        int i, add = pool_grow(depth, &mean_wait);
+        if (!add) continue;
 
-            char *item_name = getElement(job->args, 0);
-            unsigned int duration = atoi(getElement(job->args, 1));
-            unsigned long bin = atol(getElement(job->args, 2));
-
-            auction_t *auction = (auction_t *)malloc(sizeof(auction_t));
-            auction->item_name = strdup(item_name);
-            auction->rticks = duration;
-            auction->bin = bin;
-            auction->bid = 0;
-            auction->creater = strdup(job->username);
-            auction->highest_bidder = NULL;
-
-            int i;
-            for (i = 0; i < 5; i++) {
-                auction->users_watching[i] = NULL;
-            }
+        for (i = 0; i < add; i++) spawn_job_thread();
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Pool Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %d (queue depth %d, mean wait %luus)\n\n", "POOLGROW", pool_size(),
+                    depth, (unsigned long)(mean_wait / 1000));
+            sem_post(&logfile_wlock);
+        }
+    }
+    return NULL;
+}
 
-            if (auction->rticks < 1 || auction->bin < 0 || strlen(auction->item_name) < 1) {
-                ph.msg_len = 0;
-                ph.msg_type = EINVALIDARG;
-                wr_msg(job->client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s %s %d %ld\n\n", "ANCREATE:EINVALIDARG", job->username, auction->item_name, auction->rticks, auction->bin);
-                    sem_post(&logfile_wlock);
-                }
+void run_job(job_t *job) {
+    petr_header ph;
+
+    // Requests on another shard's auction are run by that shard
+    if (job->peer_fd < 0 && job->args && (job->type == ANWATCH || job->type == ANLEAVE || job->type == ANBID ||
+                                          job->type == ANPROXY)) {
+        int owner = shard_owner(atoi(getElement(job->args, 0)));
+        if (owner != shard_self) {
+            forward_job(job, owner);
+            free_job(job);
+            return;
+        }
+    }
 
-                free_auction(auction);
-                free_job(job);
-                continue;
-            }
+    if (job->type == ANCREATE) {
+        if (!job->args || job->args->length != 3) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
 
-            sem_wait(&auctions_wlock);
-            auction->id = auctionID++;
-            insertRear(auctions, auction);
-            sem_post(&auctions_wlock);
-
-            ph.msg_type = ANCREATE;
-            char num_buf[128];
-            sprintf(num_buf, "%d", auction->id);
-            char *msg = strdup(num_buf);
-            ph.msg_len = strlen(msg) + 1;
-            wr_msg(job->client_fd, &ph, msg);
+        char *item_name = getElement(job->args, 0);
+        unsigned int duration = atoi(getElement(job->args, 1));
+        unsigned long bin = atol(getElement(job->args, 2));
+
+        auction_t *auction = new_auction(item_name, job->username, duration, bin);
+
+        if (auction->rticks < 1 || auction->bin < 0 || strlen(auction->item_name) < 1) {
+            ph.msg_len = 0;
+            ph.msg_type = EINVALIDARG;
+            job_reply(job, &ph, NULL);
             if (log_fileptr) {
                 sem_wait(&logfile_wlock);
                 clk = time(NULL);
                 fprintf(log_fileptr, "%s", ctime(&clk));
                 fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s %s %d %ld\n\n", "ANCREATE", job->username, auction->item_name, auction->rticks, auction->bin);
+                fprintf(log_fileptr, "%s %s %s %d %ld\n\n", "ANCREATE:EINVALIDARG", job->username, auction->item_name, auction->rticks, auction->bin);
                 sem_post(&logfile_wlock);
             }
-            free(msg);
-        }
-        else if (job->type == ANCLOSED) {
-            if (!job->args || job->args->length != 1) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
-
-            unsigned int auctionID = *((unsigned int *)getElement(job->args, 0));
-
-            sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            node_t *curr = auctions->head;
-            auction_t *auction;
-            while (curr) {
-                auction_t *a = curr->data;
-                if (a->id == auctionID) {
-                    auction = a;
-                    break;
-                }
-                curr = curr->next;
-            }
-            sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-
-            sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-            curr = users->head;
-            user_t *user = NULL;
-            user_t *creater = NULL;
-            while (curr && auction->highest_bidder) {
-                user_t *u = curr->data;
-                if (user && creater) break;
-                if (!user && !strcmp(u->username, auction->highest_bidder)) {
-                    user = u;
-                }
-                if (!creater && !strcmp(u->username, auction->creater)) {
-                    creater = u;
-                }
-                curr = curr->next;
-            }
-            sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
 
-            if (auction->highest_bidder) {
-                // The auction has a winner
-                user->balance -= auction->bid;
-                if (creater) creater->balance += auction->bid;
+            free_auction(auction);
+            free_job(job);
+            return;
+        }
 
-                list_t *args = init(NULL, free);
-                char num_buf[128];
+        // Shards allocate ids from disjoint residue classes
+        repl_begin();
+        sem_wait(&auctions_wlock);
+        auction->id = auctionID;
+        auctionID += shard_count;
+        insertRear(auctions, auction);
+        auction->slot = ticker_add(&ticker, auction, auction->rticks);
+        auction_publish(auction, VIEW_ALL);
+        rcu_array_append(&auction_index, auction);
+        wbuf_t *ev = repl_event_begin(EV_AUCTION);
+        if (ev) {
+            // A partition may have ticked it already
+            repl_put_auction(ev, auction, auction_rticks(auction));
+            repl_event_end(ev);
+        }
+        sem_post(&auctions_wlock);
+        repl_end();
+
+        ph.msg_type = ANCREATE;
+        char num_buf[128];
+        sprintf(num_buf, "%d", auction->id);
+        char *msg = strdup(num_buf);
+        ph.msg_len = strlen(msg) + 1;
+        job_reply(job, &ph, msg);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s %s %d %ld\n\n", "ANCREATE", job->username, auction->item_name, auction->rticks, auction->bin);
+            sem_post(&logfile_wlock);
+        }
+        free(msg);
+    }
+    else if (job->type == ANCLOSED) {
+        if (!job->args || job->args->length != 1) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
 
-                sprintf(num_buf, "%d", auction->id);
-                insertRear(args, strdup(num_buf));
+        unsigned int auctionID = *((unsigned int *)getElement(job->args, 0));
+        // The tick queues a batch of these, a list walk each would hold it up
+        auction_t *auction = index_auction(auctionID);
+
+        // Balances were settled by close_auctions, only notify watchers.
+        // Encode once per wire version, shared by every watcher
+        uint64_t top = atomic_load(&auction->top);
+        user_t *winner = user_by_id(topbid_uid(top));
+        wbuf_t msgs[PETR_V2 + 1];
+        int v;
+        for (v = PETR_V1; v <= PETR_V2; v++) {
+            wbuf_init(&msgs[v], 64);
+            wire_anclosed(&msgs[v], v, auction->id, (winner) ? winner->username : NULL, topbid_bid(top));
+        }
 
-                insertRear(args, strdup(auction->highest_bidder));
+        // Send ANCLOSED to ALL users watching the auction
+        sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+        int i;
+        for (i = 0; i < 5; i++) {
+            user_t *user = auction->users_watching[i];
+            if (!user) continue;
+
+            ph.msg_len = msgs[user->proto].len;
+            ph.msg_type = ANCLOSED;
+            send_to_user(user, &ph, msgs[user->proto].data);
+            metrics_count(M_UPDATES_SENT, 1);
+        }
+        sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
 
-                sprintf(num_buf, "%ld", auction->bid);
-                insertRear(args, strdup(num_buf));
+        for (v = PETR_V1; v <= PETR_V2; v++) {
+            wbuf_free(&msgs[v]);
+        }
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %d\n\n", "ANCLOSED", auction->id);
+            sem_post(&logfile_wlock);
+        }
+    }
+    else if (job->type == ANLIST) {
+        if (job->args && job->args->length != 0) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
 
-                char *msg = strjoin(args, "\r\n");
+        wbuf_t msg;
+        wbuf_init(&msg, 256);
+        wire_rows_begin(&msg, job->proto);
 
-                // Send ANCLOSED to ALL users watching the auction
-                sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-                curr = users->head;
-                while (curr) {
-                    user = curr->data;
-                    if (!isWatching(auction->users_watching, user))  {
-                        curr = curr->next;
-                        continue;
-                    }
-                    
-                    ph.msg_len = strlen(msg) + 1;
-                    ph.msg_type = ANCLOSED;
-                    wr_msg(user->fd, &ph, msg);
+        uint32_t count = 0;
+        rcu_read_lock();
+        rcu_array_t *index = atomic_load(&auction_index);
+        int i, n = atomic_load(&index->n);
+        for (i = 0; i < n; i++) {
+            auction_t *a = atomic_load(&((auction_t *)index->items[i])->view);
+            if (a->rticks != 0) {
+                wire_anlist_row(&msg, job->proto, a, auction_rticks(index->items[i]));
+                count++;
+            }
+        }
+        rcu_read_unlock();
+        // Then the other shards' auctions, unless this is such a request
+        if (job->peer_fd < 0) count += shard_gather(job->proto, job->username, ANLIST, &msg, job->proto);
+        wire_rows_end(&msg, job->proto, count);
+
+        ph.msg_len = msg.len;
+        ph.msg_type = ANLIST;
+        job_reply(job, &ph, msg.len ? msg.data : NULL);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s\n\n", "ANLIST", job->username);
+            sem_post(&logfile_wlock);
+        }
+        wbuf_free(&msg);
+    }
+    else if (job->type == ANWATCH) {
+        if (!job->args || job->args->length != 1) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
 
-                    curr = curr->next;
-                }
-                sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+        unsigned int auctionID = atoi(getElement(job->args, 0));
 
-                deleteList(args);
-                free(msg);
+        sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+        node_t *curr = auctions->head;
+        auction_t *auction = NULL;
+        while (curr) {
+            auction_t *a = curr->data;
+            if (a->id == auctionID) {
+                auction = a;
+                break;
             }
-            else {
-                // The auction did not have a winner
-                char num_buf[128];
-
-                sprintf(num_buf, "%d", auction->id);
-
-                char *msg = strdup(num_buf);
-                msg = realloc(msg, strlen(msg) + strlen("\r\n\r\n") + 1);
-                msg = strcat(msg, "\r\n\r\n");
-
-                // Send ANCLOSED to ALL users watching the auction
-                sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-                sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-                curr = users->head;
-                while (curr)
-                {
-                    user = curr->data;
-                    if (!isWatching(auction->users_watching, user)) {
-                        curr = curr->next;
-                        continue;
-                    }
-                    
-                    ph.msg_len = strlen(msg) + 1;
-                    ph.msg_type = ANCLOSED;
-                    wr_msg(user->fd, &ph, msg);
-
-                    curr = curr->next;
-                }
-                sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-                sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+            curr = curr->next;
+        }
+        sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
 
-                free(msg);
-            }
+        if (!auction || auction->rticks == 0) {
+            ph.msg_len = 0;
+            ph.msg_type = EANNOTFOUND;
+            job_reply(job, &ph, NULL);
             if (log_fileptr) {
                 sem_wait(&logfile_wlock);
                 clk = time(NULL);
                 fprintf(log_fileptr, "%s", ctime(&clk));
                 fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %d\n\n", "ANCLOSED", auction->id);
+                fprintf(log_fileptr, "%s %s %d\n\n", "ANWATCH:EANNOTFOUND", job->username, auctionID);
                 sem_post(&logfile_wlock);
             }
+            
+            free_job(job); job = NULL;
+            return;
         }
-        else if (job->type == ANLIST) {
-            if (job->args && job->args->length != 0) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
-
-            sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            node_t *curr = auctions->head;
-            char *msg = strdup("\0");
-            while (curr) {
-                auction_t *a = (auction_t *)(curr->data);
-                if (a->rticks == 0) {
-                    curr = curr->next;
-                    continue;
-                }
-
-                list_t *l = init(NULL, free);
-
-                char num_buf[128];
-                sprintf(num_buf, "%d", a->id);
-                insertRear(l, strdup(num_buf));
-
-                insertRear(l, strdup(a->item_name));
-
-                sprintf(num_buf, "%ld", a->bin);
-                insertRear(l, strdup(num_buf));
-
-                int i, count = 0;
-                for (i = 0; i < 5; i++) {
-                    if (a->users_watching[i]) count++;
-                }
 
-                sprintf(num_buf, "%d", count);
-                insertRear(l, strdup(num_buf));
+        // If there is no "space" to watch an auction
+        repl_begin();
+        int watched = watch_auction(auction, job->user);
+        repl_end();
+        if (watched < 0) {
+            ph.msg_len = 0;
+            ph.msg_type = EANFULL;
+            job_reply(job, &ph, NULL);
+            if (log_fileptr) {
+                sem_wait(&logfile_wlock);
+                clk = time(NULL);
+                fprintf(log_fileptr, "%s", ctime(&clk));
+                fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+                fprintf(log_fileptr, "%s %s %d\n\n", "ANWATCH:EANFULL", job->username, auctionID);
+                sem_post(&logfile_wlock);
+            }
+            free_job(job); job = NULL;
+            return;
+        }
 
-                sprintf(num_buf, "%ld", a->bid);
-                insertRear(l, strdup(num_buf));
+        // The client may have gone while this was queued, after client_gone
+        // dropped its watches
+        if (job->user->shard < 0 && !job->user->is_online && !session_held(job->user)) {
+            repl_begin();
+            unwatch_auction(auction, job->user);
+            repl_end();
+        }
 
-                sprintf(num_buf, "%d", a->rticks);
-                insertRear(l, strdup(num_buf));
+        char num_buf[256];
+        sprintf(num_buf, "%ld", auction->bin);
 
-                char *m = strjoin(l, ";");
+        list_t *args = init(NULL, free);
+        insertRear(args, strdup(auction->item_name));
+        insertRear(args, strdup(num_buf));
 
-                m = realloc(m, strlen(m) + 1);
-                m = strcat(m, "\n");
+        char *msg = strjoin(args, "\r\n");
 
-                msg = realloc(msg, strlen(msg) + strlen(m) + 1);
-                msg = strcat(msg, m);
-                deleteList(l);
-                free(m);
+        ph.msg_len = strlen(msg) + 1;
+        ph.msg_type = ANWATCH;
+        job_reply(job, &ph, msg);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s %d\n\n", "ANWATCH", job->username, auctionID);
+            sem_post(&logfile_wlock);
+        }
 
-                curr = curr->next;
-            }
-            sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+        free(msg);
+        deleteList(args);
+    }
+    else if (job->type == ANLEAVE) {
+        if (!job->args || job->args->length != 1)
+        {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
+        
+        unsigned int auctionID = atoi(getElement(job->args, 0));
+        auction_t *auction = index_auction(auctionID);
 
-            if (*msg) {
-                ph.msg_len = strlen(msg) + 1;
-                ph.msg_type = ANLIST;
-                wr_msg(job->client_fd, &ph, msg);
-                
-            }
-            else {
-                ph.msg_len = 0;
-                ph.msg_type = ANLIST;
-                wr_msg(job->client_fd, &ph, NULL);
-            }
+        if (!auction || auction->rticks == 0) {
+            ph.msg_len = 0;
+            ph.msg_type = EANNOTFOUND;
+            job_reply(job, &ph, NULL);
             if (log_fileptr) {
                 sem_wait(&logfile_wlock);
                 clk = time(NULL);
                 fprintf(log_fileptr, "%s", ctime(&clk));
                 fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s\n\n", "ANLIST", job->username);
+                fprintf(log_fileptr, "%s %s %d\n\n", "ANLEAVE:EANNOTFOUND", job->username, (unsigned int)atoi(getElement(job->args, 0)));
                 sem_post(&logfile_wlock);
             }
-            free(msg);
+
+            free_job(job); job = NULL;
+            return;
         }
-        else if (job->type == ANWATCH) {
-            if (!job->args || job->args->length != 1) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
 
-            unsigned int auctionID = atoi(getElement(job->args, 0));
+        repl_begin();
+        unwatch_auction(auction, job->user);
+        repl_end();
 
-            sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            node_t *curr = auctions->head;
-            auction_t *auction = NULL;
-            while (curr) {
-                auction_t *a = curr->data;
-                if (a->id == auctionID) {
-                    auction = a;
-                    break;
-                }
-                curr = curr->next;
+        ph.msg_len = 0;
+        ph.msg_type = OK;
+        job_reply(job, &ph, NULL);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s %d\n\n", "ANLEAVE", job->username, auction->id);
+            sem_post(&logfile_wlock);
+        }
+    }
+    else if (job->type == ANBID) {
+        if (!job->args || job->args->length != 2) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
+
+        int auctionID = atoi(getElement(job->args, 0));
+        unsigned long bid = atol(getElement(job->args, 1));
+
+        auction_t *auction = find_auction(auctionID);
+
+        int result = (auction) ? place_bid(auction, job->username, job->user, bid) : EANNOTFOUND;
+
+        metrics_count((result == OK || result == ANCLOSED) ? M_BIDS_ACCEPTED : M_BIDS_REJECTED, 1);
+
+        // Proxies answer the bid right away, watchers only hear the outcome
+        char *leader = job->username;
+        unsigned long lead = bid;
+        int outcome = result;
+        if (result == OK) {
+            user_t *proxy;
+            int r = resolve_proxies(auction, &proxy, &lead);
+            if (r != -1) {
+                leader = proxy->username;
+                outcome = r;
             }
-            sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+        }
 
-            if (!auction || auction->rticks == 0) {
-                ph.msg_len = 0;
-                ph.msg_type = EANNOTFOUND;
-                wr_msg(job->client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s %d\n\n", "ANWATCH:EANNOTFOUND", job->username, auctionID);
-                    sem_post(&logfile_wlock);
-                }
-                
-                free_job(job); job = NULL;
+        // Watchers (including the bidder) see the ANUPDATE before the OK
+        if (outcome == OK) broadcast_anupdate(auction, leader, lead);
+
+        ph.msg_len = 0;
+        ph.msg_type = (result == ANCLOSED) ? OK : result;
+        trace_mark(T_PROCESS);
+        job_reply(job, &ph, NULL);
+        trace_mark(T_REPLY);
+        if (log_fileptr) {
+            char *label = (result == EANNOTFOUND) ? "ANBID:EANNOTFOUND" :
+                          (result == EANDENIED) ? "ANBID:EANDENIED" :
+                          (result == EBIDLOW) ? "ANBID:EBIDLOW" : "ANBID";
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s %d %ld\n\n", label, job->username, auctionID, bid);
+            sem_post(&logfile_wlock);
+        }
+
+        // Bid reached the buy-it-now price
+        if (outcome == ANCLOSED) close_auction(auction);
+    }
+    else if (job->type == ANBIDBATCH) {
+        if (!job->args || job->args->length % 2 != 0) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
+
+        int n = job->args->length / 2;
+        bid_req_t *bids = malloc(n * sizeof(bid_req_t));
+        uint8_t *results = malloc(n);
+        node_t *arg = job->args->head;
+        int i;
+        for (i = 0; i < n; i++) {
+            bids[i].auction_id = atoi(arg->data);
+            bids[i].amount = atol(arg->next->data);
+            bids[i].index = i;
+            arg = arg->next->next;
+        }
+
+        // Group by auction so each auction is looked up once
+        qsort(bids, n, sizeof(bid_req_t), bid_req_cmp);
+
+        int accepted = 0, forwarded = 0, forwarded_accepted = 0;
+        i = 0;
+        while (i < n) {
+            unsigned int id = bids[i].auction_id;
+            unsigned long last_bid = 0;
+            int last_result = EANNOTFOUND;
+
+            // A group on another shard's auction is placed by that shard
+            int owner = shard_owner(id);
+            if (owner != shard_self && job->peer_fd < 0) {
+                int first = i;
+                while (i < n && bids[i].auction_id == id) i++;
+                int ok = forward_bids(job, owner, &bids[first], i - first, results);
+                forwarded += i - first;
+                forwarded_accepted += ok;
+                accepted += ok;
                 continue;
             }
 
-            int i;
-            user_t **user_space = NULL;
-            for (i = 0; i < 5; i++) {
-                if (!auction->users_watching[i]) {
-                    user_space = &auction->users_watching[i];
-                    break;
+            auction_t *auction = find_auction(id);
+            for (; i < n && bids[i].auction_id == id; i++) {
+                int result = (auction) ? place_bid(auction, job->username, job->user, bids[i].amount) : EANNOTFOUND;
+                if (result == OK || result == ANCLOSED) {
+                    last_bid = bids[i].amount;
+                    last_result = result;
+                    accepted++;
                 }
+                results[bids[i].index] = (result == ANCLOSED) ? OK : result;
             }
 
-            // If there is no "space" to watch an auction
-            if (user_space == NULL) {
-                ph.msg_len = 0;
-                ph.msg_type = EANFULL;
-                wr_msg(job->client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s %d\n\n", "ANWATCH:EANFULL", job->username, auctionID);
-                    sem_post(&logfile_wlock);
+            char *leader = job->username;
+            if (last_result == OK) {
+                user_t *proxy;
+                int r = resolve_proxies(auction, &proxy, &last_bid);
+                if (r != -1) {
+                    leader = proxy->username;
+                    last_result = r;
                 }
-                free_job(job); job = NULL;
-                continue;
             }
 
-            sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-            curr = users->head;
-            user_t *user;
-            while (curr)
-            {
-                user_t *u = curr->data;
-                if (!strcmp(u->username, job->username))
-                {
-                    user = u;
-                    break;
-                }
-                curr = curr->next;
-            }
-            sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
-            
-            *user_space = user;
+            // Only the final standing bid of the group is broadcast
+            if (last_result == OK) broadcast_anupdate(auction, leader, last_bid);
+            else if (last_result == ANCLOSED) close_auction(auction);
+        }
 
-            char num_buf[256];
-            sprintf(num_buf, "%ld", auction->bin);
+        // Forwarded bids are counted by the shard that placed them
+        metrics_count(M_BIDS_ACCEPTED, accepted - forwarded_accepted);
+        metrics_count(M_BIDS_REJECTED, (n - forwarded) - (accepted - forwarded_accepted));
 
-            list_t *args = init(NULL, free);
-            insertRear(args, strdup(auction->item_name));
-            insertRear(args, strdup(num_buf));
+        wbuf_t msg;
+        wbuf_init(&msg, 16 + 4 * n);
+        wire_bidresults(&msg, job->proto, results, n);
 
-            char *msg = strjoin(args, "\r\n");
+        ph.msg_len = msg.len;
+        ph.msg_type = ANBIDBATCH;
+        trace_mark(T_PROCESS);
+        job_reply(job, &ph, msg.len ? msg.data : NULL);
+        trace_mark(T_REPLY);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s %d %d\n\n", "ANBIDBATCH", job->username, n, accepted);
+            sem_post(&logfile_wlock);
+        }
+        wbuf_free(&msg);
+        free(bids);
+        free(results);
+    }
+    else if (job->type == ANPROXY) {
+        if (!job->args || job->args->length != 2) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
 
-            ph.msg_len = strlen(msg) + 1;
-            ph.msg_type = ANWATCH;
-            wr_msg(job->client_fd, &ph, msg);
-            if (log_fileptr) {
-                sem_wait(&logfile_wlock);
-                clk = time(NULL);
-                fprintf(log_fileptr, "%s", ctime(&clk));
-                fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s %d\n\n", "ANWATCH", job->username, auctionID);
-                sem_post(&logfile_wlock);
-            }
+        int auctionID = atoi(getElement(job->args, 0));
+        unsigned long max = atol(getElement(job->args, 1));
+        if (max > TOPBID_MAX_BID) max = TOPBID_MAX_BID;
+
+        // Checked like a bid at max, except that the leader may set a max
+        // up to their own bid
+        auction_t *auction = find_auction(auctionID);
+        uint64_t top = (auction) ? atomic_load(&auction->top) : TOPBID_CLOSED;
+        int result = OK;
+        if (topbid_closed(top)) result = EANNOTFOUND;
+        else if (!strcmp(job->username, auction->creater) || !isWatching(auction->users_watching, job->user)) result = EANDENIED;
+        else if (max != 0 && max <= topbid_bid(top) && topbid_uid(top) != job->user->id) result = EBIDLOW;
+
+        user_t *leader = NULL;
+        unsigned long lead = 0;
+        int outcome = -1;
+        if (result == OK) {
+            proxy_book_t *book = proxy_book(auction, 1);
+            repl_begin();
+            sem_wait(&book->lock);
+            proxy_set(book, job->user, max);
+            repl_proxy(auction, job->user, max);
+            sem_post(&book->lock);
+            repl_end();
+            outcome = resolve_proxies(auction, &leader, &lead);
+        }
+        if (outcome == OK) broadcast_anupdate(auction, leader->username, lead);
 
-            free(msg);
-            deleteList(args);
+        ph.msg_len = 0;
+        ph.msg_type = result;
+        trace_mark(T_PROCESS);
+        job_reply(job, &ph, NULL);
+        trace_mark(T_REPLY);
+        if (log_fileptr) {
+            char *label = (result == EANNOTFOUND) ? "ANPROXY:EANNOTFOUND" :
+                          (result == EANDENIED) ? "ANPROXY:EANDENIED" :
+                          (result == EBIDLOW) ? "ANPROXY:EBIDLOW" : "ANPROXY";
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s %d %ld\n\n", label, job->username, auctionID, max);
+            sem_post(&logfile_wlock);
         }
-        else if (job->type == ANLEAVE) {
-            if (!job->args || job->args->length != 1)
-            {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
-            
-            unsigned int auctionID = atoi(getElement(job->args, 0));
-
-            sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            node_t *curr = auctions->head;
-            auction_t *auction = NULL;
-            while (curr) {
-                auction_t *a = curr->data;
-                if (a->id == auctionID) {
-                    auction = a;
-                    break;
-                }
-                curr = curr->next;
-            }
-            sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
 
-            if (!auction || auction->rticks == 0) {
-                ph.msg_len = 0;
-                ph.msg_type = EANNOTFOUND;
-                wr_msg(job->client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s %d\n\n", "ANLEAVE:EANNOTFOUND", job->username, (unsigned int)atoi(getElement(job->args, 0)));
-                    sem_post(&logfile_wlock);
-                }
+        // A proxy bid reached the buy-it-now price
+        if (outcome == ANCLOSED) close_auction(auction);
+    }
+    else if (job->type == USRLIST) {
+        if (job->args && job->args->length != 0) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
 
-                free_job(job); job = NULL;
-                continue;
+        // Newest user first, as in the users list. The body is text for
+        // both wire versions: one "name\n" row per user
+        wbuf_t msg;
+        wbuf_init(&msg, 256);
+        rcu_read_lock();
+        rcu_array_t *index = atomic_load(&user_index);
+        int i;
+        for (i = atomic_load(&index->n) - 1; i >= 0; i--) {
+            user_t *u = index->items[i];
+            if (u->is_online && strcmp(u->username, job->username)) {
+                wbuf_put_bytes(&msg, u->username, strlen(u->username));
+                wbuf_put_u8(&msg, '\n');
             }
+        }
+        rcu_read_unlock();
+        if (job->peer_fd < 0) shard_gather(job->proto, job->username, USRLIST, &msg, PETR_V1);
+        wire_rows_end(&msg, PETR_V1, 0);
 
-            sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-            curr = users->head;
-            user_t *user = NULL;
-            while (curr) {
-                user_t *u = curr->data;
-                if (!strcmp(u->username, job->username)) {
-                    user = u;
-                    break;
-                }
-                curr = curr->next;
-            }
-            sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
-            
-            int i;
-            for (i = 0; i < 5; i++) {
-                if (auction->users_watching[i] == user) {
-                    auction->users_watching[i] = NULL;
-                    break;
-                }
+        ph.msg_len = msg.len;
+        ph.msg_type = USRLIST;
+        job_reply(job, &ph, msg.len ? msg.data : NULL);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s\n\n", "USRLIST", job->username);
+            sem_post(&logfile_wlock);
+        }
+        wbuf_free(&msg);
+    }
+    else if (job->type == USRWINS) {
+        if (job->args && job->args->length != 0) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
+        wbuf_t msg;
+        wbuf_init(&msg, 256);
+        wire_rows_begin(&msg, job->proto);
+
+        uint32_t count = 0;
+        rcu_read_lock();
+        rcu_array_t *index = atomic_load(&auction_index);
+        int i, n = atomic_load(&index->n);
+        for (i = 0; i < n; i++) {
+            auction_t *auction = atomic_load(&((auction_t *)index->items[i])->view);
+
+            if (auction->highest_bidder && auction->rticks == 0 && strcmp(job->username, auction->highest_bidder)==0) {
+                wire_usrwins_row(&msg, job->proto, auction);
+                count++;
             }
+        }
+        rcu_read_unlock();
+        if (job->peer_fd < 0) count += shard_gather(job->proto, job->username, USRWINS, &msg, job->proto);
+        wire_rows_end(&msg, job->proto, count);
 
+        ph.msg_len = msg.len;
+        ph.msg_type = USRWINS;
+        job_reply(job, &ph, msg.len ? msg.data : NULL);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s\n\n", "USRWINS", job->username);
+            sem_post(&logfile_wlock);
+        }
+        wbuf_free(&msg);
+    }
+    else if (job->type == USRSALES) {
+        if (job->args && job->args->length != 0) {
             ph.msg_len = 0;
-            ph.msg_type = OK;
-            wr_msg(job->client_fd, &ph, NULL);
-            if (log_fileptr) {
-                sem_wait(&logfile_wlock);
-                clk = time(NULL);
-                fprintf(log_fileptr, "%s", ctime(&clk));
-                fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s %d\n\n", "ANLEAVE", job->username, auction->id);
-                sem_post(&logfile_wlock);
-            }
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
         }
-        else if (job->type == ANBID) {
-            if (!job->args || job->args->length != 2) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
+        wbuf_t msg;
+        wbuf_init(&msg, 256);
+        wire_rows_begin(&msg, job->proto);
 
-            int auctionID = atoi(getElement(job->args, 0));
-            unsigned long bid = atol(getElement(job->args, 1));
+        uint32_t count = 0;
+        rcu_read_lock();
+        rcu_array_t *index = atomic_load(&auction_index);
+        int i, n = atomic_load(&index->n);
+        for (i = 0; i < n; i++) {
+            auction_t *auction = atomic_load(&((auction_t *)index->items[i])->view);
 
-            sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            node_t *curr = auctions->head;
-            auction_t *auction = NULL;
-            while (curr) {
-                auction_t *a = curr->data;
-                if (a->id == auctionID) {
-                    auction = a;
-                    break;
-                }
-                curr = curr->next;
+            if (auction->creater && auction->rticks == 0 && !strcmp(job->username, auction->creater)) {
+                wire_usrsales_row(&msg, job->proto, auction);
+                count++;
             }
-            sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+        }
+        rcu_read_unlock();
+        if (job->peer_fd < 0) count += shard_gather(job->proto, job->username, USRSALES, &msg, job->proto);
+        wire_rows_end(&msg, job->proto, count);
 
-            if (!auction || auction->rticks == 0) {
-                ph.msg_len = 0;
-                ph.msg_type = EANNOTFOUND;
-                wr_msg(job->client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s %d %ld\n\n", "ANBID:EANNOTFOUND", job->username, auctionID, bid);
-                    sem_post(&logfile_wlock);
-                }
+        ph.msg_len = msg.len;
+        ph.msg_type = USRSALES;
+        job_reply(job, &ph, msg.len ? msg.data : NULL);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s\n\n", "USRSALES", job->username);
+            sem_post(&logfile_wlock);
+        }
+        wbuf_free(&msg);
+    }
+    else if (job->type == USRBLNC) {
+        if (job->args && job->args->length != 0) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            job_reply(job, &ph, NULL);
+            free_job(job); job = NULL;
+            return;
+        }
+        char num_buf[128];
+        sprintf(num_buf, "%ld", (long)atomic_load_explicit(&job->user->balance, memory_order_relaxed));
 
-                free_job(job);
-                continue;
-            }
+        ph.msg_len = strlen(num_buf) + 1;
+        ph.msg_type = USRBLNC;
+        job_reply(job, &ph, num_buf);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s\n\n", "USRBLNC", job->username);
+            sem_post(&logfile_wlock);
+        }
+    }
+    else if (job->type == JOB_TICK) {
+        int part = *(int *)getElement(job->args, 0);
+        atomic_fetch_add(&tick_closed, tick_part(part, tick_parts));
+        sem_post(&tick_done);
+    }
+    else {
+        ph.msg_len = 0;
+        ph.msg_type = ESERV;
+        job_reply(job, &ph, NULL);
+    }
+    free_job(job);
+}
 
-            sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-            curr = users->head;
-            user_t *user = NULL;
-            while (curr) {
-                user_t *u = curr->data;
-                if (!strcmp(u->username, job->username)) {
-                    user = u;
-                    break;
-                }
-                curr = curr->next;
-            }
-            sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+int job_lane(int type) {
+    switch (type) {
+        case ANBID:
+        case ANBIDBATCH:
+        case ANPROXY:
+        case ANCLOSED:
+        case JOB_TICK:
+            return LANE_BID;
+        case ANLIST:
+        case USRLIST:
+        case USRWINS:
+        case USRSALES:
+            return LANE_QUERY;
+        default:
+            return LANE_DEFAULT;
+    }
+}
 
-            if (!strcmp(job->username, auction->creater) || !isWatching(auction->users_watching, user)) {
-                ph.msg_len = 0;
-                ph.msg_type = EANDENIED;
-                wr_msg(job->client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s %d %ld\n\n", "ANBID:EANDENIED", job->username, auctionID, bid);
-                    sem_post(&logfile_wlock);
-                }
+void job_reply(job_t *job, petr_header *ph, char *msg) {
+    if (job->peer_fd < 0) {
+        netio_send(job->client_fd, ph, msg);
+        return;
+    }
 
-                free_job(job); 
-                continue;
-            } 
-            
-            if (bid <= auction->bid) {
-                ph.msg_len = 0;
-                ph.msg_type = EBIDLOW;
-                wr_msg(job->client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s %d %ld\n\n", "ANBID:EBIDLOW", job->username, auctionID, bid);
-                    sem_post(&logfile_wlock);
-                }
+    // Answer to the shard that forwarded the request
+    wbuf_t b;
+    wbuf_init(&b, 1 + ph->msg_len);
+    wbuf_put_u8(&b, ph->msg_type);
+    if (ph->msg_len) wbuf_put_bytes(&b, msg, ph->msg_len);
+    shard_write(job->peer_fd, SH_RESPONSE, b.data, b.len, -1);
+    wbuf_free(&b);
+}
 
-                free_job(job);
-                continue;
-            }
-            else if (auction->bin != 0 && bid >= auction->bin) {
-                ph.msg_len = 0;
-                ph.msg_type = OK;
-                wr_msg(job->client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s %d %ld\n\n", "ANBID", job->username, auctionID, bid);
-                    sem_post(&logfile_wlock);
-                }
+void send_to_user(user_t *user, petr_header *ph, char *msg) {
+    if (user->shard >= 0) shard_deliver(user->shard, user->username, ph, msg);
+    else if (user->is_online || session_hold(user, ph, msg) < 0) netio_send(user->fd, ph, msg);
+}
 
-                sem_wait(&auctions_wlock);
-                auction->rticks = 0;
-                if (auction->highest_bidder) free(auction->highest_bidder);
-                auction->highest_bidder = strdup(job->username);
-                auction->bid = bid;
-                sem_post(&auctions_wlock);
-                free_job(job); job = NULL;
+user_t *proxy_user(char *username, int shard) {
+    sem_wait(&proxies_lock);
+    user_t *user = user_lookup(proxies, username);
+    if (!user) {
+        user = malloc(sizeof(user_t));
+        user->username = strdup(username);
+        user->password = strdup("");
+        user->fd = -1;
+        user->balance = 0;
+        user->committed = 0;
+        user->proto = PETR_V1;
+        user->is_online = 0;
+        user->shard = shard;
+        atomic_init(&user->watches_queued, 0);
+        user->watching = init(NULL, NULL);
+        user->session = NULL;
+        if (user_register(user) < 0) {
+            free_user(user);
+            user = NULL;
+        }
+        else insertFront(proxies, user);
+    }
+    sem_post(&proxies_lock);
+    return user;
+}
 
-                job = malloc(sizeof(job_t));
-                job->type = ANCLOSED;
-                job->client_fd = -1;
-                job->username = NULL;
-                job->args = init(NULL, NULL);
-                insertRear(job->args, &auction->id);
+void forward_job(job_t *job, int shard) {
+    petr_header ph;
+    char *body = NULL;
 
-                sbuf_insert(job_queue, job);
-                continue;
-            }
+    metrics_count(M_SHARD_FORWARDED, 1);
+    trace_mark(T_PROCESS);
+    if (shard_call(shard, job->proto, job->username, job->type, job->args, &ph, &body) < 0) {
+        ph.msg_len = 0;
+        ph.msg_type = ESERV;
+    }
+    trace_mark(T_PROCESS);
+    job_reply(job, &ph, ph.msg_len ? body : NULL);
+    trace_mark(T_REPLY);
+    free(body);
+}
 
-            // Update auction
-            sem_wait(&auctions_wlock);
-            auction->bid = bid;
-            if (auction->highest_bidder) free(auction->highest_bidder);
-            auction->highest_bidder = strdup(job->username);
-            sem_post(&auctions_wlock);
-
-            // Send ANUPDATE to ALL users
-            sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-            curr = users->head;
-            while (curr) {
-                user = curr->data;
-
-                if (!isWatching(auction->users_watching, user)) {
-                    curr = curr->next;
-                    continue;
-                }
+int forward_bids(job_t *job, int shard, bid_req_t *bids, int n, uint8_t *results) {
+    list_t *args = init(NULL, free);
+    char num_buf[32];
+    int i;
+    for (i = 0; i < n; i++) {
+        sprintf(num_buf, "%u", bids[i].auction_id);
+        insertRear(args, strdup(num_buf));
+        sprintf(num_buf, "%lu", bids[i].amount);
+        insertRear(args, strdup(num_buf));
+    }
 
-                char auctionID[128];
-                char bid_buf[128];
+    petr_header ph;
+    char *body = NULL;
+    uint8_t *remote = malloc(n);
+    uint32_t m = 0;
+    metrics_count(M_SHARD_FORWARDED, 1);
+    if (shard_call(shard, job->proto, job->username, ANBIDBATCH, args, &ph, &body) == 0 && ph.msg_type == ANBIDBATCH) {
+        rbuf_t r;
+        rbuf_init(&r, body, ph.msg_len);
+        if (wire_bidresults_decode(&r, job->proto, remote, n, &m) < 0) m = 0;
+    }
+
+    int accepted = 0;
+    for (i = 0; i < n; i++) {
+        int result = (i < m) ? remote[i] : EANNOTFOUND;
+        if (result == OK) accepted++;
+        results[bids[i].index] = result;
+    }
+    free(remote);
+    free(body);
+    deleteList(args);
+    return accepted;
+}
 
-                sprintf(auctionID, "%d", auction->id);
-                sprintf(bid_buf, "%ld", bid);
+void *session_thread() {
+    pthread_detach(pthread_self());
+    user_t *expired[256];
 
-                list_t *args = init(NULL, free);
-                insertRear(args, strdup(auctionID));
-                insertRear(args, strdup(auction->item_name));
-                insertRear(args, strdup(job->username));
-                insertRear(args, strdup(bid_buf));
+    while (1) {
+        sleep(1);
+        int i, n;
+        do {
+            n = session_expire(metrics_now(), expired, 256);
+            for (i = 0; i < n; i++) unwatch_ended(expired[i]);
+            metrics_count(M_SESSIONS_EXPIRED, n);
+        } while (n == 256);
+    }
+    return NULL;
+}
 
-                char *msg = strjoin(args, "\r\n");
-                ph.msg_len = strlen(msg) + 1;
-                ph.msg_type = ANUPDATE;
+void *tick_thread(void *ticks) {
+    int tick_speed = *(int *)ticks;
+    pthread_detach(pthread_self());
+    free(ticks);
 
-                wr_msg(user->fd, &ph, msg);
+    while (1) {
+        if (tick_speed >= 0) sleep(tick_speed);
+        else press_to_cont();
+        run_tick();
+    }
+    return NULL;
+}
 
-                deleteList(args);
-                free(msg);
-                curr = curr->next;
-            }
-            sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+int run_tick() {
+    int counter = ++tick_counter;
+    uint64_t tick_start = metrics_now();
+    if (log_fileptr) {
+        sem_wait(&logfile_wlock);
+        clk = time(NULL);
+        fprintf(log_fileptr, "%s", ctime(&clk));
+        fprintf(log_fileptr, "Tick Thread (TID %ld)\n", pthread_self());
+        fprintf(log_fileptr, "%s %d\n\n", "Tick", counter);
+        sem_post(&logfile_wlock);
+    }
 
-            ph.msg_len = 0;
-            ph.msg_type = OK;
-            wr_msg(job->client_fd, &ph, NULL);
-            if (log_fileptr) {
-                sem_wait(&logfile_wlock);
-                clk = time(NULL);
-                fprintf(log_fileptr, "%s", ctime(&clk));
-                fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s %d %ld\n\n", "ANBID", job->username, auctionID, bid);
-                sem_post(&logfile_wlock);
-            }
-        }
-        else if (job->type == USRLIST) {
-            if (job->args && job->args->length != 0) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
+    // One partition per job thread and this one, as far as there are chunks
+    // to go around. Waiting for them holds nothing: the job threads may
+    // have to wait for a full job_queue or a snapshot first.
+    int i, parts = ticker_parts(&ticker, pool_size() + 1);
+    tick_parts = parts;
+    atomic_store(&tick_closed, 0);
+    for (i = 1; i < parts; i++) {
+        tick_part_ids[i] = i;
+        sbuf_insert(job_queue, server_job(JOB_TICK, &tick_part_ids[i])); // LANE_BID
+    }
+    long n = tick_part(0, parts);
+    for (i = 1; i < parts; i++) sem_wait(&tick_done);
+    n += atomic_load(&tick_closed);
+    rcu_reclaim();
+
+    metrics_count(M_TICKS, 1);
+    metrics_record(H_TICK, metrics_now() - tick_start);
+    return n;
+}
 
-            sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-            node_t *curr = users->head;
-            list_t *usernames = init(NULL, free);
-            while (curr)
-            {
-                user_t *u = curr->data;
-                if (u->is_online && strcmp(u->username, job->username)) {
-                    insertRear(usernames, strdup(u->username));
-                }
+void admin_tick(char *arg, FILE *fp) {
+    if (!virtual_clock) {
+        fprintf(fp, "tick needs the virtual clock (-t v)\n");
+        return;
+    }
+    long n = strtol(arg, NULL, 10);
+    if (n < 1) {
+        fprintf(fp, "usage: tick N\n");
+        return;
+    }
 
-                curr = curr->next;
-            }
-            sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+    // Back to back on the admin thread, the only one ticking in this mode
+    uint64_t start = metrics_now(), slowest = 0;
+    long closed = 0, i;
+    for (i = 0; i < n; i++) {
+        uint64_t tick_start = metrics_now();
+        closed += run_tick();
+        uint64_t took = metrics_now() - tick_start;
+        if (took > slowest) slowest = took;
+    }
+    double elapsed = (metrics_now() - start) / 1e9;
+
+    fprintf(fp, "ticks %ld\n", n);
+    fprintf(fp, "tick_counter %d\n", tick_counter);
+    fprintf(fp, "tick_parts %d\n", tick_parts);
+    fprintf(fp, "auctions_closed %ld\n", closed);
+    fprintf(fp, "elapsed_seconds %.6f\n", elapsed);
+    fprintf(fp, "tick_mean_us %.1f\n", elapsed * 1e6 / n);
+    fprintf(fp, "tick_max_us %.1f\n", slowest / 1e3);
+    fprintf(fp, "ticks_per_second %.0f\n", n / elapsed);
+    fprintf(fp, "closes_per_second %.0f\n", closed / elapsed);
+}
 
-            char *msg = strjoin(usernames, "\n");
-            if (msg) {
-                msg = realloc(msg, strlen(msg) + 1);
-                msg = strcat(msg, "\n");
+int tick_part(int part, int parts) {
+    auction_t **closed = NULL;
+    repl_begin();
+    int n = tick_auctions(part, parts, &closed);
+    repl_end();
+
+    // Settled as one batch, queued outside repl_begin as close_auctions may
+    // block on a full job_queue
+    metrics_count(M_AUCTIONS_CLOSED, n);
+    if (n) close_auctions(closed, n);
+    free(closed);
+    return n;
+}
 
-                ph.msg_len = strlen(msg) + 1;
-                ph.msg_type = USRLIST;
-                wr_msg(job->client_fd, &ph, msg);
-                free(msg);
-            }
-            else {
-                ph.msg_len = 0;
-                ph.msg_type = USRLIST;
-                wr_msg(job->client_fd, &ph, NULL);
-            }
-            if (log_fileptr) {
-                sem_wait(&logfile_wlock);
-                clk = time(NULL);
-                fprintf(log_fileptr, "%s", ctime(&clk));
-                fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s\n\n", "USRLIST", job->username);
-                sem_post(&logfile_wlock);
-            }
-            deleteList(usernames);
+int tick_auctions(int part, int parts, auction_t ***closed) {
+    uint32_t *slots = NULL;
+    int i, k = 0, cap = 0, n = ticker_tick(&ticker, part, parts, &slots, &cap, repl_tick);
+    if (closed) *closed = malloc(n * sizeof(auction_t *));
+    for (i = 0; i < n; i++) {
+        auction_t *auction = ticker_owner(&ticker, slots[i]);
+        auction->rticks = 0;
+        auction_publish(auction, VIEW_RTICKS);
+
+        // A buy-it-now bid may have closed it already, the bidder settles it
+        if (topbid_close(&auction->top)) {
+            if (closed) (*closed)[k] = auction;
+            k++;
         }
-        else if (job->type == USRWINS) {
-            if (job->args && job->args->length != 0) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
-            char *msg = strdup("\0");
-            sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            node_t *curr = auctions->head;
-            while (curr) {
-                auction_t *auction = curr->data;
+    }
+    free(slots);
+    return k;
+}
 
-                if (auction->highest_bidder && auction->rticks == 0 && strcmp(job->username, auction->highest_bidder)==0) {
-                    list_t *args = init(NULL, free);
+void repl_tick(int chunk) {
+    wbuf_t *ev = repl_event_begin(EV_TICK);
+    if (ev) {
+        wbuf_put_u32(ev, chunk);
+        repl_event_end(ev);
+    }
+}
 
-                    char num_buf[128];
-                    sprintf(num_buf, "%d", auction->id);
-                    insertRear(args, strdup(num_buf));
+unsigned int auction_rticks(auction_t *auction) {
+    return ticker_rticks(&ticker, auction->slot);
+}
 
-                    insertRear(args, strdup(auction->item_name));
+auction_t *find_auction(unsigned int id) {
+    trace_mark(T_PROCESS);
+    sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+    trace_mark(T_LOCK);
+    auction_t *auction = auction_lookup(auctions, id);
+    sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+    return auction;
+}
 
-                    sprintf(num_buf, "%ld", auction->bid);
-                    insertRear(args, strdup(num_buf));
+auction_t *index_auction(unsigned int id) {
+    auction_t *auction = NULL;
+    rcu_read_lock();
+    rcu_array_t *index = atomic_load(&auction_index);
+    int lo = 0, hi = atomic_load(&index->n) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        auction_t *a = index->items[mid];
+        if (a->id == id) {
+            auction = a;
+            break;
+        }
+        if (a->id < id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    rcu_read_unlock();
+    return auction;
+}
 
-                    char *m = strjoin(args, ";");
+user_t *find_user(char *username) {
+    trace_mark(T_PROCESS);
+    sem_enableread(&users_rlock, &users_wlock, &users_rcount);
+    trace_mark(T_LOCK);
+    user_t *user = user_lookup(users, username);
+    sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+    return user;
+}
 
-                    m = realloc(m, strlen(m) + 1);
-                    m = strcat(m, "\n");
+int place_bid(auction_t *auction, char *username, user_t *user, unsigned long bid) {
+    uint64_t cur = atomic_load(&auction->top);
+    if (topbid_closed(cur)) return EANNOTFOUND;
+    if (!strcmp(username, auction->creater) || !isWatching(auction->users_watching, user)) return EANDENIED;
+
+    repl_begin();
+    atomic_fetch_add(&auction->placing, 1);
+    int result;
+    while (!(result = topbid_check(cur, bid))) {
+        // Hold the bid as committed funds; a leader raising their own bid
+        // only commits the difference. A proxy's balance lives on its home
+        // shard, so remote bidders are not held to the credit limit.
+        int64_t held = (topbid_uid(cur) == user->id) ? topbid_bid(cur) : 0;
+        if (settle_reserve(user, bid - held, (user->shard >= 0) ? -1 : credit_limit) < 0) {
+            result = EANDENIED;
+            break;
+        }
+        result = accept_bid(auction, user, bid, &cur);
+        if (result != -1) break;
+        // Another bid got in first, check against it
+        settle_release(user, bid - held);
+        metrics_count(M_BID_RETRIES, 1);
+    }
 
-                    msg = realloc(msg, strlen(msg) + strlen(m) + 1);
-                    msg = strcat(msg, m);
-                    deleteList(args);
-                    free(m);
-                }
-                curr = curr->next;
-            }
-            sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+    if (result == OK || result == ANCLOSED) {
+        wbuf_t *ev = repl_event_begin(EV_BID);
+        if (ev) {
+            wbuf_put_u32(ev, auction->id);
+            wbuf_put_str(ev, username);
+            wbuf_put_u64(ev, bid);
+            repl_event_end(ev);
+        }
+    }
+    atomic_fetch_sub(&auction->placing, 1);
+    repl_end();
+    return result;
+}
 
-            if (*msg) {
-                ph.msg_len = strlen(msg) + 1;
-                ph.msg_type = USRWINS;
-                wr_msg(job->client_fd, &ph, msg);
-            }
-            else {
-                ph.msg_len = 0;
-                ph.msg_type = USRWINS;
-                wr_msg(job->client_fd, &ph, NULL);
-            }
-            if (log_fileptr) {
-                sem_wait(&logfile_wlock);
-                clk = time(NULL);
-                fprintf(log_fileptr, "%s", ctime(&clk));
-                fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s\n\n", "USRWINS", job->username);
-                sem_post(&logfile_wlock);
-            }
-            free(msg);
+int accept_bid(auction_t *auction, user_t *user, unsigned long bid, uint64_t *cur) {
+    uint64_t prev = *cur;
+    int result = topbid_cas(&auction->top, cur, user->id, bid, auction->bin);
+    if (result == -1) return -1;
+
+    // The outbid leader's funds are free again
+    user_t *leader = user_by_id(topbid_uid(prev));
+    if (leader && leader != user) settle_release(leader, topbid_bid(prev));
+
+    if (result == ANCLOSED) {
+        // The closed bit already keeps the tick from settling it
+        auction->rticks = 0;
+        ticker_set(&ticker, auction->slot, 0);
+        auction_publish(auction, VIEW_BID | VIEW_RTICKS);
+        return ANCLOSED;
+    }
+    auction_publish(auction, VIEW_BID);
+    return OK;
+}
+
+int resolve_proxies(auction_t *auction, user_t **bidder, unsigned long *bid) {
+    proxy_book_t *book = proxy_book(auction, 0);
+    if (!book) return -1;
+
+    int result = -1;
+    repl_begin();
+    trace_mark(T_PROCESS);
+    sem_wait(&book->lock);
+    trace_mark(T_LOCK);
+    while (book->n) {
+        uint64_t top = atomic_load(&auction->top);
+        if (topbid_closed(top)) break;
+        proxy_t *first = &book->entries[0];
+        unsigned long price = topbid_bid(top);
+        int leading = (topbid_uid(top) == first->user->id);
+
+        // The highest proxy goes one above the best competing offer: the
+        // runner-up's max, and the current bid unless it is its own
+        unsigned long target = (book->n > 1) ? book->entries[1].max : 0;
+        if (!leading && price > target) target = price;
+        target = (target < first->max) ? target + 1 : first->max;
+        if (target <= price) {
+            if (leading) break;
+            // Outbid past its max
+            proxy_remove(book, 0);
+            continue;
         }
-        else if (job->type == USRSALES) {
-            if (job->args && job->args->length != 0) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
-            char *msg = strdup("\0");
-            sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
-            node_t *curr = auctions->head;
-            while (curr) {
-                auction_t *auction = curr->data;
-
-                if (auction->creater && auction->rticks == 0 && !strcmp(job->username, auction->creater)) {
-                    list_t *args = init(NULL, free);
-
-                    char num_buf[128];
-                    sprintf(num_buf, "%d", auction->id);
-                    insertRear(args, strdup(num_buf));
-
-                    insertRear(args, strdup(auction->item_name));
-
-                    if (auction->highest_bidder) {
-                        insertRear(args, strdup(auction->highest_bidder));
-                        sprintf(num_buf, "%ld", auction->bid);
-                        insertRear(args, strdup(num_buf));
-                    }
-                    else {
-                        insertRear(args, strdup("None"));
-                        insertRear(args, strdup("None"));
-                    }
-
-                    char *m = strjoin(args, ";");
-
-                    m = realloc(m, strlen(m) + 1);
-                    m = strcat(m, "\n");
-
-                    msg = realloc(msg, strlen(msg) + strlen(m) + 1);
-                    msg = strcat(msg, m);
-                    deleteList(args);
-                    free(m);
-                }
-                curr = curr->next;
-            }
-            sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
 
-            if (*msg) {
-                ph.msg_len = strlen(msg) + 1;
-                ph.msg_type = USRSALES;
-                wr_msg(job->client_fd, &ph, msg);
-            }
-            else {
-                ph.msg_len = 0;
-                ph.msg_type = USRSALES;
-                wr_msg(job->client_fd, &ph, NULL);
-            }
+        int r = place_bid(auction, first->user->username, first->user, target);
+        if (r == OK || r == ANCLOSED) {
+            metrics_count(M_BIDS_ACCEPTED, 1);
+            metrics_count(M_PROXY_BIDS, 1);
             if (log_fileptr) {
                 sem_wait(&logfile_wlock);
                 clk = time(NULL);
                 fprintf(log_fileptr, "%s", ctime(&clk));
                 fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s\n\n", "USRSALES", job->username);
+                fprintf(log_fileptr, "%s %s %d %ld\n\n", "ANBID:PROXY", first->user->username, auction->id, target);
                 sem_post(&logfile_wlock);
             }
-            free(msg);
+            result = r;
+            *bidder = first->user;
+            *bid = target;
         }
-        else if (job->type == USRBLNC) {
-            if (job->args && job->args->length != 0) {
-                ph.msg_len = 0;
-                ph.msg_type = ESERV;
-                wr_msg(job->client_fd, &ph, NULL);
-                free_job(job); job = NULL;
-                continue;
-            }
-            char num_buf[128];
-            sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-            node_t *curr = users->head;
-            user_t *user;
-            while (curr) {
-                user_t *u = curr->data;
-
-                if (!strcmp(job->username, u->username)) {
-                    user = u;
-                    break;
-                }
+        else if (r != EBIDLOW) {
+            // Stopped watching or over the credit limit, the proxy is void
+            repl_proxy(auction, first->user, 0);
+            proxy_remove(book, 0);
+        }
+        // EBIDLOW: a bid got in meanwhile, look again
+    }
+    uint64_t top = atomic_load(&auction->top);
+    proxy_prune(book, topbid_uid(top), topbid_bid(top));
+    sem_post(&book->lock);
+    repl_end();
+    return result;
+}
 
-                curr = curr->next;
-            }
-            sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+void repl_proxy(auction_t *auction, user_t *user, unsigned long max) {
+    wbuf_t *ev = repl_event_begin(EV_PROXY);
+    if (ev) {
+        wbuf_put_u32(ev, auction->id);
+        wbuf_put_str(ev, user->username);
+        wbuf_put_u64(ev, max);
+        repl_event_end(ev);
+    }
+}
 
-            sprintf(num_buf, "%d", user->balance);
+void broadcast_anupdate(auction_t *auction, char *bidder, unsigned long bid) {
+    petr_header ph;
 
-            ph.msg_len = strlen(num_buf) + 1;
-            ph.msg_type = USRBLNC;
-            wr_msg(job->client_fd, &ph, num_buf);
-            if (log_fileptr) {
-                sem_wait(&logfile_wlock);
-                clk = time(NULL);
-                fprintf(log_fileptr, "%s", ctime(&clk));
-                fprintf(log_fileptr, "Job Thread (TID %ld)\n", pthread_self());
-                fprintf(log_fileptr, "%s %s\n\n", "USRBLNC", job->username);
-                sem_post(&logfile_wlock);
-            }
-        }
-        else {
-            ph.msg_len = 0;
-            ph.msg_type = ESERV;
-            wr_msg(job->client_fd, &ph, NULL);
+    // Encode once per wire version, shared by every watcher
+    wbuf_t msgs[PETR_V2 + 1];
+    int v;
+    for (v = PETR_V1; v <= PETR_V2; v++) {
+        wbuf_init(&msgs[v], 64);
+        wire_anupdate(&msgs[v], v, auction->id, auction->item_name, bidder, bid);
+    }
+
+    // Send ANUPDATE to ALL users watching the auction
+    trace_mark(T_PROCESS);
+    sem_enableread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+    trace_mark(T_LOCK);
+    int i;
+    for (i = 0; i < 5; i++) {
+        user_t *user = auction->users_watching[i];
+        if (!user) continue;
+
+        ph.msg_len = msgs[user->proto].len;
+        ph.msg_type = ANUPDATE;
+        send_to_user(user, &ph, msgs[user->proto].data);
+        metrics_count(M_UPDATES_SENT, 1);
+    }
+    sem_releaseread(&auctions_rlock, &auctions_wlock, &auctions_rcount);
+    trace_mark(T_BROADCAST);
+
+    for (v = PETR_V1; v <= PETR_V2; v++) {
+        wbuf_free(&msgs[v]);
+    }
+}
+
+void close_auctions(auction_t **closed, int n) {
+    settlement_t *batch = malloc(n * sizeof(settlement_t));
+    int i;
+
+    // The closed bit makes the leading bid final; bids that took the lead
+    // before it was set are waited out so their events precede EV_CLOSE
+    for (i = 0; i < n; i++) {
+        while (atomic_load(&closed[i]->placing)) sched_yield();
+    }
+    sem_enableread(&users_rlock, &users_wlock, &users_rcount);
+    for (i = 0; i < n; i++) settlement_of(closed[i], &batch[i]);
+    sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+
+    repl_begin();
+    settle_apply(batch, n);
+    wbuf_t *ev = repl_event_begin(EV_CLOSE);
+    if (ev) {
+        wbuf_put_u32(ev, n);
+        for (i = 0; i < n; i++) wbuf_put_u32(ev, batch[i].auction_id);
+        repl_event_end(ev);
+    }
+    repl_end();
+
+    // Proxies were settled like local users, their home shards apply the
+    // same amounts to the real accounts
+    for (i = 0; i < n; i++) {
+        settlement_t *s = &batch[i];
+        if (!s->winner) continue;
+        if (s->winner->shard >= 0) shard_settle(s->winner->shard, s->winner->username, -s->amount);
+        if (s->seller && s->seller->shard >= 0) shard_settle(s->seller->shard, s->seller->username, s->amount);
+    }
+    free(batch);
+
+    for (i = 0; i < n; i++) {
+        job_t *job = server_job(ANCLOSED, &closed[i]->id);
+        if (local_jobs) insertRear(local_jobs, job);
+        else sbuf_insert(job_queue, job); // LANE_BID
+    }
+}
+
+void close_auction(auction_t *auction) {
+    close_auctions(&auction, 1);
+}
+
+int watch_auction(auction_t *auction, user_t *user) {
+    int i;
+    sem_wait(&watchers_lock);
+    for (i = 0; i < 5 && auction->users_watching[i]; i++);
+    if (i == 5) {
+        sem_post(&watchers_lock);
+        return -1;
+    }
+    auction->users_watching[i] = user;
+    insertFront(user->watching, auction);
+    auction_publish(auction, VIEW_WATCHERS);
+    wbuf_t *ev = repl_event_begin(EV_WATCH);
+    if (ev) {
+        wbuf_put_u32(ev, auction->id);
+        wbuf_put_str(ev, user->username);
+        repl_event_end(ev);
+    }
+    sem_post(&watchers_lock);
+    return 0;
+}
+
+void drop_watcher(auction_t *auction, user_t *user) {
+    int i;
+    for (i = 0; i < 5 && auction->users_watching[i] != user; i++);
+    if (i == 5) return;
+    auction->users_watching[i] = NULL;
+    auction_publish(auction, VIEW_WATCHERS);
+    wbuf_t *ev = repl_event_begin(EV_LEAVE);
+    if (ev) {
+        wbuf_put_u32(ev, auction->id);
+        wbuf_put_str(ev, user->username);
+        repl_event_end(ev);
+    }
+}
+
+void unwatch_auction(auction_t *auction, user_t *user) {
+    sem_wait(&watchers_lock);
+    node_t *curr = user->watching->head;
+    int i = 0;
+    while (curr && curr->data != auction) {
+        curr = curr->next;
+        i++;
+    }
+    if (curr) {
+        removeByIndex(user->watching, i);
+        drop_watcher(auction, user);
+    }
+    sem_post(&watchers_lock);
+}
+
+void unwatch_all(user_t *user) {
+    repl_begin();
+    sem_wait(&watchers_lock);
+    while (user->watching->length > 0) drop_watcher(removeFront(user->watching), user);
+    sem_post(&watchers_lock);
+    repl_end();
+}
+
+void unwatch_ended(user_t *user) {
+    repl_begin();
+    sem_wait(&watchers_lock);
+    if (!user->is_online && !session_held(user)) {
+        while (user->watching->length > 0) drop_watcher(removeFront(user->watching), user);
+    }
+    sem_post(&watchers_lock);
+    repl_end();
+}
+
+job_t *server_job(int type, void *arg) {
+    job_t *job = malloc(sizeof(job_t));
+    job->type = type;
+    job->client_fd = -1;
+    job->proto = PETR_V1;
+    job->username = NULL;
+    job->user = NULL;
+    job->args = init(NULL, NULL);
+    insertRear(job->args, arg);
+    job->enqueued_ns = metrics_now();
+    job->trace = NULL;
+    job->peer_fd = -1;
+    return job;
+}
+
+void settlement_of(auction_t *auction, settlement_t *s) {
+    uint64_t top = atomic_load(&auction->top);
+    s->auction_id = auction->id;
+    s->winner = user_by_id(topbid_uid(top));
+    s->seller = user_lookup(users, auction->creater);
+    if (!s->seller && shard_home(auction->creater) != shard_self) {
+        s->seller = proxy_user(auction->creater, shard_home(auction->creater));
+    }
+    s->amount = topbid_bid(top);
+}
+
+void repl_snapshot(wbuf_t *b) {
+    size_t start = repl_frame_begin(b, EV_SYNC);
+    wbuf_put_u32(b, auctionID);
+    wbuf_put_u64(b, (uint64_t)settle_house_balance());
+    repl_frame_end(b, start);
+
+    // Every change is paused, the live objects are consistent
+    rcu_read_lock();
+    rcu_array_t *index = atomic_load(&user_index);
+    int i, n = atomic_load(&index->n);
+    for (i = 0; i < n; i++) {
+        start = repl_frame_begin(b, EV_USER);
+        repl_put_user(b, index->items[i]);
+        repl_frame_end(b, start);
+    }
+    index = atomic_load(&auction_index);
+    n = atomic_load(&index->n);
+    for (i = 0; i < n; i++) {
+        auction_t *auction = index->items[i];
+        start = repl_frame_begin(b, EV_AUCTION);
+        repl_put_auction(b, auction, auction_rticks(auction));
+        repl_frame_end(b, start);
+
+        proxy_book_t *book = proxy_book(auction, 0);
+        int j;
+        for (j = 0; book && j < book->n; j++) {
+            start = repl_frame_begin(b, EV_PROXY);
+            wbuf_put_u32(b, auction->id);
+            wbuf_put_str(b, book->entries[j].user->username);
+            wbuf_put_u64(b, book->entries[j].max);
+            repl_frame_end(b, start);
         }
-        free_job(job); job = NULL;
     }
-    return NULL;
+    rcu_read_unlock();
 }
 
-void *tick_thread(void *ticks) {
-    int tick_speed = *(int *)ticks;
-    pthread_detach(pthread_self());
-    free(ticks);
+static char *wstr_dup(wstr_t *s) {
+    return strndup(s->ptr, s->len);
+}
 
-    int counter = 0;
-    while (1) {
-        if (tick_speed >= 0) sleep(tick_speed);
-        else press_to_cont();
+void repl_apply(int type, rbuf_t *r) {
+    wstr_t s1, s2, s3;
+    uint64_t u1, u2;
+    uint32_t id;
+    uint8_t n;
+    int i;
 
-        counter++;
-        if (log_fileptr) {
-            sem_wait(&logfile_wlock);
-            clk = time(NULL);
-            fprintf(log_fileptr, "%s", ctime(&clk));
-            fprintf(log_fileptr, "Tick Thread (TID %ld)\n", pthread_self());
-            fprintf(log_fileptr, "%s %d\n\n", "Tick", counter);
-            sem_post(&logfile_wlock);
+    if (type == EV_SYNC) {
+        if (rbuf_get_u32(r, &id) < 0 || rbuf_get_u64(r, &u1) < 0) return;
+        auctionID = id;
+        settle_restore_house((int64_t)u1);
+    }
+    else if (type == EV_USER) {
+        if (rbuf_get_str(r, &s1) < 0 || rbuf_get_str(r, &s2) < 0 ||
+            rbuf_get_u64(r, &u1) < 0 || rbuf_get_u64(r, &u2) < 0) return;
+        user_t *user = malloc(sizeof(user_t));
+        user->username = wstr_dup(&s1);
+        user->password = wstr_dup(&s2);
+        user->fd = -1;
+        user->balance = (int64_t)u1;
+        user->committed = (int64_t)u2;
+        user->proto = PETR_V1;
+        user->is_online = 0;
+        user->shard = -1;
+        atomic_init(&user->watches_queued, 0);
+        user->watching = init(NULL, NULL);
+        user->session = NULL;
+        if (user_register(user) < 0) {
+            free_user(user);
+            return;
+        }
+        insertFront(users, user);
+        rcu_array_append(&user_index, user);
+    }
+    else if (type == EV_AUCTION) {
+        uint32_t rticks;
+        if (rbuf_get_u32(r, &id) < 0 || rbuf_get_str(r, &s1) < 0 || rbuf_get_str(r, &s2) < 0 ||
+            rbuf_get_u64(r, &u1) < 0 || rbuf_get_u32(r, &rticks) < 0 || rbuf_get_u64(r, &u2) < 0 ||
+            rbuf_get_str(r, &s3) < 0 || rbuf_get_u8(r, &n) < 0) return;
+        char *creater = wstr_dup(&s1), *item_name = wstr_dup(&s2);
+        auction_t *auction = new_auction(item_name, creater, rticks, u1);
+        free(creater);
+        free(item_name);
+        auction->id = id;
+        user_t *leader = NULL;
+        if (s3.len) {
+            char *name = wstr_dup(&s3);
+            leader = user_lookup(users, name);
+            free(name);
+        }
+        atomic_store(&auction->top, topbid_pack(u2, (leader) ? leader->id : 0) | ((rticks == 0) ? TOPBID_CLOSED : 0));
+        for (i = 0; i < n && i < 5; i++) {
+            if (rbuf_get_str(r, &s1) < 0) break;
+            char *name = wstr_dup(&s1);
+            auction->users_watching[i] = user_lookup(users, name);
+            if (auction->users_watching[i]) insertFront(auction->users_watching[i]->watching, auction);
+            free(name);
+        }
+        insertRear(auctions, auction);
+        auction->slot = ticker_add(&ticker, auction, rticks);
+        auction_publish(auction, VIEW_ALL);
+        rcu_array_append(&auction_index, auction);
+        if (id >= auctionID) auctionID = id + 1;
+    }
+    else if (type == EV_WATCH || type == EV_LEAVE) {
+        if (rbuf_get_u32(r, &id) < 0 || rbuf_get_str(r, &s1) < 0) return;
+        auction_t *auction = find_auction(id);
+        char *name = wstr_dup(&s1);
+        user_t *user = user_lookup(users, name);
+        free(name);
+        if (!auction || !user) return;
+        if (type == EV_WATCH) watch_auction(auction, user);
+        else unwatch_auction(auction, user);
+    }
+    else if (type == EV_BID) {
+        if (rbuf_get_u32(r, &id) < 0 || rbuf_get_str(r, &s1) < 0 || rbuf_get_u64(r, &u1) < 0) return;
+        auction_t *auction = find_auction(id);
+        char *name = wstr_dup(&s1);
+        user_t *user = user_lookup(users, name);
+        // Concurrent bids may log their events out of order, only a bid
+        // above the current one applies. The primary already checked the
+        // credit limit.
+        uint64_t cur = (auction) ? atomic_load(&auction->top) : 0;
+        if (auction && user && u1 > topbid_bid(cur)) {
+            int64_t held = (topbid_uid(cur) == user->id) ? topbid_bid(cur) : 0;
+            settle_reserve(user, (int64_t)u1 - held, -1);
+            accept_bid(auction, user, u1, &cur);
+        }
+        free(name);
+    }
+    else if (type == EV_PROXY) {
+        if (rbuf_get_u32(r, &id) < 0 || rbuf_get_str(r, &s1) < 0 || rbuf_get_u64(r, &u1) < 0) return;
+        auction_t *auction = find_auction(id);
+        char *name = wstr_dup(&s1);
+        user_t *user = user_lookup(users, name);
+        free(name);
+        if (!auction || !user) return;
+        // The bids the proxy made follow as EV_BID
+        proxy_book_t *book = proxy_book(auction, 1);
+        sem_wait(&book->lock);
+        proxy_set(book, user, u1);
+        sem_post(&book->lock);
+    }
+    else if (type == EV_TICK) {
+        // Just the chunk the primary ticked, in the same order against the
+        // chunk's other events as there
+        if (rbuf_get_u32(r, &id) < 0) return;
+        tick_auctions(id, TICKER_MAX_CHUNKS, NULL);
+    }
+    else if (type == EV_CLOSE) {
+        uint32_t count;
+        if (rbuf_get_u32(r, &count) < 0) return;
+        settlement_t *batch = malloc(count * sizeof(settlement_t));
+        uint32_t j, k = 0;
+        for (j = 0; j < count && rbuf_get_u32(r, &id) == 0; j++) {
+            auction_t *auction = find_auction(id);
+            if (auction) settlement_of(auction, &batch[k++]);
         }
+        settle_apply(batch, k);
+        free(batch);
+    }
+}
 
-        sem_wait(&auctions_wlock);
-        node_t *cur = (node_t *)auctions->head;
-        while (cur) {
-            auction_t *auction = (auction_t *)cur->data;
-            if (auction->rticks == 0) {
-                cur = cur->next;
-                continue;
-            }
+void *admin_thread(void *path) {
+    pthread_detach(pthread_self());
+
+    int admin_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, (char *)path, sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
 
-            auction->rticks--;
+    if (admin_fd < 0 || bind(admin_fd, (SA *)&addr, sizeof(addr)) != 0 || listen(admin_fd, 8) != 0) {
+        perror("admin socket");
+        return NULL;
+    }
 
-            if (auction->rticks == 0) {
-                job_t *job = malloc(sizeof(job_t));
-                job->type = ANCLOSED;
-                job->client_fd = -1;
-                job->username = NULL;
-                job->args = init(NULL, NULL);
-                insertRear(job->args, &auction->id);
+    while (1) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) continue;
+
+        // One command line per connection; a bare connect means "stats"
+        struct timeval tv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char cmd[256];
+        size_t len = 0;
+        while (len < sizeof(cmd) - 1) {
+            ssize_t r = read(fd, cmd + len, 1);
+            if (r <= 0 || cmd[len] == '\n') break;
+            len++;
+        }
+        cmd[len] = '\0';
+        if (len && cmd[len - 1] == '\r') cmd[len - 1] = '\0';
 
-                sbuf_insert(job_queue, job);
-            }
-            cur = cur->next;
+        FILE *fp = fdopen(fd, "w");
+        if (!fp) {
+            close(fd);
+            continue;
         }
-        sem_post(&auctions_wlock);
+        admin_command(cmd, fp);
+        fclose(fp);
     }
     return NULL;
 }
 
+void admin_command(char *cmd, FILE *fp) {
+    if (!strcmp(cmd, "") || !strcmp(cmd, "stats")) {
+        fprintf(fp, "job_queue_depth %d\n", sbuf_length(job_queue));
+        fprintf(fp, "job_queue_depth{lane=\"bid\"} %d\n", sbuf_lane_length(job_queue, LANE_BID));
+        fprintf(fp, "job_queue_depth{lane=\"default\"} %d\n", sbuf_lane_length(job_queue, LANE_DEFAULT));
+        fprintf(fp, "job_queue_depth{lane=\"query\"} %d\n", sbuf_lane_length(job_queue, LANE_QUERY));
+        fprintf(fp, "job_queue_capacity %d\n", job_queue->n);
+        if (pool_elastic()) {
+            fprintf(fp, "job_threads_min %d\n", pool_min);
+            fprintf(fp, "job_threads_max %d\n", pool_max);
+        }
+        fprintf(fp, "rcu_pending %ld\n", rcu_pending());
+        if (repl_path) {
+            fprintf(fp, "repl_attached %d\n", repl_attached());
+            fprintf(fp, "repl_backlog_bytes %lu\n", (unsigned long)repl_backlog());
+        }
+        if (shard_count > 1) {
+            fprintf(fp, "shard_self %d\n", shard_self);
+            fprintf(fp, "shard_count %d\n", shard_count);
+        }
+        metrics_dump(fp);
+    }
+    else if (!strcmp(cmd, "ledger")) {
+        // Every settlement moves money between accounts, so this must be 0.
+        // Proxies mirror what this shard settled with remote users, transfers
+        // what other shards settled with local ones.
+        int64_t total = settle_house_balance() - settle_transfers(), committed = 0;
+        sem_enableread(&users_rlock, &users_wlock, &users_rcount);
+        node_t *curr = users->head;
+        while (curr) {
+            total += atomic_load(&((user_t *)curr->data)->balance);
+            committed += atomic_load(&((user_t *)curr->data)->committed);
+            curr = curr->next;
+        }
+        sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+        sem_wait(&proxies_lock);
+        for (curr = proxies->head; curr; curr = curr->next) {
+            total += atomic_load(&((user_t *)curr->data)->balance);
+            committed += atomic_load(&((user_t *)curr->data)->committed);
+        }
+        sem_post(&proxies_lock);
+        fprintf(fp, "balance_sum %ld\n", (long)total);
+        fprintf(fp, "committed_sum %ld\n", (long)committed);
+        ledger_dump(fp, 20);
+    }
+    else if (!strcmp(cmd, "trace on") || !strcmp(cmd, "trace off")) {
+        trace_enable(!strcmp(cmd, "trace on"));
+        fprintf(fp, "OK\n");
+    }
+    else if (!strncmp(cmd, "trace slow ", 11)) {
+        trace_set_threshold(strtoull(cmd + 11, NULL, 10) * 1000);
+        fprintf(fp, "OK\n");
+    }
+    else if (!strcmp(cmd, "trace") || !strcmp(cmd, "trace dump")) {
+        trace_dump(fp);
+    }
+    else if (!strncmp(cmd, "tick ", 5)) {
+        admin_tick(cmd + 5, fp);
+    }
+    else {
+        fprintf(fp, "unknown command: %s\n", cmd);
+    }
+}
+
 void press_to_cont() {
     while (getchar() != '\n')
         ;
@@ -1066,7 +2032,7 @@ int server_init(int server_port) {
     }
 
     // Now server is ready to listen and verification
-    if ((listen(sockfd, 1)) != 0) {
+    if ((listen(sockfd, SOMAXCONN)) != 0) {
         printf("Listen failed\n");
         exit(EXIT_FAILURE);
     }
@@ -1083,9 +2049,11 @@ void run_server(int server_port, int num_jobthreads, int tick_speed) {
     unsigned int client_addr_len = sizeof(client_addr);
     pthread_t tid;
 
-    int i;
-    for (i = 0; i < num_jobthreads; i++) {
-        pthread_create(&tid, NULL, job_thread, NULL);
+    int i, k;
+    for (k = 0; k < num_jobthreads; k++) spawn_job_thread();
+
+    if (pool_elastic()) {
+        pthread_create(&tid, NULL, pool_thread, NULL);
         for (i = 0; i < THREADIDS_SIZE; i++) {
             if (threadids[i] == 0) {
                 threadids[i] = tid;
@@ -1094,9 +2062,10 @@ void run_server(int server_port, int num_jobthreads, int tick_speed) {
         }
     }
 
-    int *tick_s = malloc(sizeof(int));
-    *tick_s = tick_speed;
-    pthread_create(&tid, NULL, tick_thread, (void *)tick_s);
+    // Every thread started from here on inherits the I/O placement
+    affinity_place(THREAD_IO, -1, "I/O threads");
+
+    pthread_create(&tid, NULL, session_thread, NULL);
     for (i = 0; i < THREADIDS_SIZE; i++) {
         if (threadids[i] == 0) {
             threadids[i] = tid;
@@ -1104,6 +2073,66 @@ void run_server(int server_port, int num_jobthreads, int tick_speed) {
         }
     }
 
+    if (!virtual_clock) {
+        int *tick_s = malloc(sizeof(int));
+        *tick_s = tick_speed;
+        pthread_create(&tid, NULL, tick_thread, (void *)tick_s);
+        for (i = 0; i < THREADIDS_SIZE; i++) {
+            if (threadids[i] == 0) {
+                threadids[i] = tid;
+                break;
+            }
+        }
+    }
+
+    if (admin_path) {
+        pthread_create(&tid, NULL, admin_thread, (void *)admin_path);
+        for (i = 0; i < THREADIDS_SIZE; i++) {
+            if (threadids[i] == 0) {
+                threadids[i] = tid;
+                break;
+            }
+        }
+    }
+
+    if (repl_path) {
+        pthread_create(&tid, NULL, repl_thread, (void *)repl_path);
+        for (i = 0; i < THREADIDS_SIZE; i++) {
+            if (threadids[i] == 0) {
+                threadids[i] = tid;
+                break;
+            }
+        }
+    }
+
+    if (use_uring) {
+        if (netio_init(&ring_ops) < 0) {
+            perror("io_uring unavailable, using client threads");
+        }
+        else {
+            pthread_create(&tid, NULL, netio_thread, NULL);
+            for (i = 0; i < THREADIDS_SIZE; i++) {
+                if (threadids[i] == 0) {
+                    threadids[i] = tid;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (shard_count > 1) {
+        int *shard_fd = malloc(sizeof(int));
+        *shard_fd = shard_listen();
+        if (*shard_fd < 0) exit(EXIT_FAILURE);
+        pthread_create(&tid, NULL, shard_thread, (void *)shard_fd);
+        for (i = 0; i < THREADIDS_SIZE; i++) {
+            if (threadids[i] == 0) {
+                threadids[i] = tid;
+                break;
+            }
+        }
+    }
+
     while (1) {
         petr_header ph;
 
@@ -1116,97 +2145,275 @@ void run_server(int server_port, int num_jobthreads, int tick_speed) {
 
         if (rd_msgheader(temp, &ph) < 0) {
             printf("Read message error\n");
+            close(temp);
             continue;
         }
-        int *client_fd = malloc(sizeof(int));
-        *client_fd = temp;
 
+        // The first frame is a LOGIN or RESUME, which are short
         char buf[1024];
-        read(*client_fd, buf, ph.msg_len);
+        if (ph.msg_len >= sizeof(buf)) {
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            wr_msg(temp, &ph, NULL);
+            metrics_count(M_FRAMES_OVERSIZE, 1);
+            close(temp);
+            continue;
+        }
+        if (ph.msg_len && recv(temp, buf, ph.msg_len, MSG_WAITALL) != (ssize_t)ph.msg_len) {
+            printf("Read message error\n");
+            close(temp);
+            continue;
+        }
+        buf[ph.msg_len] = '\0';
+
+        // Users are served by their home shard, which gets the connection
+        if (shard_count > 1) {
+            size_t name_len = strcspn(buf, "\r\n");
+            char c = buf[name_len];
+            buf[name_len] = '\0';
+            int home = shard_home(buf);
+            buf[name_len] = c;
+
+            if (home != shard_self) {
+                if (shard_handoff(home, ph.msg_type, temp, buf, strlen(buf) + 1) == 0) {
+                    metrics_count(M_SHARD_HANDOFFS, 1);
+                }
+                else {
+                    ph.msg_len = 0;
+                    ph.msg_type = ESERV;
+                    wr_msg(temp, &ph, NULL);
+                }
+                close(temp);
+                continue;
+            }
+        }
 
-        char *username = strtok(buf, "\r\n");
-        char *password = strtok(NULL, "\r\n");
+        if (ph.msg_type == RESUME) resume_client(temp, buf);
+        else login_client(temp, buf);
+    }
+    return;
+}
 
-        user_t *user = malloc(sizeof(user_t));
-        user->username = strdup(username);
-        user->password = strdup(password);
-        user->is_online = 1;
-        user->fd = *client_fd;
-        user->balance = 0;
+void login_client(int client_fd, char *body) {
+    petr_header ph;
 
-        sem_enableread(&users_rlock, &users_wlock, &users_rcount);
-        node_t *curr = users->head;
-        user_t *user_ptr = NULL;
-        while (curr) {
-            user_t *u = curr->data;
-            if (!strcmp(u->username, user->username)) {
-                user_ptr = u;
-                break;
-            }
-            curr = curr->next;
-        }
-        sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
+    uint32_t capture_id = capture_login(body, strlen(body) + 1);
+    char *username = strtok(body, "\r\n");
+    char *password = strtok(NULL, "\r\n");
+    char *version = strtok(NULL, "\r\n");
+    char *flags = strtok(NULL, "\r\n");
+    int resume = (flags && !strcmp(flags, "resume"));
 
-        if (user_ptr) {
-            // User has logged in at least once before
+    if (!username || !password) {
+        ph.msg_len = 0;
+        ph.msg_type = ESERV;
+        wr_msg(client_fd, &ph, NULL);
+        close(client_fd);
+        return;
+    }
 
-            free(user);
+    user_t *user = malloc(sizeof(user_t));
+    user->username = strdup(username);
+    user->password = strdup(password);
+    user->is_online = 1;
+    user->fd = client_fd;
+    user->balance = 0;
+    user->committed = 0;
+    user->proto = (version && atoi(version) == PETR_V2) ? PETR_V2 : PETR_V1;
+    user->shard = -1;
+    atomic_init(&user->watches_queued, 0);
+    user->watching = init(NULL, NULL);
+    user->session = NULL;
 
-            if (user_ptr->is_online) {
-                // User is already found to be logged in
-                ph.msg_len = 0;
-                ph.msg_type = EUSRLGDIN;
-                wr_msg(*client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Main Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s\n\n", "EUSRLGDIN", user_ptr->username);
-                    sem_post(&logfile_wlock);
-                }
+    sem_enableread(&users_rlock, &users_wlock, &users_rcount);
+    node_t *curr = users->head;
+    user_t *user_ptr = NULL;
+    while (curr) {
+        user_t *u = curr->data;
+        if (!strcmp(u->username, user->username)) {
+            user_ptr = u;
+            break;
+        }
+        curr = curr->next;
+    }
+    sem_releaseread(&users_rlock, &users_wlock, &users_rcount);
 
-                free(client_fd);
-                continue;
-            }
-            else if (strcmp(user_ptr->password, user->password)) {
-                // Password does not match
-                ph.msg_len = 0;
-                ph.msg_type = EWRNGPWD;
-                wr_msg(*client_fd, &ph, NULL);
-                if (log_fileptr) {
-                    sem_wait(&logfile_wlock);
-                    clk = time(NULL);
-                    fprintf(log_fileptr, "%s", ctime(&clk));
-                    fprintf(log_fileptr, "Main Thread (TID %ld)\n", pthread_self());
-                    fprintf(log_fileptr, "%s %s\n\n", "EWRNGPWD", user_ptr->username);
-                    sem_post(&logfile_wlock);
-                }
+    if (user_ptr) {
+        // User has logged in at least once before
 
-                free(client_fd);
-                continue;
+        int proto = user->proto;
+        free_user(user);
+
+        if (user_ptr->is_online) {
+            // User is already found to be logged in
+            ph.msg_len = 0;
+            ph.msg_type = EUSRLGDIN;
+            wr_msg(client_fd, &ph, NULL);
+            metrics_count(M_LOGINS_REFUSED, 1);
+            if (log_fileptr) {
+                sem_wait(&logfile_wlock);
+                clk = time(NULL);
+                fprintf(log_fileptr, "%s", ctime(&clk));
+                fprintf(log_fileptr, "Main Thread (TID %ld)\n", pthread_self());
+                fprintf(log_fileptr, "%s %s\n\n", "EUSRLGDIN", user_ptr->username);
+                sem_post(&logfile_wlock);
             }
-            else {
-                // User successfully logged in
-                user_ptr->is_online = 1;
-                user_ptr->fd = *client_fd;
+
+            close(client_fd);
+            return;
+        }
+        else if (strcmp(user_ptr->password, password)) {
+            // Password does not match
+            ph.msg_len = 0;
+            ph.msg_type = EWRNGPWD;
+            wr_msg(client_fd, &ph, NULL);
+            metrics_count(M_LOGINS_REFUSED, 1);
+            if (log_fileptr) {
+                sem_wait(&logfile_wlock);
+                clk = time(NULL);
+                fprintf(log_fileptr, "%s", ctime(&clk));
+                fprintf(log_fileptr, "Main Thread (TID %ld)\n", pthread_self());
+                fprintf(log_fileptr, "%s %s\n\n", "EWRNGPWD", user_ptr->username);
+                sem_post(&logfile_wlock);
             }
+
+            close(client_fd);
+            return;
         }
         else {
-            // New user
-            user_ptr = user;
-            sem_wait(&users_wlock);
-            insertFront(users, user);
-            sem_post(&users_wlock);
+            // User successfully logged in
+            user_ptr->is_online = 1;
+            user_ptr->fd = client_fd;
+            user_ptr->proto = proto;
+        }
+    }
+    else {
+        // New user
+        if (user_register(user) < 0) {
+            // Out of user ids, see user_register
+            ph.msg_len = 0;
+            ph.msg_type = ESERV;
+            wr_msg(client_fd, &ph, NULL);
+            metrics_count(M_LOGINS_REFUSED, 1);
+            if (log_fileptr) {
+                sem_wait(&logfile_wlock);
+                clk = time(NULL);
+                fprintf(log_fileptr, "%s", ctime(&clk));
+                fprintf(log_fileptr, "Main Thread (TID %ld)\n", pthread_self());
+                fprintf(log_fileptr, "%s %s\n\n", "ESERV", user->username);
+                sem_post(&logfile_wlock);
+            }
+            free_user(user);
+            close(client_fd);
+            return;
         }
+        user_ptr = user;
+        repl_begin();
+        sem_wait(&users_wlock);
+        insertFront(users, user);
+        rcu_array_append(&user_index, user);
+        wbuf_t *ev = repl_event_begin(EV_USER);
+        if (ev) {
+            repl_put_user(ev, user);
+            repl_event_end(ev);
+        }
+        sem_post(&users_wlock);
+        repl_end();
+    }
+
+    // Only a client that asked for one gets a session (and its token in
+    // the OK). A new LOGIN watches again, without what a held session watched.
+    char token[SESSION_TOKEN_LEN + 1];
+    if ((resume) ? session_open(user_ptr, token) : session_end(user_ptr)) unwatch_all(user_ptr);
+    ph.msg_len = (resume) ? sizeof(token) : 0;
+    ph.msg_type = OK;
+    wr_msg(client_fd, &ph, (resume) ? token : NULL);
+    metrics_count(M_LOGINS, 1);
+    serve_client(user_ptr, client_fd, capture_id, 0);
+}
 
+void resume_client(int client_fd, char *body) {
+    petr_header ph;
+    uint32_t capture_id = capture_resume(body, strlen(body) + 1);
+    char *username = strtok(body, "\r\n");
+    char *token = strtok(NULL, "\r\n");
+
+    // Answered by session_attach once served, with the held messages
+    user_t *user = (username && token) ? session_resume(username, token, client_fd) : NULL;
+    if (!user) {
         ph.msg_len = 0;
-        ph.msg_type = OK;
-        wr_msg(*client_fd, &ph, NULL);
+        ph.msg_type = ETOKEN;
+        wr_msg(client_fd, &ph, NULL);
+        metrics_count(M_RESUMES_REFUSED, 1);
+        if (log_fileptr) {
+            sem_wait(&logfile_wlock);
+            clk = time(NULL);
+            fprintf(log_fileptr, "%s", ctime(&clk));
+            fprintf(log_fileptr, "Main Thread (TID %ld)\n", pthread_self());
+            fprintf(log_fileptr, "%s %s\n\n", "ETOKEN", (username) ? username : "");
+            sem_post(&logfile_wlock);
+        }
+        close(client_fd);
+        return;
+    }
+
+    metrics_count(M_RESUMES, 1);
+    if (log_fileptr) {
+        sem_wait(&logfile_wlock);
+        clk = time(NULL);
+        fprintf(log_fileptr, "%s", ctime(&clk));
+        fprintf(log_fileptr, "Main Thread (TID %ld)\n", pthread_self());
+        fprintf(log_fileptr, "%s %s\n\n", "RESUME", user->username);
+        sem_post(&logfile_wlock);
+    }
+    serve_client(user, client_fd, capture_id, 1);
+}
+
+void serve_client(user_t *user, int fd, uint32_t capture_id, int resume) {
+    pthread_t tid;
+    int i;
+
+    client_conn_t *conn = malloc(sizeof(client_conn_t));
+    conn->user = user;
+    conn->fd = fd;
+    conn->capture_id = capture_id;
+    conn->resume = resume;
+    ratelimit_init(&conn->rl);
+
+    if (netio_enabled()) {
+        client_started(user);
+        netio_attach(conn->fd, conn);
+        return;
+    }
+
+    // Initializing a client thread
+    sem_wait(&threadids_wlock);
+    pthread_create(&tid, NULL, client_thread, (void *)conn);
+    for (i = 0; i < THREADIDS_SIZE; i++) {
+        if (threadids[i] == 0) {
+            threadids[i] = tid;
+            break;
+        }
+    }
+    sem_post(&threadids_wlock);
+}
 
-        // Initializing a client thread
+void *shard_thread(void *fd_ptr) {
+    int shard_fd = *(int *)fd_ptr;
+    pthread_detach(pthread_self());
+    free(fd_ptr);
+
+    while (1) {
+        int conn = accept(shard_fd, NULL, NULL);
+        if (conn < 0) continue;
+
+        // One peer thread per connection, i.e. per thread of another shard
+        int *conn_ptr = malloc(sizeof(int));
+        *conn_ptr = conn;
+        pthread_t tid;
+        int i;
         sem_wait(&threadids_wlock);
-        pthread_create(&tid, NULL, client_thread, (void *)client_fd);
+        pthread_create(&tid, NULL, peer_thread, (void *)conn_ptr);
         for (i = 0; i < THREADIDS_SIZE; i++) {
             if (threadids[i] == 0) {
                 threadids[i] = tid;
@@ -1215,7 +2422,108 @@ void run_server(int server_port, int num_jobthreads, int tick_speed) {
         }
         sem_post(&threadids_wlock);
     }
-    return;
+    rcu_thread_exit();
+    return NULL;
+}
+
+void *peer_thread(void *conn_ptr) {
+    int conn = *(int *)conn_ptr;
+    pthread_detach(pthread_self());
+    free(conn_ptr);
+
+    // Requests are run here rather than queued: a job thread of this shard
+    // may itself be waiting on the shard that sent them. Jobs they raise
+    // (ANCLOSED) are run here too, after the reply.
+    local_jobs = init(NULL, free_job);
+
+    while (1) {
+        petr_header ph;
+        char *body;
+        int fd;
+        if (shard_read(conn, &ph, &body, &fd) < 0) break;
+
+        rbuf_t r;
+        rbuf_init(&r, body, ph.msg_len);
+        uint8_t proto, type;
+        wstr_t name;
+        uint64_t amount;
+        char username[256];
+
+        if (ph.msg_type == SH_HANDOFF) {
+            if (fd >= 0) login_client(fd, body);
+        }
+        else if (ph.msg_type == SH_RESUME) {
+            if (fd >= 0) resume_client(fd, body);
+        }
+        else if (ph.msg_type == SH_REQUEST) {
+            if (rbuf_get_u8(&r, &proto) < 0 || rbuf_get_str(&r, &name) < 0 || rbuf_get_u8(&r, &type) < 0) {
+                free(body);
+                break;
+            }
+            job_t *job = malloc(sizeof(job_t));
+            job->type = type;
+            job->client_fd = -1;
+            job->proto = (proto == PETR_V2) ? PETR_V2 : PETR_V1;
+            job->username = strndup(name.ptr, name.len);
+            job->user = proxy_user(job->username, shard_home(job->username));
+            job->args = (r.pos < r.len && body[r.pos]) ? strsplit(body + r.pos, "\r\n") : NULL;
+            job->enqueued_ns = metrics_now();
+            job->trace = NULL;
+            job->peer_fd = conn;
+            metrics_count(M_SHARD_SERVED, 1);
+            if (!job->user) {
+                // Out of user ids
+                ph.msg_len = 0;
+                ph.msg_type = ESERV;
+                job_reply(job, &ph, NULL);
+                free_job(job);
+                free(body);
+                continue;
+            }
+            job->user->proto = job->proto;
+
+            run_job(job);
+            while (local_jobs->length) run_job(removeFront(local_jobs));
+        }
+        else if (ph.msg_type == SH_DELIVER) {
+            if (rbuf_get_str(&r, &name) == 0 && rbuf_get_u8(&r, &type) == 0) {
+                snprintf(username, sizeof(username), "%.*s", name.len, name.ptr);
+                user_t *user = find_user(username);
+                if (user) {
+                    ph.msg_len = r.len - r.pos;
+                    ph.msg_type = type;
+                    send_to_user(user, &ph, ph.msg_len ? body + r.pos : NULL);
+                }
+            }
+        }
+        else if (ph.msg_type == SH_SETTLE) {
+            if (rbuf_get_str(&r, &name) == 0 && rbuf_get_u64(&r, &amount) == 0) {
+                snprintf(username, sizeof(username), "%.*s", name.len, name.ptr);
+                settle_transfer(find_user(username), (int64_t)amount);
+            }
+        }
+        else if (fd >= 0) {
+            close(fd);
+        }
+        free(body);
+    }
+    close(conn);
+    deleteList(local_jobs);
+    metrics_release();
+    rcu_thread_exit();
+
+    // The id of an exited detached thread must not be cancelled at shutdown
+    int i;
+    sem_wait(&threadids_wlock);
+    for (i = 0; i < THREADIDS_SIZE; i++) {
+        if (pthread_equal(threadids[i], pthread_self())) {
+            threadids[i] = 0;
+            break;
+        }
+    }
+    sem_post(&threadids_wlock);
+
+    return NULL;
 }
 
 int main(int argc, char *argv[]) {
@@ -1224,31 +2532,91 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    int opt, num_jobthreads = 2, tick_speed = -1;
+    int opt, tick_speed = -1;
     unsigned int port = atoi(argv[argc - 2]);
 
     // Parameter parsing
-    while ((opt = getopt(argc, argv, "hj:t:l:")) != -1)
+    while ((opt = getopt(argc, argv, "hj:t:c:l:s:S:D:r:f:J:I:R:W:uC:")) != -1)
     {
         switch (opt) {
             case 'h':
                 fprintf(stdout, USAGE_MSG);
                 return EXIT_SUCCESS;
             case 'j':
-                num_jobthreads = atoi(optarg);
+                if (pool_parse(optarg) < 0) {
+                    fprintf(stderr, USAGE_MSG);
+                    return EXIT_FAILURE;
+                }
                 break;
             case 't':
-                tick_speed = atoi(optarg);
+                if (!strcmp(optarg, "v")) virtual_clock = 1;
+                else tick_speed = atoi(optarg);
                 break;
             case 'l':
                 log_fileptr = fopen(optarg, "w+");
                 break;
+            case 'c':
+                credit_limit = atol(optarg);
+                break;
+            case 's':
+                admin_path = optarg;
+                break;
+            case 'S':
+                if (shard_parse(optarg) < 0) {
+                    fprintf(stderr, USAGE_MSG);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'D':
+                shard_dir = optarg;
+                break;
+            case 'R':
+                if (ratelimit_parse(optarg) < 0) {
+                    fprintf(stderr, "Invalid rate limits: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'W':
+                ratelimit_set_target(atol(optarg));
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'C':
+                if (capture_open(optarg) < 0) {
+                    perror("capture file");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'J':
+            case 'I':
+                if (affinity_parse((opt == 'J') ? THREAD_JOB : THREAD_IO, optarg) < 0) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                repl_path = optarg;
+                break;
+            case 'f':
+                follow_path = optarg;
+                break;
             default:
                 fprintf(stderr, USAGE_MSG);
                 return EXIT_FAILURE;
         }
     }
 
+    // A replica holds all the primary's state, shards only their part
+    if (shard_count > 1 && (repl_path || follow_path)) {
+        fprintf(stderr, "-r/-f cannot be combined with -S\n");
+        return EXIT_FAILURE;
+    }
+    if (virtual_clock && !admin_path) {
+        fprintf(stderr, "-t v needs -s SOCKET to drive the ticks\n");
+        return EXIT_FAILURE;
+    }
+
     int i;
     for (i = 0; i < THREADIDS_SIZE; i++) {
         threadids[i] = 0;
@@ -1260,11 +2628,33 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Writes to clients that already disconnected must not kill the server
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("Failed to set signal handler");
+        exit(EXIT_FAILURE);
+    }
+
+    metrics_init();
+    settle_init();
+    rcu_init();
+    shard_init(shard_dir, port);
+    repl_init();
+    if (repl_path) repl_enable(repl_snapshot);
+    pool_init();
+
     // Initialize global shared variables
     users = init(NULL, free_user);
     auctions = init(auction_cmp, free_auction);
+    proxies = init(NULL, free_user);
+    rcu_array_init(&auction_index, 64);
+    ticker_init(&ticker);
+    sem_init(&tick_done, 0, 0);
+    rcu_array_init(&user_index, 64);
+    user_ids_init();
     job_queue = (sbuf_t *)malloc(sizeof(sbuf_t));
-    sbuf_init(job_queue, num_jobthreads);
+    // Room in each lane for one queued job per job thread the pool may grow to
+    static const int lane_weights[NUM_LANES] = LANE_WEIGHTS;
+    sbuf_init_lanes(job_queue, pool_max, NUM_LANES, lane_weights);
 
     // Initialize mutual exclusion read and write locks
     sem_init(&users_wlock, 0, 1);
@@ -1272,8 +2662,21 @@ int main(int argc, char *argv[]) {
     sem_init(&users_rlock, 0, 1);
     sem_init(&auctions_rlock, 0, 1);
     sem_init(&threadids_wlock, 0, 1);
+    sem_init(&proxies_lock, 0, 1);
+    sem_init(&watchers_lock, 0, 1);
+    session_init();
     sem_init(&logfile_wlock, 0, 1);
 
+    // A replica gets its state from the primary and serves clients only
+    // once promoted
+    if (follow_path) {
+        repl_follow(follow_path, repl_apply);
+        printf("Primary gone, promoted to primary\n");
+        fflush(stdout);
+        run_server(port, pool_min, tick_speed);
+        return EXIT_SUCCESS;
+    }
+
     // Initialize auction filename into auctions list
     char *auc_filename = argv[argc - 1];
     FILE *auc_fileptr = fopen(auc_filename, "r");
@@ -1299,23 +2702,19 @@ int main(int argc, char *argv[]) {
             bin = (unsigned long)atol(line);
         }
         else {
-            auction_t *auction = (auction_t *)malloc(sizeof(auction_t));
-            auction->item_name = strdup(item_name);
-            auction->rticks = duration;
-            auction->bin = bin;
-            auction->bid = 0;
-            auction->creater = strdup("ZBid Server");
-            auction->highest_bidder = NULL;
-
-            int j;
-            for (j = 0; j < 5; j++) {
-                auction->users_watching[j] = NULL;
-            }
+            // Every shard numbers the file's auctions alike and keeps its own
+            if (shard_owner(auctionID) == shard_self) {
+                auction_t *auction = new_auction(item_name, "ZBid Server", duration, bin);
 
-            sem_wait(&auctions_wlock);
-            auction->id = auctionID++;
-            insertRear(auctions, auction);
-            sem_post(&auctions_wlock);
+                sem_wait(&auctions_wlock);
+                auction->id = auctionID;
+                insertRear(auctions, auction);
+                auction->slot = ticker_add(&ticker, auction, auction->rticks);
+                auction_publish(auction, VIEW_ALL);
+                rcu_array_append(&auction_index, auction);
+                sem_post(&auctions_wlock);
+            }
+            auctionID++;
 
             free(item_name); item_name = NULL;
         }
@@ -1323,8 +2722,9 @@ int main(int argc, char *argv[]) {
     }
     if (item_name) free(item_name);
     fclose(auc_fileptr);
+    auctionID = shard_next_id(auctionID);
 
-    run_server(port, num_jobthreads, tick_speed);
+    run_server(port, pool_min, tick_speed);
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,255 @@
+#include "session.h"
+#include "metrics.h"
+#include "netio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+// Valid tokens by hash; a session is never freed while the server runs, so
+// its pointer stays usable after it leaves the table
+static session_t *buckets[SESSION_BUCKETS];
+static sem_t table_lock;
+
+void session_init() {
+	sem_init(&table_lock, 0, 1);
+}
+
+static uint32_t token_hash(const char *token) {
+	uint32_t h = 2166136261u;
+	for (; *token; token++) h = (h ^ (uint8_t)*token) * 16777619u;
+	return h % SESSION_BUCKETS;
+}
+
+// Under table_lock
+static void table_remove(session_t *s) {
+	session_t **p = &buckets[token_hash(s->token)];
+	while (*p && *p != s) p = &(*p)->next;
+	if (*p) *p = s->next;
+	s->next = NULL;
+}
+
+static void new_token(char *token) {
+	uint8_t r[SESSION_TOKEN_LEN / 2];
+	if (getrandom(r, sizeof(r), 0) != sizeof(r)) {
+		// Unguessable tokens are what stands in for the password
+		perror("getrandom");
+		abort();
+	}
+	int i;
+	for (i = 0; i < (int)sizeof(r); i++) sprintf(token + 2 * i, "%02x", r[i]);
+}
+
+// Under s->lock
+static void drop_backlog(session_t *s) {
+	int i;
+	for (i = 0; i < s->held; i++) free(s->bodies[i]);
+	s->held = 0;
+}
+
+int session_open(user_t *user, char *token) {
+	sem_wait(&table_lock);
+	session_t *s = user->session;
+	if (!s) {
+		s = calloc(1, sizeof(session_t));
+		s->user = user;
+		s->state = SESSION_ENDED;
+		sem_init(&s->lock, 0, 1);
+		user->session = s;
+	}
+	sem_wait(&s->lock);
+	if (s->state != SESSION_ENDED) table_remove(s);
+	int held = (s->state != SESSION_ENDED && s->state != SESSION_ATTACHED);
+	drop_backlog(s);
+	s->state = SESSION_ATTACHED;
+	new_token(s->token);
+	uint32_t b = token_hash(s->token);
+	s->next = buckets[b];
+	buckets[b] = s;
+	strcpy(token, s->token);
+	sem_post(&s->lock);
+	sem_post(&table_lock);
+	return held;
+}
+
+int session_end(user_t *user) {
+	session_t *s = user->session;
+	if (!s) return 0;
+	sem_wait(&table_lock);
+	sem_wait(&s->lock);
+	if (s->state != SESSION_ENDED) table_remove(s);
+	int held = (s->state != SESSION_ENDED && s->state != SESSION_ATTACHED);
+	drop_backlog(s);
+	s->state = SESSION_ENDED;
+	sem_post(&s->lock);
+	sem_post(&table_lock);
+	return held;
+}
+
+int session_detach(user_t *user, int fd) {
+	session_t *s = user->session;
+	if (!s) return -1;
+	sem_wait(&s->lock);
+	if (s->state == SESSION_RESUMING) {
+		// Held again if the resuming connection itself went away; an older
+		// one leaves it alone
+		if (fd == s->resume_fd) {
+			s->gone_ns = metrics_now();
+			s->state = SESSION_HELD;
+		}
+		sem_post(&s->lock);
+		return 0;
+	}
+	if (user->fd != fd) {
+		sem_post(&s->lock);
+		return 0;
+	}
+	if (s->state != SESSION_ATTACHED) {
+		sem_post(&s->lock);
+		return -1;
+	}
+	user->is_online = 0;
+	s->gone_ns = metrics_now();
+	s->state = SESSION_HELD;
+	sem_post(&s->lock);
+	return 0;
+}
+
+int session_held(user_t *user) {
+	session_t *s = user->session;
+	return s && (s->state == SESSION_HELD || s->state == SESSION_LOST || s->state == SESSION_RESUMING);
+}
+
+user_t *session_resume(const char *username, const char *token, int fd) {
+	if (strlen(token) != SESSION_TOKEN_LEN) return NULL;
+	sem_wait(&table_lock);
+	session_t *s = buckets[token_hash(token)];
+	while (s && strcmp(s->token, token)) s = s->next;
+	sem_post(&table_lock);
+	if (!s) return NULL;
+
+	// Rechecked, another connection may have taken it over meanwhile
+	sem_wait(&s->lock);
+	user_t *user = s->user;
+	if ((s->state != SESSION_HELD && s->state != SESSION_ATTACHED && s->state != SESSION_RESUMING) ||
+	    strcmp(s->token, token) || strcmp(user->username, username)) {
+		sem_post(&s->lock);
+		return NULL;
+	}
+	// The old connection's fd stays open until its session_detach, which
+	// waits for the lock and then leaves the session alone
+	if (s->state == SESSION_ATTACHED) shutdown(user->fd, SHUT_RDWR);
+	else if (s->state == SESSION_RESUMING) shutdown(s->resume_fd, SHUT_RDWR);
+	user->is_online = 0;
+	s->resume_fd = fd;
+	s->state = SESSION_RESUMING;
+	sem_post(&s->lock);
+	return user;
+}
+
+int session_attach(user_t *user, int fd) {
+	session_t *s = user->session;
+	petr_header backlog[SESSION_BACKLOG];
+	char *bodies[SESSION_BACKLOG];
+	char token[SESSION_TOKEN_LEN + 1];
+	int i, n, first = 1;
+
+	sem_wait(&s->lock);
+	while (1) {
+		if (s->state != SESSION_RESUMING || s->resume_fd != fd) {
+			sem_post(&s->lock);
+			return -1;
+		}
+		if (!first && !s->held) break;
+
+		// Taken out so the sends, which may block, are made without the lock
+		strcpy(token, s->token);
+		n = s->held;
+		memcpy(backlog, s->backlog, n * sizeof(petr_header));
+		memcpy(bodies, s->bodies, n * sizeof(char *));
+		s->held = 0;
+		sem_post(&s->lock);
+
+		if (first) {
+			petr_header ph;
+			ph.msg_len = sizeof(token);
+			ph.msg_type = OK;
+			netio_send(fd, &ph, token);
+			first = 0;
+		}
+		for (i = 0; i < n; i++) {
+			netio_send(fd, &backlog[i], bodies[i]);
+			free(bodies[i]);
+		}
+		sem_wait(&s->lock);
+	}
+	user->fd = fd;
+	user->is_online = 1;
+	s->state = SESSION_ATTACHED;
+	sem_post(&s->lock);
+	return 0;
+}
+
+int session_hold(user_t *user, petr_header *ph, char *msg) {
+	session_t *s = user->session;
+	if (!s) return (user->is_online) ? -1 : 0;
+
+	int ret = 0;
+	sem_wait(&s->lock);
+	if (s->state == SESSION_ATTACHED || (s->state == SESSION_ENDED && user->is_online)) {
+		ret = -1;
+	}
+	else if ((s->state == SESSION_HELD || s->state == SESSION_RESUMING) && s->held == SESSION_BACKLOG) {
+		// Resuming now would miss messages
+		drop_backlog(s);
+		s->state = SESSION_LOST;
+	}
+	else if (s->state == SESSION_HELD || s->state == SESSION_RESUMING) {
+		s->backlog[s->held] = *ph;
+		s->bodies[s->held] = NULL;
+		if (ph->msg_len) {
+			s->bodies[s->held] = malloc(ph->msg_len);
+			memcpy(s->bodies[s->held], msg, ph->msg_len);
+		}
+		s->held++;
+	}
+	sem_post(&s->lock);
+	return ret;
+}
+
+int session_expire(uint64_t now, user_t **users, int max) {
+	int b, k = 0;
+	sem_wait(&table_lock);
+	for (b = 0; b < SESSION_BUCKETS && k < max; b++) {
+		session_t **p = &buckets[b];
+		while (*p && k < max) {
+			session_t *s = *p;
+			sem_wait(&s->lock);
+			// A client may have gone after now was taken
+			if (s->state == SESSION_LOST ||
+			    (s->state == SESSION_HELD && now > s->gone_ns &&
+			     now - s->gone_ns > SESSION_TTL_MS * 1000000ULL)) {
+				*p = s->next;
+				s->next = NULL;
+				drop_backlog(s);
+				s->state = SESSION_ENDED;
+				users[k++] = s->user;
+			}
+			else {
+				p = &s->next;
+			}
+			sem_post(&s->lock);
+		}
+	}
+	sem_post(&table_lock);
+	return k;
+}
+
+void session_free(session_t *s) {
+	if (s) {
+		drop_backlog(s);
+		sem_destroy(&s->lock);
+		free(s);
+	}
+}
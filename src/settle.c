@@ -0,0 +1,103 @@
+#include "settle.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <semaphore.h>
+
+static ledger_entry_t *ledger = NULL;
+static uint64_t ledger_len, ledger_cap;
+static int64_t ledger_volume;
+static sem_t ledger_lock;
+
+static _Atomic int64_t house_balance;
+static _Atomic int64_t transfer_balance;
+
+void settle_init() {
+	ledger_cap = 1024;
+	ledger = malloc(ledger_cap * sizeof(ledger_entry_t));
+	sem_init(&ledger_lock, 0, 1);
+}
+
+void settle_apply(settlement_t *batch, int n) {
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		settlement_t *s = &batch[i];
+		if (!s->winner) continue;
+
+		// The winning bid was held as committed funds until now
+		atomic_fetch_sub(&s->winner->committed, s->amount);
+		atomic_fetch_sub(&s->winner->balance, s->amount);
+		if (s->seller) atomic_fetch_add(&s->seller->balance, s->amount);
+		else atomic_fetch_add(&house_balance, s->amount);
+	}
+
+	sem_wait(&ledger_lock);
+	for (i = 0; i < n; i++) {
+		if (!batch[i].winner) continue;
+		if (ledger_len == ledger_cap) {
+			ledger_cap *= 2;
+			ledger = realloc(ledger, ledger_cap * sizeof(ledger_entry_t));
+		}
+		ledger[ledger_len].seq = ledger_len + 1;
+		ledger[ledger_len].when = now;
+		ledger[ledger_len].s = batch[i];
+		ledger_volume += batch[i].amount;
+		ledger_len++;
+	}
+	sem_post(&ledger_lock);
+}
+
+int64_t settle_house_balance() {
+	return atomic_load(&house_balance);
+}
+
+void settle_restore_house(int64_t balance) {
+	atomic_store(&house_balance, balance);
+}
+
+void settle_transfer(user_t *u, int64_t amount) {
+	if (u) atomic_fetch_add(&u->balance, amount);
+	else atomic_fetch_add(&house_balance, amount);
+	atomic_fetch_add(&transfer_balance, amount);
+}
+
+int64_t settle_transfers() {
+	return atomic_load(&transfer_balance);
+}
+
+int settle_reserve(user_t *u, int64_t amount, int64_t limit) {
+	if (limit < 0) {
+		atomic_fetch_add(&u->committed, amount);
+		return 0;
+	}
+
+	int64_t committed = atomic_load(&u->committed);
+	do {
+		if (committed + amount > atomic_load(&u->balance) + limit) return -1;
+	} while (!atomic_compare_exchange_weak(&u->committed, &committed, committed + amount));
+	return 0;
+}
+
+void settle_release(user_t *u, int64_t amount) {
+	atomic_fetch_sub(&u->committed, amount);
+}
+
+void ledger_dump(FILE *fp, int n) {
+	sem_wait(&ledger_lock);
+	fprintf(fp, "settlements %lu\n", (unsigned long)ledger_len);
+	fprintf(fp, "volume %ld\n", (long)ledger_volume);
+	fprintf(fp, "house_balance %ld\n", (long)settle_house_balance());
+
+	uint64_t i;
+	for (i = ledger_len; i > 0 && n > 0; i--, n--) {
+		ledger_entry_t *e = &ledger[i - 1];
+		char when[32];
+		struct tm tm;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&e->when, &tm));
+		fprintf(fp, "%lu %s auction=%u winner=%s seller=%s amount=%ld\n", (unsigned long)e->seq, when,
+		        e->s.auction_id, e->s.winner->username, e->s.seller ? e->s.seller->username : "(house)",
+		        (long)e->s.amount);
+	}
+	sem_post(&ledger_lock);
+}
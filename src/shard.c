@@ -0,0 +1,280 @@
+#include "shard.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Connect attempts to a peer that is not up yet, 100ms apart
+#define SHARD_CONNECT_TRIES 50
+
+int shard_self = 0, shard_count = 1;
+
+static char *shard_dir = "/tmp";
+static int shard_port;
+
+// This thread's connection to each peer, stored as fd + 1 so 0 is "none"
+static __thread int conns[SHARD_MAX];
+
+int shard_parse(char *spec) {
+	int k, n;
+	char end;
+	if (sscanf(spec, "%d/%d%c", &k, &n, &end) != 2) return -1;
+	if (n < 1 || n > SHARD_MAX || k < 0 || k >= n) return -1;
+	shard_self = k;
+	shard_count = n;
+	return 0;
+}
+
+void shard_init(char *dir, int port) {
+	if (dir) shard_dir = dir;
+	shard_port = port;
+}
+
+int shard_owner(unsigned int id) {
+	return (id - 1) % shard_count;
+}
+
+int shard_home(const char *username) {
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (; *username; username++) {
+		h ^= (unsigned char)*username;
+		h *= 16777619u;
+	}
+	return h % shard_count;
+}
+
+unsigned int shard_next_id(unsigned int id) {
+	while (shard_owner(id) != shard_self) id++;
+	return id;
+}
+
+static void shard_addr(int shard, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/zbid_%d_shard%d.sock", shard_dir, shard_port, shard);
+}
+
+int shard_listen() {
+	struct sockaddr_un addr;
+	shard_addr(shard_self, &addr);
+	unlink(addr.sun_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		perror(addr.sun_path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void shard_unlink() {
+	struct sockaddr_un addr;
+	shard_addr(shard_self, &addr);
+	unlink(addr.sun_path);
+}
+
+static int shard_conn(int shard) {
+	if (conns[shard]) return conns[shard] - 1;
+
+	struct sockaddr_un addr;
+	shard_addr(shard, &addr);
+	int tries;
+	for (tries = 0; tries < SHARD_CONNECT_TRIES; tries++) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) return -1;
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			conns[shard] = fd + 1;
+			return fd;
+		}
+		close(fd);
+		usleep(100000);
+	}
+	fprintf(stderr, "shard %d unreachable at %s\n", shard, addr.sun_path);
+	return -1;
+}
+
+static void shard_drop(int shard) {
+	if (conns[shard]) close(conns[shard] - 1);
+	conns[shard] = 0;
+}
+
+int shard_write(int conn, int type, const char *body, size_t len, int fd) {
+	petr_header ph;
+	memset(&ph, 0, sizeof(ph));
+	ph.msg_len = len;
+	ph.msg_type = type;
+
+	struct iovec iov[2] = { { &ph, sizeof(ph) }, { (void *)body, len } };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = (len) ? 2 : 1;
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+	if (fd >= 0) {
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = sizeof(ctrl.buf);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &fd, sizeof(int));
+	}
+
+	// The descriptor goes with the first byte; a short write continues
+	// with plain writes
+	size_t total = sizeof(ph) + len, sent = 0;
+	while (sent < total) {
+		ssize_t n = sendmsg(conn, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		sent += n;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		while (n > 0 && msg.msg_iovlen) {
+			if ((size_t)n >= msg.msg_iov->iov_len) {
+				n -= msg.msg_iov->iov_len;
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			}
+			else {
+				msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+				msg.msg_iov->iov_len -= n;
+				n = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+int shard_read(int conn, petr_header *ph, char **body, int *fd) {
+	struct iovec iov = { ph, sizeof(*ph) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	*fd = -1;
+	*body = NULL;
+	ssize_t n = recvmsg(conn, &msg, MSG_WAITALL);
+	if (n <= 0) return -1;
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) memcpy(fd, CMSG_DATA(c), sizeof(int));
+	if (n < (ssize_t)sizeof(*ph) && recv(conn, (char *)ph + n, sizeof(*ph) - n, MSG_WAITALL) != (ssize_t)sizeof(*ph) - n) {
+		goto fail;
+	}
+
+	*body = malloc(ph->msg_len + 1);
+	if (ph->msg_len && recv(conn, *body, ph->msg_len, MSG_WAITALL) != (ssize_t)ph->msg_len) goto fail;
+	(*body)[ph->msg_len] = '\0';
+	return 0;
+
+fail:
+	if (*fd >= 0) close(*fd);
+	*fd = -1;
+	free(*body);
+	*body = NULL;
+	return -1;
+}
+
+static int shard_send(int shard, int type, wbuf_t *b, int fd) {
+	int conn = shard_conn(shard);
+	if (conn < 0) return -1;
+	if (shard_write(conn, type, b->data, b->len, fd) < 0) {
+		shard_drop(shard);
+		return -1;
+	}
+	return 0;
+}
+
+int shard_handoff(int shard, int msg_type, int client_fd, const char *login, size_t len) {
+	wbuf_t b = { (char *)login, len, len };
+	return shard_send(shard, (msg_type == RESUME) ? SH_RESUME : SH_HANDOFF, &b, client_fd);
+}
+
+int shard_deliver(int shard, const char *username, petr_header *ph, const char *body) {
+	wbuf_t b;
+	wbuf_init(&b, 32 + ph->msg_len);
+	wbuf_put_str(&b, username);
+	wbuf_put_u8(&b, ph->msg_type);
+	if (ph->msg_len) wbuf_put_bytes(&b, body, ph->msg_len);
+	int ret = shard_send(shard, SH_DELIVER, &b, -1);
+	wbuf_free(&b);
+	return ret;
+}
+
+int shard_settle(int shard, const char *username, int64_t amount) {
+	wbuf_t b;
+	wbuf_init(&b, 48);
+	wbuf_put_str(&b, username);
+	wbuf_put_u64(&b, (uint64_t)amount);
+	int ret = shard_send(shard, SH_SETTLE, &b, -1);
+	wbuf_free(&b);
+	return ret;
+}
+
+int shard_call(int shard, int proto, const char *username, int type, list_t *args,
+               petr_header *reply, char **body) {
+	wbuf_t b;
+	wbuf_init(&b, 128);
+	wbuf_put_u8(&b, proto);
+	wbuf_put_str(&b, username);
+	wbuf_put_u8(&b, type);
+	char *req = strjoin(args, "\r\n");
+	if (req) {
+		wbuf_put_bytes(&b, req, strlen(req) + 1);
+		free(req);
+	}
+	int ret = shard_send(shard, SH_REQUEST, &b, -1);
+	wbuf_free(&b);
+	if (ret < 0) return -1;
+
+	petr_header ph;
+	char *resp;
+	int fd;
+	if (shard_read(shard_conn(shard), &ph, &resp, &fd) < 0 || ph.msg_type != SH_RESPONSE || ph.msg_len < 1) {
+		if (fd >= 0) close(fd);
+		free(resp);
+		shard_drop(shard);
+		return -1;
+	}
+
+	// Strip the type byte in place
+	reply->msg_type = (uint8_t)resp[0];
+	reply->msg_len = ph.msg_len - 1;
+	memmove(resp, resp + 1, ph.msg_len);
+	*body = resp;
+	return 0;
+}
+
+uint32_t shard_gather(int proto, const char *username, int type, wbuf_t *rows, int version) {
+	uint32_t count = 0;
+	int k;
+	for (k = 0; k < shard_count; k++) {
+		if (k == shard_self) continue;
+
+		petr_header ph;
+		char *body;
+		if (shard_call(k, proto, username, type, NULL, &ph, &body) < 0) continue;
+		if (ph.msg_type == type) count += wire_rows_merge(rows, version, body, ph.msg_len);
+		free(body);
+	}
+	return count;
+}
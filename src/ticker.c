@@ -0,0 +1,170 @@
+#include "ticker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TICKER_X86 1
+#endif
+
+typedef int (*tick_fn)(uint32_t *rticks, int n, uint32_t base, uint32_t *out);
+
+// Counts rticks[0, n) down, n a multiple of TICKER_LANES, and writes the
+// slots (base + index) that reached 0 to out
+static int tick_scalar(uint32_t *rticks, int n, uint32_t base, uint32_t *out) {
+	int i, k = 0;
+	for (i = 0; i < n; i++) {
+		if (rticks[i] == 0) continue;
+		if (--rticks[i] == 0) out[k++] = base + i;
+	}
+	return k;
+}
+
+#ifdef TICKER_X86
+static int tick_sse2(uint32_t *rticks, int n, uint32_t base, uint32_t *out) {
+	const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1);
+	int i, k = 0;
+	for (i = 0; i < n; i += 4) {
+		__m128i *p = (__m128i *)(rticks + i);
+		__m128i v = _mm_load_si128(p);
+		__m128i closed = _mm_cmpeq_epi32(v, zero);
+		if (_mm_movemask_epi8(closed) == 0xffff) continue;
+
+		// Adding all ones (-1) to the open lanes only
+		int last = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, one)));
+		_mm_store_si128(p, _mm_add_epi32(v, _mm_andnot_si128(closed, _mm_cmpeq_epi32(v, v))));
+		while (last) {
+			out[k++] = base + i + __builtin_ctz(last);
+			last &= last - 1;
+		}
+	}
+	return k;
+}
+
+__attribute__((target("avx2")))
+static int tick_avx2(uint32_t *rticks, int n, uint32_t base, uint32_t *out) {
+	const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1);
+	int i, k = 0;
+	for (i = 0; i < n; i += 8) {
+		__m256i *p = (__m256i *)(rticks + i);
+		__m256i v = _mm256_load_si256(p);
+		__m256i closed = _mm256_cmpeq_epi32(v, zero);
+		if (_mm256_movemask_epi8(closed) == -1) continue;
+
+		int last = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, one)));
+		_mm256_store_si256(p, _mm256_add_epi32(v, _mm256_andnot_si256(closed, _mm256_cmpeq_epi32(v, v))));
+		while (last) {
+			out[k++] = base + i + __builtin_ctz(last);
+			last &= last - 1;
+		}
+	}
+	return k;
+}
+#endif
+
+static tick_fn tick_impl;
+static const char *tick_name;
+
+int ticker_use(const char *impl) {
+	if (!strcmp(impl, "scalar")) tick_impl = tick_scalar;
+#ifdef TICKER_X86
+	else if (!strcmp(impl, "sse2")) tick_impl = tick_sse2;
+	else if (!strcmp(impl, "avx2") && __builtin_cpu_supports("avx2")) tick_impl = tick_avx2;
+#endif
+	else return -1;
+	tick_name = impl;
+	return 0;
+}
+
+const char *ticker_impl() {
+	if (!tick_impl && ticker_use("avx2") < 0 && ticker_use("sse2") < 0) ticker_use("scalar");
+	return tick_name;
+}
+
+void ticker_init(ticker_t *t) {
+	memset(t, 0, sizeof(ticker_t));
+	ticker_impl();
+}
+
+void ticker_free(ticker_t *t) {
+	int c;
+	for (c = 0; c < TICKER_MAX_CHUNKS && t->rticks[c]; c++) {
+		free(t->rticks[c]);
+		free(t->owners[c]);
+		sem_destroy(&t->locks[c]);
+	}
+	memset(t, 0, sizeof(ticker_t));
+}
+
+int ticker_add(ticker_t *t, void *owner, uint32_t rticks) {
+	int slot = atomic_load(&t->n), c = slot / TICKER_CHUNK, i = slot % TICKER_CHUNK;
+	if (c == TICKER_MAX_CHUNKS) {
+		fprintf(stderr, "ticker: more than %d auctions\n", TICKER_MAX_CHUNKS * TICKER_CHUNK);
+		abort();
+	}
+	if (!t->rticks[c]) {
+		// Zeroed: the unused slots of the last chunk tick as closed. Ready
+		// before n covers it, which is when a tick starts looking at it.
+		t->rticks[c] = aligned_alloc(64, TICKER_CHUNK * sizeof(uint32_t));
+		memset(t->rticks[c], 0, TICKER_CHUNK * sizeof(uint32_t));
+		t->owners[c] = calloc(TICKER_CHUNK, sizeof(void *));
+		sem_init(&t->locks[c], 0, 1);
+	}
+	sem_wait(&t->locks[c]);
+	t->owners[c][i] = owner;
+	__atomic_store_n(&t->rticks[c][i], rticks, __ATOMIC_RELAXED);
+	if (rticks) t->open[c]++;
+	atomic_store(&t->n, slot + 1);
+	sem_post(&t->locks[c]);
+	return slot;
+}
+
+uint32_t ticker_rticks(ticker_t *t, int slot) {
+	return __atomic_load_n(&t->rticks[slot / TICKER_CHUNK][slot % TICKER_CHUNK], __ATOMIC_RELAXED);
+}
+
+void ticker_set(ticker_t *t, int slot, uint32_t rticks) {
+	int c = slot / TICKER_CHUNK;
+	uint32_t *p = &t->rticks[c][slot % TICKER_CHUNK];
+	sem_wait(&t->locks[c]);
+	t->open[c] += (rticks != 0) - (*p != 0);
+	__atomic_store_n(p, rticks, __ATOMIC_RELAXED);
+	sem_post(&t->locks[c]);
+}
+
+void *ticker_owner(ticker_t *t, int slot) {
+	return t->owners[slot / TICKER_CHUNK][slot % TICKER_CHUNK];
+}
+
+int ticker_parts(ticker_t *t, int max) {
+	int chunks = (atomic_load(&t->n) + TICKER_CHUNK - 1) / TICKER_CHUNK;
+	if (chunks > max) chunks = max;
+	return (chunks > 1) ? chunks : 1;
+}
+
+int ticker_tick(ticker_t *t, int part, int parts, uint32_t **slots, int *cap, void (*ticked)(int chunk)) {
+	int c, k = 0, chunks = (atomic_load(&t->n) + TICKER_CHUNK - 1) / TICKER_CHUNK;
+	for (c = part; c < chunks; c += parts) {
+		sem_wait(&t->locks[c]);
+		if (!t->open[c]) {
+			sem_post(&t->locks[c]);
+			continue;
+		}
+		if (k + t->open[c] > *cap) {
+			while (k + t->open[c] > *cap) *cap = *cap ? *cap * 2 : 1024;
+			*slots = realloc(*slots, *cap * sizeof(uint32_t));
+		}
+		// Only up to the last slot handed out, rounded up to whole vectors
+		int used = atomic_load(&t->n) - c * TICKER_CHUNK;
+		if (used > TICKER_CHUNK) used = TICKER_CHUNK;
+		used = (used + TICKER_LANES - 1) / TICKER_LANES * TICKER_LANES;
+
+		int closed = tick_impl(t->rticks[c], used, c * TICKER_CHUNK, *slots + k);
+		t->open[c] -= closed;
+		k += closed;
+		if (ticked) ticked(c);
+		sem_post(&t->locks[c]);
+	}
+	return k;
+}
@@ -0,0 +1,36 @@
+#include "topbid.h"
+#include "protocol.h"
+
+uint64_t topbid_pack(unsigned long bid, uint32_t uid) {
+	// Masked so that neither can reach the closed bit
+	return ((uint64_t)(uid & TOPBID_MAX_UID) << TOPBID_BID_BITS) | (bid & TOPBID_MAX_BID);
+}
+
+unsigned long topbid_bid(uint64_t t) {
+	return t & TOPBID_MAX_BID;
+}
+
+uint32_t topbid_uid(uint64_t t) {
+	return (t >> TOPBID_BID_BITS) & TOPBID_MAX_UID;
+}
+
+int topbid_closed(uint64_t t) {
+	return (t & TOPBID_CLOSED) != 0;
+}
+
+int topbid_check(uint64_t t, unsigned long bid) {
+	if (topbid_closed(t)) return EANNOTFOUND;
+	if (bid <= topbid_bid(t) || bid > TOPBID_MAX_BID) return EBIDLOW;
+	return 0;
+}
+
+int topbid_cas(topbid_t *top, uint64_t *cur, uint32_t uid, unsigned long bid, unsigned long bin) {
+	int closing = (bin != 0 && bid >= bin);
+	uint64_t next = topbid_pack(bid, uid) | (closing ? TOPBID_CLOSED : 0);
+	if (!atomic_compare_exchange_strong(top, cur, next)) return -1;
+	return closing ? ANCLOSED : OK;
+}
+
+int topbid_close(topbid_t *top) {
+	return !topbid_closed(atomic_fetch_or(top, TOPBID_CLOSED));
+}
@@ -0,0 +1,117 @@
+#include "trace.h"
+#include "metrics.h"
+#include "helpers.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	// 0 while being written, else 1 + the ring position it was written for
+	atomic_ulong seq;
+	trace_t trace;
+} trace_entry_t;
+
+static atomic_int enabled;
+static _Atomic uint64_t threshold_ns = 1000000;
+
+static trace_entry_t ring[TRACE_RING_SIZE];
+static atomic_ulong ring_next;
+
+static __thread trace_t *current = NULL;
+
+static const char *stage_names[T_NUM_STAGES] = {
+	"read", "enqueue", "queue", "lock", "process", "broadcast", "reply"
+};
+
+void trace_enable(int on) {
+	atomic_store(&enabled, on);
+}
+
+int trace_enabled() {
+	return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+void trace_set_threshold(uint64_t ns) {
+	atomic_store(&threshold_ns, ns);
+}
+
+uint64_t trace_threshold() {
+	return atomic_load(&threshold_ns);
+}
+
+trace_t *trace_start(int type, char *username) {
+	if (!trace_enabled()) return NULL;
+
+	trace_t *t = calloc(1, sizeof(trace_t));
+	t->type = type;
+	strncpy(t->username, username, TRACE_NAME_LEN - 1);
+	t->start_ns = t->last_ns = metrics_now();
+	return t;
+}
+
+void trace_set(trace_t *t) {
+	current = t;
+}
+
+trace_t *trace_get() {
+	return current;
+}
+
+void trace_mark(int stage) {
+	trace_t *t = current;
+	if (!t) return;
+
+	uint64_t now = metrics_now();
+	t->stage_ns[stage] += now - t->last_ns;
+	t->last_ns = now;
+}
+
+void trace_finish() {
+	trace_t *t = current;
+	if (!t) return;
+	current = NULL;
+
+	t->total_ns = t->last_ns - t->start_ns;
+
+	int s;
+	for (s = 0; s < T_NUM_STAGES; s++) metrics_record(H_TRACE_FIRST + s, t->stage_ns[s]);
+	metrics_record(H_TRACE_TOTAL, t->total_ns);
+
+	if (t->total_ns >= trace_threshold()) {
+		unsigned long pos = atomic_fetch_add(&ring_next, 1);
+		trace_entry_t *e = &ring[pos % TRACE_RING_SIZE];
+		atomic_store(&e->seq, 0);
+		e->trace = *t;
+		atomic_store(&e->seq, pos + 1);
+	}
+	free(t);
+}
+
+void trace_discard() {
+	free(current);
+	current = NULL;
+}
+
+void trace_dump(FILE *fp) {
+	unsigned long next = atomic_load(&ring_next);
+	unsigned long n = (next < TRACE_RING_SIZE) ? next : TRACE_RING_SIZE;
+	unsigned long i;
+	int s;
+
+	fprintf(fp, "trace %s, slow threshold %luus, %lu slow requests recorded\n",
+	        trace_enabled() ? "on" : "off", (unsigned long)(trace_threshold() / 1000), next);
+	for (i = 1; i <= n; i++) {
+		unsigned long pos = next - i;
+		trace_entry_t *e = &ring[pos % TRACE_RING_SIZE];
+		if (atomic_load(&e->seq) != pos + 1) continue;
+		trace_t t = e->trace;
+		// Skip entries overwritten while copying
+		if (atomic_load(&e->seq) != pos + 1) continue;
+
+		fprintf(fp, "%s %s total=%.1fus", msg_name(t.type), t.username, t.total_ns / 1000.0);
+		for (s = 0; s < T_NUM_STAGES; s++) {
+			if (t.stage_ns[s]) fprintf(fp, " %s=%.1fus", stage_names[s], t.stage_ns[s] / 1000.0);
+		}
+		fprintf(fp, "\n");
+	}
+}
@@ -0,0 +1,126 @@
+#include "uring.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+int uring_init(uring_t *r, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	// One mapping holds both rings
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+	r->cq_ring_size = r->sq_ring_size;
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+	                  IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) goto fail;
+	r->cq_ring = r->sq_ring;
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto fail;
+
+	char *sq = r->sq_ring, *cq = r->cq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->sqe_tail = *r->sq_tail;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+fail:
+	close(r->fd);
+	return -1;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *r) {
+	unsigned head = atomic_load_explicit((_Atomic unsigned *)r->sq_head, memory_order_acquire);
+	if (r->sqe_tail - head >= r->sq_entries) return NULL;
+
+	unsigned idx = r->sqe_tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sqe_tail++;
+	return sqe;
+}
+
+int uring_submit(uring_t *r, unsigned wait_nr) {
+	unsigned tail = *r->sq_tail;
+	unsigned n = r->sqe_tail - tail;
+	atomic_store_explicit((_Atomic unsigned *)r->sq_tail, r->sqe_tail, memory_order_release);
+
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, n, wait_nr, (wait_nr) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR && !wait_nr);
+	return ret;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *r) {
+	unsigned head = *r->cq_head;
+	if (head == atomic_load_explicit((_Atomic unsigned *)r->cq_tail, memory_order_acquire)) return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *r) {
+	atomic_store_explicit((_Atomic unsigned *)r->cq_head, *r->cq_head + 1, memory_order_release);
+}
+
+int uring_bufs_init(uring_t *r, uring_bufs_t *b, int bgid, unsigned nbufs, unsigned size) {
+	// nbufs must be a power of 2
+	size_t ring_size = nbufs * sizeof(struct io_uring_buf);
+	b->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->ring == MAP_FAILED) return -1;
+	b->bufs = malloc((size_t)nbufs * size);
+	b->nbufs = nbufs;
+	b->size = size;
+	b->tail = 0;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(b->ring, ring_size);
+		free(b->bufs);
+		return -1;
+	}
+
+	unsigned i;
+	for (i = 0; i < nbufs; i++) uring_buf_put(b, i);
+	return 0;
+}
+
+char *uring_buf(uring_bufs_t *b, unsigned bid) {
+	return b->bufs + (size_t)bid * b->size;
+}
+
+void uring_buf_put(uring_bufs_t *b, unsigned bid) {
+	struct io_uring_buf *buf = &b->ring->bufs[b->tail & (b->nbufs - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring_buf(b, bid);
+	buf->len = b->size;
+	buf->bid = bid;
+	b->tail++;
+	// The tail shares its slot with bufs[0].resv
+	atomic_store_explicit((_Atomic uint16_t *)&b->ring->tail, b->tail, memory_order_release);
+}
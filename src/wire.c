@@ -0,0 +1,438 @@
+#include "wire.h"
+#include "protocol.h"
+#include <string.h>
+
+void wbuf_init(wbuf_t *b, size_t cap) {
+	b->data = malloc(cap ? cap : 1);
+	b->len = 0;
+	b->cap = cap ? cap : 1;
+}
+
+void wbuf_free(wbuf_t *b) {
+	if (b) {
+		free(b->data); b->data = NULL;
+		b->len = b->cap = 0;
+	}
+}
+
+void wbuf_reset(wbuf_t *b) {
+	b->len = 0;
+}
+
+/* Make room for n more bytes and return a pointer to them */
+static char* wbuf_reserve(wbuf_t *b, size_t n) {
+	if (b->len + n > b->cap) {
+		while (b->len + n > b->cap) b->cap *= 2;
+		b->data = realloc(b->data, b->cap);
+	}
+	char *p = b->data + b->len;
+	b->len += n;
+	return p;
+}
+
+void wbuf_put_u8(wbuf_t *b, uint8_t v) {
+	*wbuf_reserve(b, 1) = v;
+}
+
+void wbuf_put_u16(wbuf_t *b, uint16_t v) {
+	unsigned char *p = (unsigned char *)wbuf_reserve(b, 2);
+	p[0] = v; p[1] = v >> 8;
+}
+
+void wbuf_put_u32(wbuf_t *b, uint32_t v) {
+	unsigned char *p = (unsigned char *)wbuf_reserve(b, 4);
+	int i;
+	for (i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+void wbuf_put_u64(wbuf_t *b, uint64_t v) {
+	unsigned char *p = (unsigned char *)wbuf_reserve(b, 8);
+	int i;
+	for (i = 0; i < 8; i++) p[i] = v >> (8 * i);
+}
+
+void wbuf_put_bytes(wbuf_t *b, const char *s, size_t n) {
+	memcpy(wbuf_reserve(b, n), s, n);
+}
+
+void wbuf_put_str(wbuf_t *b, const char *s) {
+	size_t n = s ? strlen(s) : 0;
+	if (n > UINT16_MAX) n = UINT16_MAX;
+	wbuf_put_u16(b, n);
+	wbuf_put_bytes(b, s, n);
+}
+
+void wbuf_put_dec(wbuf_t *b, unsigned long v) {
+	char tmp[24];
+	int i = sizeof(tmp);
+	do {
+		tmp[--i] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	wbuf_put_bytes(b, tmp + i, sizeof(tmp) - i);
+}
+
+void rbuf_init(rbuf_t *r, const char *data, size_t len) {
+	r->data = data;
+	r->len = len;
+	r->pos = 0;
+}
+
+int rbuf_get_u8(rbuf_t *r, uint8_t *v) {
+	if (r->pos + 1 > r->len) return -1;
+	*v = (unsigned char)r->data[r->pos++];
+	return 0;
+}
+
+int rbuf_get_u16(rbuf_t *r, uint16_t *v) {
+	if (r->pos + 2 > r->len) return -1;
+	const unsigned char *p = (const unsigned char *)r->data + r->pos;
+	*v = p[0] | (p[1] << 8);
+	r->pos += 2;
+	return 0;
+}
+
+int rbuf_get_u32(rbuf_t *r, uint32_t *v) {
+	if (r->pos + 4 > r->len) return -1;
+	const unsigned char *p = (const unsigned char *)r->data + r->pos;
+	int i;
+	*v = 0;
+	for (i = 0; i < 4; i++) *v |= (uint32_t)p[i] << (8 * i);
+	r->pos += 4;
+	return 0;
+}
+
+int rbuf_get_u64(rbuf_t *r, uint64_t *v) {
+	if (r->pos + 8 > r->len) return -1;
+	const unsigned char *p = (const unsigned char *)r->data + r->pos;
+	int i;
+	*v = 0;
+	for (i = 0; i < 8; i++) *v |= (uint64_t)p[i] << (8 * i);
+	r->pos += 8;
+	return 0;
+}
+
+int rbuf_get_str(rbuf_t *r, wstr_t *s) {
+	if (rbuf_get_u16(r, &s->len) < 0 || r->pos + s->len > r->len) return -1;
+	s->ptr = r->data + r->pos;
+	r->pos += s->len;
+	return 0;
+}
+
+/*
+ * Text (v1) field reader: everything up to delim, a null byte or the end of
+ * the body. The delimiter is consumed. Returns -1 if nothing is left.
+ */
+static int text_field(rbuf_t *r, const char *delim, wstr_t *s) {
+	if (r->pos >= r->len || r->data[r->pos] == '\0') return -1;
+	size_t dlen = strlen(delim);
+	size_t i = r->pos;
+	int found = 0;
+	while (i < r->len && r->data[i] != '\0') {
+		if (r->data[i] == delim[0] && i + dlen <= r->len && !memcmp(r->data + i, delim, dlen)) {
+			found = 1;
+			break;
+		}
+		i++;
+	}
+	s->ptr = r->data + r->pos;
+	s->len = i - r->pos;
+	r->pos = found ? i + dlen : i;
+	return 0;
+}
+
+/* Like text_field, but an empty/missing trailing field is not an error */
+static void text_field_opt(rbuf_t *r, const char *delim, wstr_t *s) {
+	if (text_field(r, delim, s) < 0) {
+		s->ptr = r->data + r->pos;
+		s->len = 0;
+	}
+}
+
+static uint64_t text_num(wstr_t *s) {
+	uint64_t v = 0;
+	int i;
+	for (i = 0; i < s->len && s->ptr[i] >= '0' && s->ptr[i] <= '9'; i++) {
+		v = v * 10 + (s->ptr[i] - '0');
+	}
+	return v;
+}
+
+void wire_rows_begin(wbuf_t *b, int version) {
+	if (version == PETR_V2) wbuf_put_u32(b, 0);
+}
+
+void wire_rows_end(wbuf_t *b, int version, uint32_t count) {
+	if (version == PETR_V2) {
+		size_t len = b->len;
+		b->len = 0;
+		wbuf_put_u32(b, count);
+		b->len = len;
+	}
+	else if (b->len) {
+		wbuf_put_u8(b, '\0');
+	}
+}
+
+uint32_t wire_rows_merge(wbuf_t *b, int version, const char *body, size_t len) {
+	if (version == PETR_V2) {
+		rbuf_t r;
+		uint32_t count;
+		rbuf_init(&r, body, len);
+		if (rbuf_get_u32(&r, &count) < 0) return 0;
+		wbuf_put_bytes(b, body + r.pos, len - r.pos);
+		return count;
+	}
+	// Drop the terminator, rows_end adds one back
+	if (len && body[len - 1] == '\0') len--;
+	wbuf_put_bytes(b, body, len);
+	return 0;
+}
+
+void wire_anlist_row(wbuf_t *b, int version, auction_t *a, unsigned int rticks) {
+	int i, count = 0;
+	for (i = 0; i < 5; i++) {
+		if (a->users_watching[i]) count++;
+	}
+
+	if (version == PETR_V2) {
+		wbuf_put_u32(b, a->id);
+		wbuf_put_str(b, a->item_name);
+		wbuf_put_u64(b, a->bin);
+		wbuf_put_u32(b, count);
+		wbuf_put_u64(b, a->bid);
+		wbuf_put_u32(b, rticks);
+		return;
+	}
+	wbuf_put_dec(b, a->id);
+	wbuf_put_u8(b, ';');
+	wbuf_put_bytes(b, a->item_name, strlen(a->item_name));
+	wbuf_put_u8(b, ';');
+	wbuf_put_dec(b, a->bin);
+	wbuf_put_u8(b, ';');
+	wbuf_put_dec(b, count);
+	wbuf_put_u8(b, ';');
+	wbuf_put_dec(b, a->bid);
+	wbuf_put_u8(b, ';');
+	wbuf_put_dec(b, rticks);
+	wbuf_put_u8(b, '\n');
+}
+
+void wire_usrwins_row(wbuf_t *b, int version, auction_t *a) {
+	if (version == PETR_V2) {
+		wbuf_put_u32(b, a->id);
+		wbuf_put_str(b, a->item_name);
+		wbuf_put_u64(b, a->bid);
+		return;
+	}
+	wbuf_put_dec(b, a->id);
+	wbuf_put_u8(b, ';');
+	wbuf_put_bytes(b, a->item_name, strlen(a->item_name));
+	wbuf_put_u8(b, ';');
+	wbuf_put_dec(b, a->bid);
+	wbuf_put_u8(b, '\n');
+}
+
+void wire_usrsales_row(wbuf_t *b, int version, auction_t *a) {
+	if (version == PETR_V2) {
+		wbuf_put_u32(b, a->id);
+		wbuf_put_str(b, a->item_name);
+		wbuf_put_str(b, a->highest_bidder);
+		wbuf_put_u64(b, a->highest_bidder ? a->bid : 0);
+		return;
+	}
+	wbuf_put_dec(b, a->id);
+	wbuf_put_u8(b, ';');
+	wbuf_put_bytes(b, a->item_name, strlen(a->item_name));
+	wbuf_put_u8(b, ';');
+	if (a->highest_bidder) {
+		wbuf_put_bytes(b, a->highest_bidder, strlen(a->highest_bidder));
+		wbuf_put_u8(b, ';');
+		wbuf_put_dec(b, a->bid);
+	}
+	else {
+		wbuf_put_bytes(b, "None;None", 9);
+	}
+	wbuf_put_u8(b, '\n');
+}
+
+void wire_anupdate(wbuf_t *b, int version, unsigned int id, const char *item_name, const char *bidder, unsigned long bid) {
+	if (version == PETR_V2) {
+		wbuf_put_u32(b, id);
+		wbuf_put_str(b, item_name);
+		wbuf_put_str(b, bidder);
+		wbuf_put_u64(b, bid);
+		return;
+	}
+	wbuf_put_dec(b, id);
+	wbuf_put_bytes(b, "\r\n", 2);
+	wbuf_put_bytes(b, item_name, strlen(item_name));
+	wbuf_put_bytes(b, "\r\n", 2);
+	wbuf_put_bytes(b, bidder, strlen(bidder));
+	wbuf_put_bytes(b, "\r\n", 2);
+	wbuf_put_dec(b, bid);
+	wbuf_put_u8(b, '\0');
+}
+
+void wire_anclosed(wbuf_t *b, int version, unsigned int id, const char *winner, unsigned long bid) {
+	if (version == PETR_V2) {
+		wbuf_put_u32(b, id);
+		wbuf_put_str(b, winner);
+		wbuf_put_u64(b, winner ? bid : 0);
+		return;
+	}
+	wbuf_put_dec(b, id);
+	wbuf_put_bytes(b, "\r\n", 2);
+	if (winner) {
+		wbuf_put_bytes(b, winner, strlen(winner));
+		wbuf_put_bytes(b, "\r\n", 2);
+		wbuf_put_dec(b, bid);
+	}
+	else {
+		wbuf_put_bytes(b, "\r\n", 2);
+	}
+	wbuf_put_u8(b, '\0');
+}
+
+int wire_rows_start(rbuf_t *r, int version, uint32_t *count) {
+	*count = 0;
+	if (version == PETR_V2) return rbuf_get_u32(r, count);
+	return 0;
+}
+
+int wire_anlist_next(rbuf_t *r, int version, anlist_row_t *row) {
+	if (version == PETR_V2) {
+		if (rbuf_get_u32(r, &row->id) < 0) return -1;
+		if (rbuf_get_str(r, &row->item_name) < 0) return -1;
+		if (rbuf_get_u64(r, &row->bin) < 0) return -1;
+		if (rbuf_get_u32(r, &row->watchers) < 0) return -1;
+		if (rbuf_get_u64(r, &row->bid) < 0) return -1;
+		return rbuf_get_u32(r, &row->rticks);
+	}
+	wstr_t f;
+	if (text_field(r, ";", &f) < 0) return -1;
+	row->id = text_num(&f);
+	if (text_field(r, ";", &row->item_name) < 0) return -1;
+	if (text_field(r, ";", &f) < 0) return -1;
+	row->bin = text_num(&f);
+	if (text_field(r, ";", &f) < 0) return -1;
+	row->watchers = text_num(&f);
+	if (text_field(r, ";", &f) < 0) return -1;
+	row->bid = text_num(&f);
+	if (text_field(r, "\n", &f) < 0) return -1;
+	row->rticks = text_num(&f);
+	return 0;
+}
+
+int wire_usrwins_next(rbuf_t *r, int version, usrhist_row_t *row) {
+	row->winner.ptr = NULL;
+	row->winner.len = 0;
+	if (version == PETR_V2) {
+		if (rbuf_get_u32(r, &row->id) < 0) return -1;
+		if (rbuf_get_str(r, &row->item_name) < 0) return -1;
+		return rbuf_get_u64(r, &row->bid);
+	}
+	wstr_t f;
+	if (text_field(r, ";", &f) < 0) return -1;
+	row->id = text_num(&f);
+	if (text_field(r, ";", &row->item_name) < 0) return -1;
+	if (text_field(r, "\n", &f) < 0) return -1;
+	row->bid = text_num(&f);
+	return 0;
+}
+
+int wire_usrsales_next(rbuf_t *r, int version, usrhist_row_t *row) {
+	if (version == PETR_V2) {
+		if (rbuf_get_u32(r, &row->id) < 0) return -1;
+		if (rbuf_get_str(r, &row->item_name) < 0) return -1;
+		if (rbuf_get_str(r, &row->winner) < 0) return -1;
+		return rbuf_get_u64(r, &row->bid);
+	}
+	wstr_t f;
+	if (text_field(r, ";", &f) < 0) return -1;
+	row->id = text_num(&f);
+	if (text_field(r, ";", &row->item_name) < 0) return -1;
+	if (text_field(r, ";", &row->winner) < 0) return -1;
+	if (text_field(r, "\n", &f) < 0) return -1;
+	row->bid = text_num(&f);
+	if (row->winner.len == 4 && !memcmp(row->winner.ptr, "None", 4)) {
+		row->winner.len = 0;
+	}
+	return 0;
+}
+
+int wire_anupdate_decode(rbuf_t *r, int version, anupdate_t *m) {
+	if (version == PETR_V2) {
+		if (rbuf_get_u32(r, &m->id) < 0) return -1;
+		if (rbuf_get_str(r, &m->item_name) < 0) return -1;
+		if (rbuf_get_str(r, &m->bidder) < 0) return -1;
+		return rbuf_get_u64(r, &m->bid);
+	}
+	wstr_t f;
+	if (text_field(r, "\r\n", &f) < 0) return -1;
+	m->id = text_num(&f);
+	if (text_field(r, "\r\n", &m->item_name) < 0) return -1;
+	if (text_field(r, "\r\n", &m->bidder) < 0) return -1;
+	if (text_field(r, "\r\n", &f) < 0) return -1;
+	m->bid = text_num(&f);
+	return 0;
+}
+
+int wire_anclosed_decode(rbuf_t *r, int version, anclosed_t *m) {
+	if (version == PETR_V2) {
+		if (rbuf_get_u32(r, &m->id) < 0) return -1;
+		if (rbuf_get_str(r, &m->winner) < 0) return -1;
+		return rbuf_get_u64(r, &m->bid);
+	}
+	wstr_t f;
+	if (text_field(r, "\r\n", &f) < 0) return -1;
+	m->id = text_num(&f);
+	text_field_opt(r, "\r\n", &m->winner);
+	text_field_opt(r, "\r\n", &f);
+	m->bid = text_num(&f);
+	return 0;
+}
+
+void wire_bidbatch(wbuf_t *b, unsigned int *ids, unsigned long *amounts, uint32_t n) {
+	uint32_t i;
+	for (i = 0; i < n; i++) {
+		if (i) wbuf_put_bytes(b, "\r\n", 2);
+		wbuf_put_dec(b, ids[i]);
+		wbuf_put_bytes(b, "\r\n", 2);
+		wbuf_put_dec(b, amounts[i]);
+	}
+	if (n) wbuf_put_u8(b, '\0');
+}
+
+void wire_bidresults(wbuf_t *b, int version, uint8_t *results, uint32_t n) {
+	uint32_t i;
+	if (version == PETR_V2) {
+		wbuf_put_u32(b, n);
+		wbuf_put_bytes(b, (char *)results, n);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (i) wbuf_put_u8(b, ';');
+		wbuf_put_dec(b, results[i]);
+	}
+	if (n) wbuf_put_u8(b, '\0');
+}
+
+int wire_bidresults_decode(rbuf_t *r, int version, uint8_t *results, uint32_t max, uint32_t *n) {
+	*n = 0;
+	if (version == PETR_V2) {
+		uint32_t count, i;
+		if (rbuf_get_u32(r, &count) < 0) return -1;
+		for (i = 0; i < count; i++) {
+			uint8_t v;
+			if (rbuf_get_u8(r, &v) < 0) return -1;
+			if (i < max) results[(*n)++] = v;
+		}
+		return 0;
+	}
+	wstr_t f;
+	while (text_field(r, ";", &f) == 0) {
+		if (*n < max) results[(*n)++] = text_num(&f);
+	}
+	return 0;
+}
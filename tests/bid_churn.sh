@@ -0,0 +1,33 @@
+#!/bin/sh
+# Connections that bid once and log out, far more of them over the run than
+# the server has RCU reader slots (RCU_MAX_READERS): the server must outlive
+# them all. Run from the repository root after make (make check does both).
+
+PORT=${CHECK_PORT:-4321}
+
+./bin/zbid_server $PORT rsrc/auction1.txt > /dev/null 2>&1 &
+SERVER=$!
+sleep 0.5
+
+OUT=$(./bin/zbid_loadgen -c 8 -T 2 -d 3 -s loginbid $PORT)
+echo "$OUT"
+
+FAIL=0
+if ! kill -0 $SERVER 2> /dev/null; then
+	echo "FAIL: the server died"
+	FAIL=1
+fi
+BIDS=$(echo "$OUT" | awk '$1 == "ANBID" { print $2 }')
+if [ "${BIDS:-0}" -le 512 ]; then
+	echo "FAIL: only ${BIDS:-0} bidding connections, expected more than 512"
+	FAIL=1
+fi
+if ! echo "$OUT" | grep -q " 0 unexpected disconnects"; then
+	echo "FAIL: connections were dropped"
+	FAIL=1
+fi
+
+kill -INT $SERVER 2> /dev/null
+wait $SERVER 2> /dev/null
+[ $FAIL -eq 0 ] && echo "PASS: bid_churn"
+exit $FAIL
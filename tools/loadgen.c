@@ -0,0 +1,562 @@
+// Load generator for zbid_server: simulates many concurrent PETR clients
+// and reports throughput and latency percentiles per message type.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "histogram.h"
+
+#define MAX_EVENTS 256
+#define MAX_HOT 64
+#define HOT_DURATION 1000000
+
+#define USAGE_MSG "./bin/zbid_loadgen [-h] [-c N] [-T N] [-d S] [-s SCENARIO] [-m MIX] [-a N] [-w US] [-2] [-H HOST] PORT_NUMBER\n\n\
+-h				Displays this help menu, and returns EXIT_SUCCESS\n\
+-c N				Number of concurrent client connections. Default 100.\n\
+-T N				Number of load generator threads. Default 4.\n\
+-d S				Run for S seconds. Default 10.\n\
+-s SCENARIO			login, loginbid, poll, bidwar, churn, reconnect or mixed. Default mixed.\n\
+-m MIX				Custom request mix overriding the scenario, e.g. list=4,bid=4,watch=1,blnc=1,wins=1\n\
+-a N				Number of hot auctions created for bidding/watching. Default 3.\n\
+-w US				Think time between requests of one connection, in microseconds. Default 0.\n\
+-2				Negotiate PETR v2 (binary) bodies at LOGIN.\n\
+-H HOST				Server address. Default 127.0.0.1.\n\
+PORT_NUMBER			Port the server is listening on\n"
+
+enum ops { OP_LIST, OP_BID, OP_WATCH, OP_BLNC, OP_WINS, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = { "list", "bid", "watch", "blnc", "wins" };
+
+enum conn_states { ST_CONNECTING, ST_LOGIN, ST_SETUP, ST_RUN, ST_LOGOUT };
+
+typedef struct {
+	int fd;
+	int id;
+	int state;
+	int setup_i;          // next hot auction to ANWATCH during ST_SETUP
+	int watched;          // auction ANWATCHed by the churn op, 0 if none
+	int restart;          // LOGIN was refused, reconnect
+	char token[64];       // session token of the last LOGIN, "" if none
+	uint8_t pending;      // type of the outstanding request, 0 if idle
+	uint64_t sent_at;
+	uint64_t next_at;     // earliest time of the next request (think time)
+	char *rbuf;
+	size_t rlen, rcap;
+} conn_t;
+
+typedef struct {
+	histogram_t *lat[256];  // request latency by request msg_type
+	uint64_t errors[256];   // error replies by request msg_type
+	uint64_t notifications; // ANUPDATE/ANCLOSED broadcasts received
+	uint64_t disconnects;
+} stats_t;
+
+typedef struct {
+	int index;
+	int first_conn, num_conns;
+	stats_t stats;
+} worker_t;
+
+// Configuration
+static struct sockaddr_in servaddr;
+static int num_conns = 100, num_threads = 4, duration = 10, num_hot = 3;
+static int think_us = 0, proto = PETR_V1, login_storm = 0, reconnect_storm = 0, storm_bid = 0;
+static int weights[NUM_OPS];
+static int total_weight;
+
+static unsigned int hot_ids[MAX_HOT];
+static atomic_ulong next_bid = 1;
+static uint64_t deadline;
+
+static conn_t *conns;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int send_frame(int fd, uint8_t type, const char *body) {
+	char frame[1024];
+	uint32_t len = body ? strlen(body) + 1 : 0;
+	petr_header *h = (petr_header *)frame;
+	h->msg_len = len;
+	h->msg_type = type;
+	if (len) memcpy(frame + sizeof(petr_header), body, len);
+	return (send(fd, frame, sizeof(petr_header) + len, MSG_NOSIGNAL) < 0) ? -1 : 0;
+}
+
+/* Blocking request/reply, used by the setup connection only */
+static int request(int fd, uint8_t type, const char *body, char *reply, size_t cap) {
+	if (send_frame(fd, type, body) < 0) return -1;
+	while (1) {
+		petr_header h;
+		if (recv(fd, &h, sizeof(h), MSG_WAITALL) != sizeof(h)) return -1;
+		char tmp[4096];
+		char *dst = (h.msg_len <= cap) ? reply : tmp;
+		if (h.msg_len > sizeof(tmp) && dst == tmp) return -1;
+		if (h.msg_len && recv(fd, dst, h.msg_len, MSG_WAITALL) != h.msg_len) return -1;
+		if (h.msg_type == ANUPDATE || h.msg_type == ANCLOSED) continue;
+		return h.msg_type;
+	}
+}
+
+/* Creates the hot auctions that bidding and watching target */
+static void setup_auctions() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct timeval tv = { 5, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	char body[256], reply[256];
+	sprintf(body, "lg%d_seller\r\nloadgen", getpid());
+	if (request(fd, LOGIN, body, reply, sizeof(reply)) != OK) {
+		fprintf(stderr, "setup LOGIN failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int i;
+	for (i = 0; i < num_hot; i++) {
+		sprintf(body, "loadgen item %d\r\n%d\r\n0", i, HOT_DURATION);
+		if (request(fd, ANCREATE, body, reply, sizeof(reply)) != ANCREATE) {
+			fprintf(stderr, "setup ANCREATE failed\n");
+			exit(EXIT_FAILURE);
+		}
+		hot_ids[i] = atoi(reply);
+	}
+	request(fd, LOGOUT, NULL, reply, sizeof(reply));
+	close(fd);
+}
+
+static void conn_start(conn_t *c, int epfd) {
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->state = ST_CONNECTING;
+	c->setup_i = 0;
+	c->watched = 0;
+	c->restart = 0;
+	c->pending = 0;
+	c->rlen = 0;
+	c->next_at = 0;
+	c->sent_at = now_ns();
+
+	connect(c->fd, (struct sockaddr *)&servaddr, sizeof(servaddr));
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void conn_stop(conn_t *c, int epfd) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void issue(conn_t *c, uint8_t type, const char *body) {
+	c->pending = type;
+	c->sent_at = now_ns();
+	if (send_frame(c->fd, type, body) < 0) c->pending = 0;
+}
+
+static void issue_next(conn_t *c) {
+	char body[128];
+
+	if (login_storm) {
+		// loginbid: one bid on every connection before the LOGOUT
+		if (storm_bid && c->state == ST_SETUP) {
+			c->state = ST_RUN;
+			sprintf(body, "%u\r\n%lu", hot_ids[rand() % num_hot], atomic_fetch_add(&next_bid, 1));
+			issue(c, ANBID, body);
+			return;
+		}
+		issue(c, LOGOUT, NULL);
+		c->state = ST_LOGOUT;
+		return;
+	}
+
+	if (c->state == ST_SETUP) {
+		if (c->setup_i < num_hot && weights[OP_BID]) {
+			sprintf(body, "%u", hot_ids[c->setup_i++]);
+			issue(c, ANWATCH, body);
+			return;
+		}
+		c->state = ST_RUN;
+	}
+
+	if (reconnect_storm) {
+		// Drops the connection without LOGOUT, the next one resumes
+		c->restart = 1;
+		return;
+	}
+
+	int pick = rand() % total_weight;
+	int op = 0;
+	while (pick >= weights[op]) pick -= weights[op++];
+
+	unsigned int hot = hot_ids[rand() % num_hot];
+	switch (op) {
+		case OP_LIST:
+			issue(c, ANLIST, NULL);
+			break;
+		case OP_BID:
+			sprintf(body, "%u\r\n%lu", hot, atomic_fetch_add(&next_bid, 1));
+			issue(c, ANBID, body);
+			break;
+		case OP_WATCH:
+			// Alternates ANWATCH and ANLEAVE
+			if (c->watched) {
+				sprintf(body, "%u", c->watched);
+				c->watched = 0;
+				issue(c, ANLEAVE, body);
+			}
+			else {
+				sprintf(body, "%u", hot);
+				c->watched = hot;
+				issue(c, ANWATCH, body);
+			}
+			break;
+		case OP_BLNC:
+			issue(c, USRBLNC, NULL);
+			break;
+		case OP_WINS:
+			issue(c, USRWINS, NULL);
+			break;
+	}
+}
+
+static void handle_frame(worker_t *w, conn_t *c, uint8_t type, const char *body, uint32_t len) {
+	if (type == ANUPDATE || type == ANCLOSED) {
+		w->stats.notifications++;
+		return;
+	}
+	if (!c->pending) return;
+
+	uint8_t req = c->pending;
+	uint64_t t = now_ns();
+	if (!w->stats.lat[req]) {
+		w->stats.lat[req] = malloc(sizeof(histogram_t));
+		hist_init(w->stats.lat[req]);
+	}
+	hist_record(w->stats.lat[req], t - c->sent_at);
+	if (type != OK && type != req) w->stats.errors[req]++;
+	c->pending = 0;
+
+	if (c->state == ST_LOGIN) {
+		// The server keeps refused connections open (e.g. EUSRLGDIN)
+		c->state = (type != OK) ? ST_LOGOUT : (req == RESUME) ? ST_RUN : ST_SETUP;
+		c->restart = (type != OK);
+		if (type == OK && len > 0 && len < sizeof(c->token) && body[len - 1] == '\0') memcpy(c->token, body, len);
+		else if (req == RESUME) c->token[0] = '\0';
+	}
+	c->next_at = t + think_us * 1000ULL;
+}
+
+/* Parses every complete frame in the connection's receive buffer */
+static int conn_read(worker_t *w, conn_t *c) {
+	int closed = 0;
+	while (1) {
+		if (c->rcap - c->rlen < 4096) {
+			c->rcap *= 2;
+			c->rbuf = realloc(c->rbuf, c->rcap);
+		}
+		ssize_t n = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n <= 0) {
+			// Frames received before the close (e.g. LOGOUT's OK) still count
+			closed = 1;
+			break;
+		}
+		c->rlen += n;
+	}
+
+	size_t off = 0;
+	while (c->rlen - off >= sizeof(petr_header)) {
+		petr_header *h = (petr_header *)(c->rbuf + off);
+		if (c->rlen - off < sizeof(petr_header) + h->msg_len) break;
+		handle_frame(w, c, h->msg_type, (char *)(h + 1), h->msg_len);
+		off += sizeof(petr_header) + h->msg_len;
+	}
+	memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+	c->rlen -= off;
+	return closed ? -1 : 0;
+}
+
+static void *worker_thread(void *arg) {
+	worker_t *w = (worker_t *)arg;
+	int epfd = epoll_create1(0);
+	struct epoll_event events[MAX_EVENTS];
+	int i;
+
+	for (i = 0; i < w->num_conns; i++) conn_start(&conns[w->first_conn + i], epfd);
+
+	while (now_ns() < deadline) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, 1);
+		for (i = 0; i < n; i++) {
+			conn_t *c = events[i].data.ptr;
+			if (c->fd < 0) continue;
+
+			if (c->state == ST_CONNECTING && (events[i].events & EPOLLOUT)) {
+				struct epoll_event ev;
+				ev.events = EPOLLIN;
+				ev.data.ptr = c;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+
+				char body[128];
+				int type = LOGIN;
+				if (reconnect_storm && c->token[0]) {
+					sprintf(body, "lg%d_%d\r\n%s", getpid(), c->id, c->token);
+					type = RESUME;
+				}
+				else {
+					// The reconnect scenario asks for a session token
+					const char *fields = (proto == PETR_V2) ? "\r\n2" : "";
+					if (reconnect_storm) fields = (proto == PETR_V2) ? "\r\n2\r\nresume" : "\r\n1\r\nresume";
+					sprintf(body, "lg%d_%d\r\nloadgen%s", getpid(), c->id, fields);
+				}
+				uint64_t started = c->sent_at;
+				c->state = ST_LOGIN;
+				issue(c, type, body);
+				c->sent_at = started; // LOGIN latency includes the TCP connect
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				if (conn_read(w, c) < 0) {
+					// Closed by the server: expected after LOGOUT, otherwise count it
+					if (c->state != ST_LOGOUT) w->stats.disconnects++;
+					conn_stop(c, epfd);
+					if (login_storm || reconnect_storm) conn_start(c, epfd);
+				}
+			}
+		}
+
+		uint64_t t = now_ns();
+		for (i = 0; i < w->num_conns; i++) {
+			conn_t *c = &conns[w->first_conn + i];
+			if (c->fd < 0 || c->pending || t < c->next_at) continue;
+			if (c->restart) {
+				conn_stop(c, epfd);
+				conn_start(c, epfd);
+				continue;
+			}
+			if (c->state == ST_SETUP || c->state == ST_RUN) issue_next(c);
+		}
+	}
+
+	for (i = 0; i < w->num_conns; i++) {
+		if (conns[w->first_conn + i].fd >= 0) conn_stop(&conns[w->first_conn + i], epfd);
+	}
+	close(epfd);
+	return NULL;
+}
+
+static const char *type_name(int type) {
+	switch (type) {
+		case LOGIN: return "LOGIN";
+		case LOGOUT: return "LOGOUT";
+		case RESUME: return "RESUME";
+		case ANLIST: return "ANLIST";
+		case ANWATCH: return "ANWATCH";
+		case ANLEAVE: return "ANLEAVE";
+		case ANBID: return "ANBID";
+		case USRBLNC: return "USRBLNC";
+		case USRWINS: return "USRWINS";
+		default: return "OTHER";
+	}
+}
+
+static void report(worker_t *workers, double elapsed) {
+	int t, i;
+	uint64_t notifications = 0, disconnects = 0, total = 0;
+
+	printf("%-10s %10s %8s %10s %10s %10s %10s %10s %10s\n",
+	       "TYPE", "COUNT", "ERRORS", "OPS/S", "MEAN(us)", "P50(us)", "P99(us)", "P999(us)", "MAX(us)");
+	for (t = 0; t < 256; t++) {
+		histogram_t merged;
+		uint64_t errors = 0;
+		int found = 0;
+		hist_init(&merged);
+		for (i = 0; i < num_threads; i++) {
+			if (!workers[i].stats.lat[t]) continue;
+			hist_merge(&merged, workers[i].stats.lat[t]);
+			errors += workers[i].stats.errors[t];
+			found = 1;
+		}
+		if (!found) continue;
+		total += merged.total;
+		printf("%-10s %10lu %8lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", type_name(t),
+		       merged.total, errors, merged.total / elapsed, hist_mean(&merged) / 1e3,
+		       hist_percentile(&merged, 50) / 1e3, hist_percentile(&merged, 99) / 1e3,
+		       hist_percentile(&merged, 99.9) / 1e3, merged.max / 1e3);
+	}
+	for (i = 0; i < num_threads; i++) {
+		notifications += workers[i].stats.notifications;
+		disconnects += workers[i].stats.disconnects;
+	}
+	printf("\n%lu requests in %.2fs (%.0f req/s), %lu notifications, %lu unexpected disconnects\n",
+	       total, elapsed, total / elapsed, notifications, disconnects);
+}
+
+static void set_scenario(char *name) {
+	memset(weights, 0, sizeof(weights));
+	if (!strcmp(name, "login")) {
+		login_storm = 1;
+		weights[OP_LIST] = 1;
+	}
+	else if (!strcmp(name, "loginbid")) {
+		login_storm = 1;
+		storm_bid = 1;
+		weights[OP_BID] = 1;
+	}
+	else if (!strcmp(name, "poll")) weights[OP_LIST] = 1;
+	else if (!strcmp(name, "bidwar")) weights[OP_BID] = 1;
+	else if (!strcmp(name, "churn")) weights[OP_WATCH] = 1;
+	else if (!strcmp(name, "reconnect")) {
+		// Watches the hot auctions once, then reconnects over and over
+		reconnect_storm = 1;
+		weights[OP_BID] = 1;
+	}
+	else if (!strcmp(name, "mixed")) {
+		weights[OP_LIST] = 4;
+		weights[OP_BID] = 4;
+		weights[OP_WATCH] = 1;
+		weights[OP_BLNC] = 1;
+	}
+	else {
+		fprintf(stderr, "Unknown scenario %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void set_mix(char *mix) {
+	memset(weights, 0, sizeof(weights));
+	char *tok = strtok(mix, ",");
+	while (tok) {
+		char *eq = strchr(tok, '=');
+		int op;
+		if (!eq) break;
+		*eq = '\0';
+		for (op = 0; op < NUM_OPS; op++) {
+			if (!strcmp(tok, op_names[op])) weights[op] = atoi(eq + 1);
+		}
+		tok = strtok(NULL, ",");
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	char *host = "127.0.0.1";
+	char *mix = NULL;
+	set_scenario("mixed");
+
+	while ((opt = getopt(argc, argv, "hc:T:d:s:m:a:w:2H:")) != -1) {
+		switch (opt) {
+			case 'h':
+				fprintf(stdout, USAGE_MSG);
+				return EXIT_SUCCESS;
+			case 'c':
+				num_conns = atoi(optarg);
+				break;
+			case 'T':
+				num_threads = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 's':
+				set_scenario(optarg);
+				break;
+			case 'm':
+				mix = optarg;
+				break;
+			case 'a':
+				num_hot = atoi(optarg);
+				break;
+			case 'w':
+				think_us = atoi(optarg);
+				break;
+			case '2':
+				proto = PETR_V2;
+				break;
+			case 'H':
+				host = optarg;
+				break;
+			default:
+				fprintf(stderr, USAGE_MSG);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, USAGE_MSG);
+		return EXIT_FAILURE;
+	}
+	if (mix) set_mix(mix);
+	if (num_hot < 1) num_hot = 1;
+	if (num_hot > MAX_HOT) num_hot = MAX_HOT;
+	if (num_threads > num_conns) num_threads = num_conns;
+
+	int op;
+	total_weight = 0;
+	for (op = 0; op < NUM_OPS; op++) total_weight += weights[op];
+	if (total_weight <= 0) {
+		fprintf(stderr, "Empty request mix\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = htons(atoi(argv[optind]));
+	inet_pton(AF_INET, host, &servaddr.sin_addr);
+
+	setup_auctions();
+
+	int i;
+	conns = calloc(num_conns, sizeof(conn_t));
+	for (i = 0; i < num_conns; i++) {
+		conns[i].id = i;
+		conns[i].fd = -1;
+		conns[i].rcap = 8192;
+		conns[i].rbuf = malloc(conns[i].rcap);
+	}
+
+	worker_t *workers = calloc(num_threads, sizeof(worker_t));
+	pthread_t *tids = malloc(num_threads * sizeof(pthread_t));
+	uint64_t start = now_ns();
+	deadline = start + duration * 1000000000ULL;
+	for (i = 0; i < num_threads; i++) {
+		workers[i].index = i;
+		workers[i].first_conn = i * num_conns / num_threads;
+		workers[i].num_conns = (i + 1) * num_conns / num_threads - workers[i].first_conn;
+		pthread_create(&tids[i], NULL, worker_thread, &workers[i]);
+	}
+	for (i = 0; i < num_threads; i++) pthread_join(tids[i], NULL);
+
+	report(workers, (now_ns() - start) / 1e9);
+
+	for (i = 0; i < num_threads; i++) {
+		int t;
+		for (t = 0; t < 256; t++) free(workers[i].stats.lat[t]);
+	}
+	for (i = 0; i < num_conns; i++) free(conns[i].rbuf);
+	free(conns);
+	free(workers);
+	free(tids);
+	return EXIT_SUCCESS;
+}
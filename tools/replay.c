@@ -0,0 +1,490 @@
+// Replays a traffic capture (zbid_server -C FILE) against a server and
+// reports latency percentiles per message type, like zbid_loadgen.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "histogram.h"
+#include "capture.h"
+
+#define MAX_EVENTS 256
+#define MAX_INFLIGHT 64
+#define DRAIN_NS 5000000000ULL
+#define TOKEN_BUCKETS 1024
+
+#define USAGE_MSG "./bin/zbid_replay [-h] [-F] [-x SPEED] [-H HOST] CAPTURE_FILE PORT_NUMBER\n\n\
+-h				Displays this help menu, and returns EXIT_SUCCESS\n\
+-F				Send as fast as possible: each connection sends its next frame\n\
+				as soon as the previous one is answered. By default frames are\n\
+				sent at their captured times, whether answered or not.\n\
+-x SPEED			Speeds the captured timeline up by SPEED, e.g. 2 or 0.5. Default 1.\n\
+-H HOST				Server address. Default 127.0.0.1.\n\
+CAPTURE_FILE			File written by zbid_server -C\n\
+PORT_NUMBER			Port the server is listening on\n"
+
+typedef struct {
+	capture_rec_t rec;
+	char *body;
+	int next; // next event of the same connection, -1 if none
+} event_t;
+
+typedef struct {
+	int fd;
+	int state;
+	int head, tail;   // events dispatched to the connection and not yet sent
+	uint8_t types[MAX_INFLIGHT]; // outstanding requests, oldest first
+	uint64_t sent_at[MAX_INFLIGHT];
+	int inflight;
+	char *rbuf;
+	size_t rlen, rcap;
+	char *user; // from the LOGIN or RESUME that opened it
+} conn_t;
+
+// The session token this replay's server gave the user at its last LOGIN,
+// and the user's latest connection
+typedef struct token {
+	char *user;
+	char *token;
+	conn_t *conn;
+	struct token *next;
+} token_t;
+
+enum conn_states { ST_IDLE, ST_OPEN, ST_CLOSING, ST_DONE };
+
+typedef struct {
+	histogram_t *lat[256];  // request latency by request msg_type
+	uint64_t errors[256];   // error replies by request msg_type
+	uint64_t notifications; // ANUPDATE/ANCLOSED broadcasts received
+	uint64_t disconnects;
+	uint64_t unanswered;
+} stats_t;
+
+static struct sockaddr_in servaddr;
+static int fast = 0;
+static double speed = 1;
+
+static event_t *events;
+static int num_events;
+static conn_t *conns;
+static uint32_t num_conns;
+static int draining; // connections told to close with frames still to send or answer
+static token_t *tokens[TOKEN_BUCKETS];
+static stats_t stats;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Reads the whole capture and links every connection's events */
+static void load(const char *path) {
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	char magic[8];
+	uint64_t wall;
+	if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) || fread(&wall, sizeof(wall), 1, fp) != 1) {
+		fprintf(stderr, "%s is not a capture file\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	int cap = 1024;
+	events = malloc(cap * sizeof(event_t));
+	capture_rec_t rec;
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		char *body = NULL;
+		if (rec.len) {
+			body = malloc(rec.len);
+			// The server stopped mid-record: replay what was complete
+			if (fread(body, 1, rec.len, fp) != rec.len) {
+				free(body);
+				break;
+			}
+		}
+		if (num_events == cap) {
+			cap *= 2;
+			events = realloc(events, cap * sizeof(event_t));
+		}
+		events[num_events].rec = rec;
+		events[num_events].body = body;
+		events[num_events].next = -1;
+		num_events++;
+		if (rec.conn >= num_conns) num_conns = rec.conn + 1;
+	}
+	fclose(fp);
+
+	conns = calloc(num_conns, sizeof(conn_t));
+	uint32_t i;
+	for (i = 0; i < num_conns; i++) {
+		conns[i].fd = -1;
+		conns[i].head = conns[i].tail = -1;
+	}
+	printf("%d records, %u connections, %.2fs captured\n", num_events, num_conns ? num_conns - 1 : 0,
+	       num_events ? events[num_events - 1].rec.ns / 1e9 : 0);
+}
+
+static token_t *token_of(const char *user) {
+	uint32_t h = 2166136261u;
+	const char *p;
+	for (p = user; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+	token_t **t = &tokens[h % TOKEN_BUCKETS];
+	while (*t && strcmp((*t)->user, user)) t = &(*t)->next;
+	if (!*t) {
+		*t = calloc(1, sizeof(token_t));
+		(*t)->user = strdup(user);
+	}
+	return *t;
+}
+
+/* The captured token was the capturing server's: the RESUME carries the one
+ * this replay got for the user instead (if none, it is refused) */
+static void resume_token(conn_t *c, event_t *e) {
+	token_t *t = token_of(c->user);
+	if (!t->token) return;
+	size_t len = strlen(c->user) + 2 + strlen(t->token) + 1;
+	char *body = malloc(len);
+	snprintf(body, len, "%s\r\n%s", c->user, t->token);
+	free(e->body);
+	e->body = body;
+	e->rec.len = len;
+}
+
+static void conn_open(conn_t *c, int epfd) {
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(c->fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+	c->state = ST_OPEN;
+	c->rcap = 8192;
+	c->rbuf = malloc(c->rcap);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void conn_close(conn_t *c, int epfd) {
+	if (c->state == ST_CLOSING) draining--;
+	if (c->fd >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		close(c->fd);
+	}
+	stats.unanswered += c->inflight;
+	c->inflight = 0;
+	c->fd = -1;
+	c->state = ST_DONE;
+	c->head = -1;
+	free(c->rbuf);
+	c->rbuf = NULL;
+	if (c->user && token_of(c->user)->conn == c) token_of(c->user)->conn = NULL;
+	free(c->user);
+	c->user = NULL;
+}
+
+static int send_frame(conn_t *c, event_t *e) {
+	char stack[1024];
+	size_t size = sizeof(petr_header) + e->rec.len;
+	char *frame = (size <= sizeof(stack)) ? stack : malloc(size);
+	petr_header *h = (petr_header *)frame;
+	h->msg_len = e->rec.len;
+	h->msg_type = e->rec.type;
+	if (e->rec.len) memcpy(frame + sizeof(petr_header), e->body, e->rec.len);
+	// Blocks if the server stops reading, like a real client would
+	size_t off = 0;
+	while (off < size) {
+		ssize_t n = send(c->fd, frame + off, size - off, MSG_NOSIGNAL);
+		if (n < 0 && errno == EAGAIN) continue;
+		if (n <= 0) break;
+		off += n;
+	}
+	if (frame != stack) free(frame);
+	return (off == size) ? 0 : -1;
+}
+
+/* Sends the connection's dispatched frames, one at a time in -F mode */
+static void pump(conn_t *c, int epfd) {
+	if (c->state == ST_CLOSING && c->head < 0 && !c->inflight) {
+		conn_close(c, epfd);
+		return;
+	}
+	while (c->head >= 0 && c->state != ST_DONE) {
+		if (c->inflight == MAX_INFLIGHT || (fast && c->inflight)) return;
+		event_t *e = &events[c->head];
+		if (e->rec.kind == CAP_CLOSE) {
+			// The client left once its last request was answered (LOGOUT)
+			// or dropped the connection
+			if (c->inflight) return;
+			conn_close(c, epfd);
+			return;
+		}
+		c->head = e->next;
+		if ((e->rec.kind == CAP_LOGIN || e->rec.kind == CAP_RESUME) && c->fd < 0) {
+			conn_open(c, epfd);
+			c->user = (e->body) ? strndup(e->body, strcspn(e->body, "\r\n")) : strdup("");
+			token_of(c->user)->conn = c;
+		}
+		if (e->rec.kind == CAP_RESUME) resume_token(c, e);
+		// The server closes the connection after answering
+		if (e->rec.type == LOGOUT && c->state == ST_OPEN) {
+			c->state = ST_CLOSING;
+			draining++;
+		}
+		if (send_frame(c, e) < 0) {
+			stats.disconnects++;
+			conn_close(c, epfd);
+			return;
+		}
+		c->types[c->inflight] = e->rec.type;
+		c->sent_at[c->inflight] = now_ns();
+		c->inflight++;
+	}
+}
+
+/* A RESUME takes the session over from the user's connection if the server
+ * had not seen that one close yet (its CAP_CLOSE is captured later): it is
+ * closed first, once its requests are answered. Returns 1 if the RESUME has
+ * to wait for that. */
+static int takes_over(event_t *e, int epfd) {
+	char *user = (e->body) ? strndup(e->body, strcspn(e->body, "\r\n")) : strdup("");
+	conn_t *c = token_of(user)->conn;
+	free(user);
+	if (!c || c->state != ST_OPEN) return 0;
+	c->state = ST_CLOSING;
+	draining++;
+	pump(c, epfd);
+	return 1;
+}
+
+/* Hands event i to its connection */
+static void dispatch(int i, int epfd) {
+	event_t *e = &events[i];
+	conn_t *c = &conns[e->rec.conn];
+	if (c->state == ST_DONE) return;
+	if (c->tail >= 0) events[c->tail].next = i;
+	c->tail = i;
+	if (c->head < 0) c->head = i;
+	if (e->rec.kind == CAP_CLOSE && c->state != ST_CLOSING) {
+		c->state = ST_CLOSING;
+		draining++;
+	}
+	pump(c, epfd);
+}
+
+/* Matches a reply with the oldest outstanding request it can answer: replies
+ * of one connection come back in order, except that requests running on
+ * different job lanes may overtake each other */
+static void handle_frame(conn_t *c, uint8_t type, char *body, uint32_t len) {
+	if (type == ANUPDATE || type == ANCLOSED) {
+		stats.notifications++;
+		return;
+	}
+	if (!c->inflight) return;
+
+	int i;
+	for (i = 0; i < c->inflight && c->types[i] != type; i++);
+	if (i == c->inflight) i = 0;
+
+	uint8_t req = c->types[i];
+	if (!stats.lat[req]) {
+		stats.lat[req] = malloc(sizeof(histogram_t));
+		hist_init(stats.lat[req]);
+	}
+	hist_record(stats.lat[req], now_ns() - c->sent_at[i]);
+	if (type != OK && type != req) stats.errors[req]++;
+	memmove(&c->types[i], &c->types[i + 1], c->inflight - i - 1);
+	memmove(&c->sent_at[i], &c->sent_at[i + 1], (c->inflight - i - 1) * sizeof(uint64_t));
+	c->inflight--;
+
+	// A LOGIN that asked for a session is answered with its token
+	if (req == LOGIN && type == OK && len && !body[len - 1]) {
+		token_t *t = token_of(c->user);
+		free(t->token);
+		t->token = strdup(body);
+	}
+
+	// A refused LOGIN or RESUME sends nothing more: its next attempt is a
+	// new connection
+	if ((req == LOGIN || req == RESUME) && type != OK && c->state == ST_OPEN) {
+		c->head = -1;
+		c->state = ST_CLOSING;
+		draining++;
+	}
+}
+
+static int conn_read(conn_t *c) {
+	int closed = 0;
+	while (1) {
+		if (c->rcap - c->rlen < 4096) {
+			c->rcap *= 2;
+			c->rbuf = realloc(c->rbuf, c->rcap);
+		}
+		ssize_t n = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n <= 0) {
+			closed = 1;
+			break;
+		}
+		c->rlen += n;
+	}
+
+	size_t off = 0;
+	while (c->rlen - off >= sizeof(petr_header)) {
+		petr_header *h = (petr_header *)(c->rbuf + off);
+		if (c->rlen - off < sizeof(petr_header) + h->msg_len) break;
+		handle_frame(c, h->msg_type, c->rbuf + off + sizeof(petr_header), h->msg_len);
+		off += sizeof(petr_header) + h->msg_len;
+	}
+	memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+	c->rlen -= off;
+	return closed ? -1 : 0;
+}
+
+static const char *type_name(int type) {
+	switch (type) {
+		case LOGIN: return "LOGIN";
+		case RESUME: return "RESUME";
+		case LOGOUT: return "LOGOUT";
+		case ANCREATE: return "ANCREATE";
+		case ANLIST: return "ANLIST";
+		case ANWATCH: return "ANWATCH";
+		case ANLEAVE: return "ANLEAVE";
+		case ANBID: return "ANBID";
+		case ANBIDBATCH: return "ANBIDBATCH";
+		case ANPROXY: return "ANPROXY";
+		case USRLIST: return "USRLIST";
+		case USRWINS: return "USRWINS";
+		case USRSALES: return "USRSALES";
+		case USRBLNC: return "USRBLNC";
+		default: return "OTHER";
+	}
+}
+
+static void report(double elapsed) {
+	int t;
+	uint64_t total = 0;
+
+	printf("%-10s %10s %8s %10s %10s %10s %10s %10s %10s\n",
+	       "TYPE", "COUNT", "ERRORS", "OPS/S", "MEAN(us)", "P50(us)", "P99(us)", "P999(us)", "MAX(us)");
+	for (t = 0; t < 256; t++) {
+		histogram_t *h = stats.lat[t];
+		if (!h) continue;
+		total += h->total;
+		printf("%-10s %10lu %8lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", type_name(t),
+		       h->total, stats.errors[t], h->total / elapsed, hist_mean(h) / 1e3,
+		       hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+		       hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+	}
+	printf("\n%lu requests in %.2fs (%.0f req/s), %lu notifications, %lu unanswered, %lu unexpected disconnects\n",
+	       total, elapsed, total / elapsed, stats.notifications, stats.unanswered, stats.disconnects);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	char *host = "127.0.0.1";
+
+	while ((opt = getopt(argc, argv, "hFx:H:")) != -1) {
+		switch (opt) {
+			case 'h':
+				fprintf(stdout, USAGE_MSG);
+				return EXIT_SUCCESS;
+			case 'F':
+				fast = 1;
+				break;
+			case 'x':
+				speed = atof(optarg);
+				break;
+			case 'H':
+				host = optarg;
+				break;
+			default:
+				fprintf(stderr, USAGE_MSG);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind + 1 >= argc || speed <= 0) {
+		fprintf(stderr, USAGE_MSG);
+		return EXIT_FAILURE;
+	}
+
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = htons(atoi(argv[optind + 1]));
+	inet_pton(AF_INET, host, &servaddr.sin_addr);
+
+	load(argv[optind]);
+
+	int epfd = epoll_create1(0);
+	struct epoll_event evs[MAX_EVENTS];
+	int next = 0, open = 1, i;
+	uint64_t start = now_ns(), last = 0;
+
+	while (open) {
+		uint64_t t = now_ns();
+		// Captured order is kept across connections, and a LOGIN or RESUME
+		// waits for the connections closed before it, which may hold the
+		// same user
+		while (next < num_events) {
+			event_t *e = &events[next];
+			if ((e->rec.kind == CAP_LOGIN || e->rec.kind == CAP_RESUME) && draining) break;
+			if (e->rec.kind == CAP_RESUME && takes_over(e, epfd)) break;
+			if (!fast && t - start < e->rec.ns / speed) break;
+			dispatch(next++, epfd);
+		}
+
+		int n = epoll_wait(epfd, evs, MAX_EVENTS, 1);
+		for (i = 0; i < n; i++) {
+			conn_t *c = evs[i].data.ptr;
+			if (c->fd < 0) continue;
+			int closed = conn_read(c);
+			if (closed) {
+				// Expected after a LOGOUT
+				if (c->state != ST_CLOSING) stats.disconnects++;
+				conn_close(c, epfd);
+			}
+			else pump(c, epfd);
+		}
+
+		// Done once every event is sent and answered, or after DRAIN_NS of
+		// waiting for replies that will not come
+		open = 0;
+		uint32_t k;
+		for (k = 0; k < num_conns; k++) {
+			if (conns[k].head >= 0 || conns[k].inflight) open = 1;
+		}
+		if (next < num_events) open = 1;
+		else if (!last) last = now_ns();
+		else if (now_ns() - last > DRAIN_NS) open = 0;
+	}
+
+	report((now_ns() - start) / 1e9);
+
+	uint32_t k;
+	for (k = 0; k < num_conns; k++) {
+		if (conns[k].fd >= 0) conn_close(&conns[k], epfd);
+	}
+	close(epfd);
+	for (i = 0; i < num_events; i++) free(events[i].body);
+	for (i = 0; i < 256; i++) free(stats.lat[i]);
+	free(events);
+	free(conns);
+	return EXIT_SUCCESS;
+}